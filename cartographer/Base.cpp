@@ -12,12 +12,24 @@ my::null_log cartographer_log;
 #include <fstream>
 #include <vector>
 #include <locale>
+#include <cstdio> /* std::sscanf */
+#include <algorithm> /* std::min, std::max, std::sort, std::find */
 
 #include <boost/bind.hpp>
 
 namespace cartographer
 {
 
+/* Сколько раз повторять запрос тайла, который сервер не прислал */
+static const int server_max_retries = 3;
+
+/* Окончательный ответ сервера на запрос тайла: тайл (200) или его
+	отсутствие (404). Остальное (503 и т.п.) - повод повторить запрос */
+static inline bool final_status(unsigned int status_code)
+{
+	return status_code == 200 || status_code == 404;
+}
+
 wxDEFINE_EVENT(MY_EVENT, wxCommandEvent);
 
 BEGIN_EVENT_TABLE(Base, wxGLCanvas)
@@ -34,7 +46,8 @@ BEGIN_EVENT_TABLE(Base, wxGLCanvas)
 END_EVENT_TABLE()
 
 Base::Base(wxWindow *parent, const std::wstring &server_addr,
-	const std::wstring &init_map, std::size_t cache_size)
+	const std::wstring &init_map, const cache_sizes &caches,
+	std::size_t server_connections, std::size_t decoder_threads)
 	: my::employer(L"Cartographer_employer", false)
 	, wxGLCanvas(parent, wxID_ANY, NULL /* attribs */,
 		wxDefaultPosition, wxDefaultSize,
@@ -43,29 +56,53 @@ Base::Base(wxWindow *parent, const std::wstring &server_addr,
 	, magic_id_(0)
 	, load_texture_debug_counter_(0)
 	, MY_MUTEX_DEF(delete_texture_mutex_,true)
+	, delete_texture_pending_(0)
 	, delete_texture_debug_counter_(0)
+	, upload_budget_bytes_(4 * 1024 * 1024)
+	, upload_budget_time_( posix_time::milliseconds(4) )
+	, upload_last_count_(0)
+	, upload_last_bytes_(0)
+	, upload_last_time_(0.0)
+	, MY_MUTEX_DEF(paint_stats_mutex_,true)
+	, tiles_scale_(0.0)
+	, http_pool_(io_service_, server_connections)
 	, cache_path_( fs::system_complete(L"cache").string() )
-	, cache_(cache_size)
-	, cache_active_tiles_(0)
+	, cache_(caches.ram, caches.gpu)
 	, basis_map_id_(0)
 	, basis_z_(0)
 	, basis_tile_x1_(0)
 	, basis_tile_y1_(0)
 	, basis_tile_x2_(0)
 	, basis_tile_y2_(0)
-	, MY_MUTEX_DEF(cache_mutex_,false)
+	, pyramid_map_id_(0)
+	, pyramid_epoch_(0)
 	, builder_debug_counter_(0)
-	, file_iterator_(cache_.end())
 	, file_loader_dbg_loop_(0)
 	, file_loader_dbg_load_(0)
-	, server_iterator_(cache_.end())
+	, file_loader_dbg_drop_(0)
+	, stores_imported_(0)
+	, index_routed_dbg_(0)
+	, MY_MUTEX_DEF(server_requests_mutex_,true)
+	, server_request_serial_(0)
+	, server_batch_size_(0)
+	, MY_MUTEX_DEF(server_replies_mutex_,true)
 	, server_loader_dbg_loop_(0)
 	, server_loader_dbg_load_(0)
+	, server_loader_dbg_drop_(0)
+	, decode_queue_limit_(0)
+	, tiles_opaque_bpp_(24)
+	, MY_MUTEX_DEF(decode_mutex_,true)
+	, decoded_count_(0)
+	, decode_errors_count_(0)
+	, unpacked_count_(0)
 	, anim_period_( posix_time::milliseconds(50) )
 	, def_min_anim_steps_(5)
 	, anim_speed_(0)
 	, anim_freq_(0)
 	, animator_debug_counter_(0)
+	, raw_limit_(caches.raw)
+	, MY_MUTEX_DEF(disk_limit_mutex_,true)
+	, disk_limit_(0)
 	, draw_tile_debug_counter_(0)
 	, MY_MUTEX_DEF(paint_mutex_,true)
 	, MY_MUTEX_DEF(params_mutex_,true)
@@ -92,6 +129,16 @@ Base::Base(wxWindow *parent, const std::wstring &server_addr,
 
 		magic_init();
 
+		/* Буферы PBO для асинхронной загрузки текстур: 16 тайлов
+			RGBA 256x256. Если OpenGL их не умеет - загрузка из ОЗУ */
+		pbo_ring_.init(16, 256 * 256 * 4);
+
+		/* VBO для вывода. Если его нет - массивы вершин в ОЗУ */
+		batch_.init();
+
+		/* Страница атласа под первые тайлы - заранее */
+		textures_.reserve(32, tiles_opaque_bpp_);
+
 		std::wstring request;
 		std::wstring file;
 
@@ -124,12 +171,15 @@ Base::Base(wxWindow *parent, const std::wstring &server_addr,
 				}
 
 				/* Резолвим сервер */
+				std::string host = my::ip::punycode_encode(addr);
+				std::string service = my::ip::punycode_encode(port);
+
 				asio::ip::tcp::resolver resolver(io_service_);
-				asio::ip::tcp::resolver::query query(
-					my::ip::punycode_encode(addr),
-					my::ip::punycode_encode(port));
+				asio::ip::tcp::resolver::query query(host, service);
 				server_endpoint_ = *resolver.resolve(query);
 
+				http_pool_.set_server(server_endpoint_, host + ":" + service);
+
 				load_and_save_xml(request, file);
 			}
 
@@ -184,6 +234,37 @@ Base::Base(wxWindow *parent, const std::wstring &server_addr,
 					карты числовому идентификатору */
 				maps_name_to_id_[map.name] = id;
 
+				/* Дисковый кэш карты. Без него тайлы
+					будут загружаться только с сервера */
+				try
+				{
+					tile_store::ptr store(new tile_store);
+					store->open(cache_path_ + L"/" + map.sid);
+					tile_stores_[id] = store;
+				}
+				catch (std::exception &e)
+				{
+					main_log << L"[cartographer] Кэш карты недоступен: "
+						<< map.sid << L": " << my::utf8::decode(e.what())
+						<< main_log;
+				}
+
+				if (raw_limit_)
+				{
+					try
+					{
+						tile_store::ptr store(new tile_store);
+						store->open(cache_path_ + L"/" + map.sid + L".raw");
+						raw_stores_[id] = store;
+					}
+					catch (std::exception &e)
+					{
+						main_log << L"[cartographer] Кэш декодированных тайлов недоступен: "
+							<< map.sid << L": " << my::utf8::decode(e.what())
+							<< main_log;
+					}
+				}
+
 				p.first++;
 			}
 		}
@@ -195,14 +276,44 @@ Base::Base(wxWindow *parent, const std::wstring &server_addr,
 				<< my::exception(e);
 		} /* Загружаем с сервера список доступных карт */
 
+		/* Запускаем декодеры - по количеству ядер, если не указано иное */
+		if (decoder_threads == 0)
+			decoder_threads = boost::thread::hardware_concurrency();
+		if (decoder_threads == 0)
+			decoder_threads = 1;
+
+		decode_queue_limit_ = decoder_threads * 4;
+
+		for (std::size_t i = 0; i < decoder_threads; ++i)
+		{
+			my::worker::ptr worker = new_worker(L"decoder", false);
+			decoders_.push_back(worker);
+			boost::thread( boost::bind(
+				&Base::decoder_proc, this, worker) );
+		}
+
 		/* Запускаем файловый загрузчик тайлов */
 		file_loader_ = new_worker(L"file_loader", false);
 		boost::thread( boost::bind(
 			&Base::file_loader_proc, this, file_loader_) );
 
-		/* Запускаем серверный загрузчик тайлов */
+		/* ... запись в дисковый кэш и его обслуживание */
+		disk_writer_ = new_worker(L"disk_writer", false);
+		boost::thread( boost::bind(
+			&Base::disk_writer_proc, this, disk_writer_) );
+
+		disk_keeper_ = new_worker(L"disk_keeper", false);
+		boost::thread( boost::bind(
+			&Base::disk_keeper_proc, this, disk_keeper_) );
+
+		/* Запускаем серверный загрузчик тайлов и поток,
+			обслуживающий асинхронные запросы к серверу */
 		if (load_from_server)
 		{
+			io_work_.reset( new asio::io_service::work(io_service_) );
+			io_thread_ = boost::thread( boost::bind(
+				&asio::io_service::run, &io_service_) );
+
 			server_loader_ = new_worker(L"server_loader", false);
 			boost::thread( boost::bind(
 				&Base::server_loader_proc, this, server_loader_) );
@@ -240,6 +351,9 @@ Base::~Base()
 
 	cache_.clear();
 	delete_textures();
+	textures_.clear();
+	pbo_ring_.deinit();
+	batch_.deinit();
 	magic_deinit();
 
 	/*TODO: assert не срабатывает! */
@@ -253,7 +367,15 @@ void Base::stop()
 
 	/* Освобождаем ("увольняем") всех "работников" */
 	dismiss(file_loader_);
-	dismiss(server_loader_);
+	dismiss(disk_writer_);
+	dismiss(disk_keeper_);
+	if (server_loader_)
+		dismiss(server_loader_);
+	for (workers_list::iterator iter = decoders_.begin();
+		iter != decoders_.end(); ++iter)
+	{
+		dismiss(*iter);
+	}
 	dismiss(animator_);
 
 	/* Ждём завершения */
@@ -262,6 +384,19 @@ void Base::stop()
 	#endif
 
 	wait_for_finish();
+
+	/* Дописываем на диск то, что осталось в очередях */
+	flush_tile_stores(tile_stores_);
+	flush_tile_stores(raw_stores_);
+
+	/* Останавливаем обработку запросов к серверу. Незавершённые
+		запросы просто бросаем */
+	if (io_thread_.joinable())
+	{
+		io_work_.reset();
+		io_service_.stop();
+		io_thread_.join();
+	}
 }
 
 void Base::update()
@@ -302,16 +437,9 @@ void Base::magic_exec()
 		Избавиться не удалось, поэтому делаем ход конём - выводим
 		в никуда белую текстуру */
 
-	glColor4d(1.0, 1.0, 1.0, 0.0);
-	glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
-
-	glBindTexture(GL_TEXTURE_2D, magic_id_);
-	glBegin(GL_QUADS);
-		glTexCoord2i(0, 0); glVertex3i( 0,  0, 0);
-		glTexCoord2i(1, 0); glVertex3i(-1,  0, 0);
-		glTexCoord2i(1, 0); glVertex3i(-1, -1, 0);
-		glTexCoord2i(0, 1); glVertex3i( 0, -1, 0);
-	glEnd();
+	batch_.add_quad( magic_id_,
+		point(0.0, 0.0), point(-1.0, 0.0), point(-1.0, -1.0), point(0.0, -1.0),
+		0.0, 0.0, 1.0, 1.0, color(1.0, 1.0, 1.0, 0.0) );
 }
 
 void Base::check_gl_error()
@@ -336,331 +464,1476 @@ void Base::check_gl_error()
 	}
 }
 
+void Base::load_texture_later(const tiles_queue::item &item)
+{
+	/* Пиксели теперь занимают память - учитываем это в кэше */
+	cache_.update(item.id);
+	load_texture_queue_.push(item.id, item.ptr, item.prio);
+}
+
 void Base::load_textures()
 {
-	shared_lock<shared_mutex> lock(cache_mutex_);
+	/* Тайлы выдаются по приоритету (видимый слой, от центра экрана),
+		поэтому при исчерпании бюджета ждут менее важные */
+	const posix_time::ptime start = my::time::utc_now();
+	std::size_t bytes = 0;
+	int count = 0;
+	tiles_queue::item item;
+
+	while (bytes < upload_budget_bytes_ && load_texture_queue_.pop(item))
+	{
+		tile::ptr &tile_ptr = item.ptr;
+
+		/* Тайл, уже вытесненный из кэша, не загружаем */
+		if (tile_ptr.unique())
+			continue;
+
+		/* Тайл покинул пирамиду - не тратим на него бюджет. Если он
+			вернётся, enqueue_tile() снова поставит его в очередь.
+			Буфер PBO ему до тех пор ни к чему - он нужен декодерам */
+		if (item.stale())
+		{
+			unload_pbo(item.id, tile_ptr);
+			continue;
+		}
+
+		if (tile_ptr->ok())
+		{
+			GLuint texture_id = tile_ptr->convert_to_gl_texture(&pbo_ring_, &textures_);
+			check_gl_error();
+
+			/* Пиксели пропали вместе с буфером PBO (драйвер потерял
+				его содержимое или текстура не создалась) - тайл
+				загружаем заново, иначе он так и остался бы пустым */
+			if (!texture_id && !tile_ptr->ok())
+			{
+				tile_ptr->set_state(tile::file_loading);
+				enqueue_tile(item.id, tile_ptr, item.prio);
+				continue;
+			}
+
+			++load_texture_debug_counter_;
+			++count;
+			bytes += tile_ptr->gpu_size();
+
+			/* Пиксели из ОЗУ переехали в видеопамять */
+			cache_.update(item.id);
+
+			if (my::time::utc_now() - start >= upload_budget_time_)
+				break;
+		}
+	}
+
+	/* Освободившиеся буферы PBO - снова декодерам */
+	pbo_ring_.prepare();
+
+	upload_last_count_ = count;
+	upload_last_bytes_ = bytes;
+	upload_last_time_ = my::time::div(
+		my::time::utc_now() - start, posix_time::milliseconds(1) );
+}
+
+void Base::snapshot_paint_stats()
+{
+	unique_lock<mutex> lock(paint_stats_mutex_);
+
+	loader_stats &st = paint_stats_;
+
+	st.textures_uploaded = upload_last_count_;
+	st.texture_upload_bytes = upload_last_bytes_;
+	st.texture_upload_time = upload_last_time_;
+	st.free_textures = textures_.free_count();
+	st.atlas_pages = textures_.pages_count();
+	st.atlas_bytes = textures_.pages_bytes();
+	st.textures_freed_bytes = textures_.freed_bytes();
+	st.textures_created = textures_.created();
+	st.textures_recycled = textures_.recycled();
+	st.draw_calls = batch_.draw_calls();
+	st.draw_primitives = batch_.primitives();
+	st.draw_state_changes = batch_.state_changes();
+	st.draw_shaders = batch_.shaders();
+}
+
+void Base::delete_texture_later(const texture_pool::texture &tex)
+{
+	if (boost::this_thread::get_id() == paint_thread_id_)
+	{
+		delete_texture(tex);
+	}
+	else
+	{
+		unique_lock<mutex> lock(delete_texture_mutex_);
+		delete_texture_queue_.push_back(tex);
+		++delete_texture_pending_;
+	}
+}
+
+void Base::delete_texture(const texture_pool::texture &tex)
+{
+	/* Текстура возвращается в пул, лишние удаляет delete_textures() */
+	textures_.give_back(tex);
+	++delete_texture_debug_counter_;
+}
+
+void Base::delete_textures()
+{
+	/* Блокируем очередь, только если в ней что-то есть */
+	if (delete_texture_pending_ != 0)
+	{
+		textures_list textures;
+
+		{
+			unique_lock<mutex> lock(delete_texture_mutex_);
+			textures.swap(delete_texture_queue_);
+		}
+
+		for (textures_list::iterator iter = textures.begin();
+			iter != textures.end(); ++iter)
+		{
+			delete_texture(*iter);
+			--delete_texture_pending_;
+		}
+	}
+
+	textures_.flush();
+	check_gl_error();
+}
+
+bool Base::check_tile_id(const tile::id &tile_id)
+{
+	int sz = tiles_count(tile_id.z);
+
+	return tile_id.z >= 1
+		&& tile_id.x >= 0 && tile_id.x < sz
+		&& tile_id.y >= 0 && tile_id.y < sz;
+}
+
+tile::ptr Base::find_tile(const tile::id &tile_id)
+{
+	return cache_.find(tile_id);
+}
+
+void Base::paint_tile(const tile::id &tile_id, int level)
+{
+	int z = tile_id.z - level;
+
+	if (z <= 0)
+		return;
+
+	tile::ptr tile_ptr = get_tile( tile::id(
+		tile_id.map_id, z, tile_id.x >> level, tile_id.y >> level) );
+
+	GLuint texture_id = tile_ptr ? tile_ptr->texture_id() : 0;
+
+	if (texture_id == 0)
+		paint_tile(tile_id, level + 1);
+	else
+	{
+		int mask = 0;
+		int kw = 1;
+
+		for (int i = 0; i < level; ++i)
+		{
+			mask = (mask << 1) | 1;
+			kw <<= 1;
+		}
+
+		double w = 1.0 / (double)kw;
+		double x = (tile_id.x & mask) * w;
+		double y = (tile_id.y & mask) * w;
+
+		double u1 = x, v1 = y, u2 = x + w, v2 = y + w;
+
+		int slot = tile_ptr->atlas_slot();
+		if (slot >= 0)
+		{
+			/* Тайл - место на странице атласа. Чтобы линейная фильтрация
+				не захватывала соседей, отступаем на полтекселя внутрь,
+				но только по краям самого тайла - внутренние границы
+				(при выводе части родителя) остаются точными */
+			int sx, sy;
+			textures_.slot_offset(slot, sx, sy);
+
+			const double k = 1.0 / (double)textures_.page_size();
+			const double ts = (double)textures_.tile_size();
+
+			u1 = (sx + x * ts + (x <= 0.0 ? 0.5 : 0.0)) * k;
+			v1 = (sy + y * ts + (y <= 0.0 ? 0.5 : 0.0)) * k;
+			u2 = (sx + (x + w) * ts - (x + w >= 1.0 ? 0.5 : 0.0)) * k;
+			v2 = (sy + (y + w) * ts - (y + w >= 1.0 ? 0.5 : 0.0)) * k;
+		}
+
+		const point lt = tiles_center_
+			+ (point(tile_id.x, tile_id.y) - tiles_origin_) * tiles_scale_;
+
+		batch_.add_rect(texture_id, lt.x, lt.y,
+			lt.x + tiles_scale_, lt.y + tiles_scale_,
+			u1, v1, u2, v2, tiles_color_);
+
+		/*-
+		point border[4];
+		border[0] = lt;
+		border[1] = point(lt.x + tiles_scale_, lt.y);
+		border[2] = point(lt.x + tiles_scale_, lt.y + tiles_scale_);
+		border[3] = point(lt.x, lt.y + tiles_scale_);
+		batch_.add_lines(border, 4, true, 1.0, color(1.0, 1.0, 1.0));
+		-*/
+	}
+}
+
+tile::ptr Base::get_tile(const tile::id &tile_id)
+{
+	//if ( !check_tile_id(tile_id))
+	//	return tile::ptr();
+
+	tile::ptr tile_ptr = find_tile(tile_id);
+
+	return tile_ptr;
+}
+
+tiles_queue::priority Base::tile_priority(const tile::id &tile_id,
+	int z_i, const point &central_tile)
+{
+	/* Центр экрана в координатах слоя тайла */
+	double k = 1.0;
+	for (int z = z_i; z < tile_id.z; ++z)
+		k *= 2.0;
+	for (int z = tile_id.z; z < z_i; ++z)
+		k /= 2.0;
+
+	const point center = central_tile * k;
+	const double distance = center.distance(
+		point(tile_id.x + 0.5, tile_id.y + 0.5) );
+
+	/* Сначала видимый слой, затем верхние (более крупные) слои
+		по мере удаления от видимого, и только потом нижний слой,
+		который виден лишь при переходе между масштабами */
+	int level = z_i - tile_id.z;
+	if (level < 0)
+		level = 20 - level; /* Масштабов не более 19 */
+
+	return tiles_queue::priority(level, distance, tile_id.z);
+}
+
+/* Разность прямоугольников a \ b - не более четырёх прямоугольников */
+static int rect_difference(const tiles_rect &a, const tiles_rect &b,
+	tiles_rect *out)
+{
+	if (a.empty())
+		return 0;
+
+	/* Пересечение */
+	tiles_rect i(
+		std::max(a.x1, b.x1), std::max(a.y1, b.y1),
+		std::min(a.x2, b.x2), std::min(a.y2, b.y2) );
+
+	if (i.empty())
+	{
+		out[0] = a;
+		return 1;
+	}
+
+	int n = 0;
+
+	/* Полосы сверху и снизу - во всю ширину,
+		слева и справа - только на высоту пересечения */
+	if (a.y1 < i.y1)
+		out[n++] = tiles_rect(a.x1, a.y1, a.x2, i.y1);
+	if (i.y2 < a.y2)
+		out[n++] = tiles_rect(a.x1, i.y2, a.x2, a.y2);
+	if (a.x1 < i.x1)
+		out[n++] = tiles_rect(a.x1, i.y1, i.x1, i.y2);
+	if (i.x2 < a.x2)
+		out[n++] = tiles_rect(i.x2, i.y1, a.x2, i.y2);
+
+	return n;
+}
+
+void Base::update_pyramid(int map_id, const pyramid_t &pyramid,
+	int z_i, const point &central_tile)
+{
+	/* Приоритеты тайлов, ещё ждущих в очередях, - относительно нового
+		видимого слоя и центра: иначе после смены масштаба новый видимый
+		слой грузился бы последним, как "нижний" */
+	{
+		boost::function<tiles_queue::priority (const tile::id&)> prio_of
+			= boost::bind(&Base::tile_priority, _1, z_i, central_tile);
+
+		file_queue_.reprioritize(prio_of);
+		server_queue_.reprioritize(prio_of);
+		load_texture_queue_.reprioritize(prio_of);
+	}
+
+	/* Новое поколение: тайлы, вошедшие в пирамиду сейчас, отличаются
+		от тех же тайлов, покидавших её раньше (0 - "вне пирамиды") */
+	if (++pyramid_epoch_ == 0)
+		++pyramid_epoch_;
+
+	const bool same_map = (pyramid_map_id_ == map_id);
+	const std::size_t levels = std::max(pyramid_.size(), pyramid.size());
+
+	for (std::size_t z = 1; z < levels; ++z)
+	{
+		const tiles_rect old_rect = z < pyramid_.size() ? pyramid_[z] : tiles_rect();
+		const tiles_rect new_rect = z < pyramid.size() ? pyramid[z] : tiles_rect();
+
+		if (same_map && old_rect == new_rect)
+			continue;
+
+		tiles_rect rects[4];
+		int count;
+
+		/* Покинувшие пирамиду. При смене карты - все старые тайлы */
+		count = rect_difference(old_rect,
+			same_map ? new_rect : tiles_rect(), rects);
+
+		for (int i = 0; i < count; ++i)
+			for (int x = rects[i].x1; x < rects[i].x2; ++x)
+				for (int y = rects[i].y1; y < rects[i].y2; ++y)
+					release_tile( tile::id(pyramid_map_id_, (int)z, x, y) );
+
+		/* Вошедшие в пирамиду */
+		count = rect_difference(new_rect,
+			same_map ? old_rect : tiles_rect(), rects);
+
+		for (int i = 0; i < count; ++i)
+			for (int x = rects[i].x1; x < rects[i].x2; ++x)
+				for (int y = rects[i].y1; y < rects[i].y2; ++y)
+					acquire_tile( tile::id(map_id, (int)z, x, y),
+						z_i, central_tile );
+	}
+
+	pyramid_map_id_ = map_id;
+	pyramid_ = pyramid;
+}
+
+void Base::acquire_tile(const tile::id &tile_id, int z_i,
+	const point &central_tile)
+{
+	tile::ptr tile_ptr = cache_.find(tile_id);
+
+	if (!tile_ptr)
+	{
+		tile_ptr = tile::ptr( new tile(on_image_delete_) );
+		tile_ptr->set_state( initial_tile_state(tile_id) );
+	}
+
+	tile_ptr->set_epoch(pyramid_epoch_);
+
+	/* Тайлы пирамиды закрепляем в кэше, чтобы они
+		не вытесняли друг друга */
+	cache_.insert(tile_id, tile_ptr, true);
+
+	enqueue_tile( tile_id, tile_ptr,
+		tile_priority(tile_id, z_i, central_tile) );
+}
+
+void Base::release_tile(const tile::id &tile_id)
+{
+	/* Тайл больше никому не нужен - загрузчики, успевшие взять
+		его из очереди, это увидят (tiles_queue::item::stale()) */
+	tile::ptr tile_ptr = cache_.find(tile_id);
+	if (tile_ptr)
+	{
+		tile_ptr->set_epoch(0);
+		unload_pbo(tile_id, tile_ptr);
+	}
+
+	/* Загрузку тайла, не успевшего загрузиться, отменяем */
+	file_queue_.erase(tile_id);
+	server_queue_.erase(tile_id);
+
+	/* ... в том числе уже отправленный на сервер запрос
+		(пакетный - только если он больше никому не нужен) */
+	http_pool::request_ptr req;
+
+	{
+		unique_lock<mutex> lock(server_requests_mutex_);
+
+		server_requests_list::iterator iter = server_requests_.find(tile_id);
+		if (iter != server_requests_.end())
+		{
+			if (--iter->second->tiles == 0)
+				req = iter->second->req;
+			server_requests_.erase(iter);
+		}
+	}
+
+	if (req)
+	{
+		http_pool_.cancel(req);
+		wake_up(server_loader_); /* Освободилось место для нового запроса */
+	}
+
+	cache_.unpin(tile_id);
+}
+
+void Base::unload_pbo(const tile::id &tile_id, const tile::ptr &tile_ptr)
+{
+	/* Пока тайл не готов, буфер ещё заполняет декодер */
+	if (tile_ptr->state() != tile::ready || tile_ptr->pbo_slot() < 0)
+		return;
+
+	/* Кольцо PBO маленькое: тайлы, ушедшие из пирамиды при быстрой
+		прокрутке, заняли бы его целиком, и декодеры остались бы
+		без буферов. Пиксели возвращаем в ОЗУ - под учёт кэша */
+	tile_ptr->move_from_pbo(&pbo_ring_);
+	cache_.update(tile_id);
+}
+
+void Base::enqueue_tile(const tile::id &tile_id, const tile::ptr &tile_ptr,
+	const tiles_queue::priority &prio)
+{
+	switch (tile_ptr->state())
+	{
+		case tile::file_loading:
+			file_queue_.push(tile_id, tile_ptr, prio);
+			wake_up(file_loader_);
+			break;
+
+		case tile::server_loading:
+			if (server_loader_)
+			{
+				server_queue_.push(tile_id, tile_ptr, prio);
+				wake_up(server_loader_);
+			}
+			break;
+
+		default:
+			/* Декодированный, но ещё не загруженный в текстуру тайл
+				(вернулся в пирамиду или сменил приоритет) */
+			if (tile_ptr->ok() && tile_ptr->texture_id() == 0)
+				load_texture_queue_.push(tile_id, tile_ptr, prio);
+	}
+}
+
+int Base::initial_tile_state(const tile::id &tile_id)
+{
+	/* Пока старый кэш переносится в хранилище, индекс неполон -
+		решение за файловым загрузчиком */
+	tile_store::ptr store = get_tile_store(tile_id.map_id);
+	if (!store || stores_imported_ == 0)
+		return tile::file_loading;
+
+	switch (find_stored_tile(tile_id, store))
+	{
+		case tile_store::missing:
+			++index_routed_dbg_;
+			return tile::ready; /* Тайла нет на сервере - загружать нечего */
+
+		case tile_store::absent:
+			++index_routed_dbg_;
+			return tile::server_loading;
+
+		default:
+			return tile::file_loading;
+	}
+}
+
+tile_store::result Base::find_stored_tile(const tile::id &tile_id,
+	const tile_store::ptr &store)
+{
+	tile_store::result res = store->find(tile_id);
+
+	if (res == tile_store::absent)
+	{
+		tile_store::ptr raw_store = get_raw_store(tile_id.map_id);
+		if (raw_store && raw_store->find(tile_id) == tile_store::found)
+			res = tile_store::found;
+	}
+
+	return res;
+}
+
+tile_store::ptr Base::get_tile_store(int map_id)
+{
+	tile_stores_list::iterator iter = tile_stores_.find(map_id);
+	return iter == tile_stores_.end() ? tile_store::ptr() : iter->second;
+}
+
+tile_store::ptr Base::get_raw_store(int map_id)
+{
+	tile_stores_list::iterator iter = raw_stores_.find(map_id);
+	return iter == raw_stores_.end() ? tile_store::ptr() : iter->second;
+}
+
+void Base::import_cache_trees()
+{
+	for (tile_stores_list::iterator iter = tile_stores_.begin();
+		iter != tile_stores_.end() && !finish(); ++iter)
+	{
+		const map_info &map = maps_[iter->first];
+		const std::wstring dir = cache_path_ + L"/" + map.sid;
+
+		try
+		{
+			if (!fs::is_directory(dir))
+				continue;
+
+			main_log << L"[cartographer] Перенос кэша в хранилище: "
+				<< dir << main_log;
+
+			std::size_t count = iter->second->import_tree(dir, map.ext);
+
+			/* Перенесённый кэш не удаляем, а переименовываем - чтобы
+				не переносить его снова. Удалить его можно вручную */
+			fs::rename(dir, dir + L".imported");
+
+			main_log << L"[cartographer] Перенесено тайлов: " << count
+				<< main_log;
+		}
+		catch (std::exception &e)
+		{
+			main_log << L"[cartographer] Ошибка переноса кэша: "
+				<< dir << L": " << my::utf8::decode(e.what()) << main_log;
+		}
+	}
+}
+
+/* Запись хранилища - кандидат на вытеснение */
+struct cold_entry
+{
+	tile_store::entry e;
+	int map_id;
+};
+
+/* Сначала давно не читанные, при равенстве - раньше записанные */
+static bool colder(const cold_entry &a, const cold_entry &b)
+{
+	return a.e.access < b.e.access
+		|| (a.e.access == b.e.access && a.e.offset < b.e.offset);
+}
+
+boost::uint64_t Base::disk_limit()
+{
+	unique_lock<mutex> lock(disk_limit_mutex_);
+	return disk_limit_;
+}
+
+bool Base::disk_keeper_needed(tile_stores_list &stores, boost::uint64_t limit)
+{
+	boost::uint64_t total = 0;
+
+	for (tile_stores_list::iterator iter = stores.begin();
+		iter != stores.end(); ++iter)
+	{
+		if (iter->second->needs_maintenance())
+			return true;
+		total += iter->second->data_size();
+	}
+
+	return limit && total > limit;
+}
+
+bool Base::disk_keeper_needed()
+{
+	return disk_keeper_needed(tile_stores_, disk_limit())
+		|| disk_keeper_needed(raw_stores_, raw_limit_);
+}
+
+void Base::evict_cold_tiles(tile_stores_list &stores, boost::uint64_t limit,
+	std::vector<tile_store::ptr> &evicted_from)
+{
+	/* Все записи всех хранилищ: такт последнего обращения общий,
+		поэтому их можно сравнивать между собой */
+	std::vector<cold_entry> all;
+	boost::uint64_t total = 0;
+
+	for (tile_stores_list::iterator iter = stores.begin();
+		iter != stores.end(); ++iter)
+	{
+		tile_store::entries_list entries;
+		iter->second->get_entries(entries);
+
+		for (std::size_t i = 0; i < entries.size(); ++i)
+		{
+			cold_entry ce;
+			ce.e = entries[i];
+			ce.map_id = iter->first;
+			all.push_back(ce);
+			total += entries[i].size;
+		}
+	}
+
+	/* Освобождаем с запасом - до 90% квоты, чтобы не сжимать
+		хранилища после каждого нового тайла */
+	const boost::uint64_t target = limit / 10 * 9;
+	if (total <= target)
+		return;
+
+	std::sort(all.begin(), all.end(), colder);
+
+	std::map<int, tile_store::entries_list> victims;
+
+	for (std::size_t i = 0; i < all.size() && total > target; ++i)
+	{
+		victims[all[i].map_id].push_back(all[i].e);
+		total -= all[i].e.size;
+	}
+
+	for (std::map<int, tile_store::entries_list>::iterator iter = victims.begin();
+		iter != victims.end(); ++iter)
+	{
+		tile_store::ptr store = stores[iter->first];
+		store->evict(iter->second);
+		evicted_from.push_back(store);
+	}
+}
+
+bool Base::maintain_stores(tile_stores_list &stores, boost::uint64_t limit,
+	boost::uint32_t tick)
+{
+	for (tile_stores_list::iterator iter = stores.begin();
+		iter != stores.end(); ++iter)
+	{
+		iter->second->touch(tick);
+	}
+
+	/* Вытесненные тайлы освобождают место только при сжатии */
+	std::vector<tile_store::ptr> evicted_from;
+
+	if (limit)
+		evict_cold_tiles(stores, limit, evicted_from);
+
+	/* Сжимаем хранилища с вытесненными тайлами и с избытком мусора,
+		а при превышении квоты - все, где мусор есть */
+	boost::uint64_t total = 0;
+	for (tile_stores_list::iterator iter = stores.begin();
+		iter != stores.end(); ++iter)
+	{
+		total += iter->second->data_size();
+	}
+
+	bool ok = true;
+
+	for (tile_stores_list::iterator iter = stores.begin();
+		iter != stores.end() && !finish(); ++iter)
+	{
+		tile_store::ptr store = iter->second;
+		tile_store::stats st = store->get_stats();
+
+		bool compact = store->needs_compaction()
+			|| std::find(evicted_from.begin(), evicted_from.end(), store)
+				!= evicted_from.end()
+			|| (limit && total > limit
+				&& st.file_bytes > st.live_bytes + 16 /* заголовок файла */);
+
+		if (!compact)
+			continue;
+
+		try
+		{
+			store->compact( boost::bind(&Base::finishing, this) );
+		}
+		catch (std::exception &e)
+		{
+			ok = false;
+			main_log << L"[cartographer] Ошибка сжатия дискового кэша: "
+				<< maps_[iter->first].sid << L": "
+				<< my::utf8::decode(e.what()) << main_log;
+		}
+	}
+
+	return ok;
+}
+
+bool Base::disk_writes_pending()
+{
+	for (tile_stores_list::iterator iter = tile_stores_.begin();
+		iter != tile_stores_.end(); ++iter)
+	{
+		if (iter->second->pending())
+			return true;
+	}
+
+	for (tile_stores_list::iterator iter = raw_stores_.begin();
+		iter != raw_stores_.end(); ++iter)
+	{
+		if (iter->second->pending())
+			return true;
+	}
+
+	return false;
+}
+
+void Base::flush_tile_stores(tile_stores_list &stores)
+{
+	for (tile_stores_list::iterator iter = stores.begin();
+		iter != stores.end(); ++iter)
+	{
+		try
+		{
+			iter->second->flush();
+		}
+		catch (std::exception &e)
+		{
+			main_log << L"[cartographer] Ошибка записи в дисковый кэш: "
+				<< maps_[iter->first].sid << L": "
+				<< my::utf8::decode(e.what()) << main_log;
+		}
+	}
+}
+
+/* Запись в дисковый кэш. Пока поток пишет, очередь копится -
+	следующая пачка уходит на диск одним обращением.
+	Когда писать нечего - засыпает */
+void Base::disk_writer_proc(my::worker::ptr this_worker)
+{
+	MY_REGISTER_THREAD(L"cartographer::disk_writer");
+
+	while (!finish())
+	{
+		{
+			unique_lock<mutex> lock(this_worker->get_mutex());
+
+			if (!disk_writes_pending())
+			{
+				sleep(this_worker, lock);
+				continue;
+			}
+		}
+
+		flush_tile_stores(tile_stores_);
+		flush_tile_stores(raw_stores_);
+	}
+}
+
+/* Обслуживание дискового кэша. Когда делать нечего - засыпает */
+void Base::disk_keeper_proc(my::worker::ptr this_worker)
+{
+	MY_REGISTER_THREAD(L"cartographer::disk_keeper");
+
+	/* Такт учёта обращений. Общий для всех хранилищ */
+	boost::uint32_t tick = 0;
+
+	while (!finish())
+	{
+		{
+			unique_lock<mutex> lock(this_worker->get_mutex());
+
+			if (!disk_keeper_needed())
+			{
+				sleep(this_worker, lock);
+				continue;
+			}
+		}
+
+		++tick;
+
+		/* Квоты у уровней кэша свои */
+		bool ok = maintain_stores(tile_stores_, disk_limit(), tick);
+		ok = maintain_stores(raw_stores_, raw_limit_, tick) && ok;
+
+		/* При ошибке (нет места на диске и т.п.) - пауза,
+			чтобы не повторять попытки без остановки */
+		for (int i = 0; !ok && i < 100 && !finish(); ++i)
+			boost::this_thread::sleep( posix_time::milliseconds(100) );
+	}
+}
+
+/* Загрузчик тайлов с диска. При пустой очереди - засыпает */
+void Base::file_loader_proc(my::worker::ptr this_worker)
+{
+	MY_REGISTER_THREAD(L"cartographer::file_loader");
+
+	/* Старый кэш переносим до начала работы - иначе его тайлы
+		пришлось бы снова загружать с сервера */
+	import_cache_trees();
+	++stores_imported_;
+
+	/* Теперь индекс хранилищ полон, и новые тайлы по нему
+		направляет acquire_tile() */
+
+	while (!finish())
+	{
+		tiles_queue::item item;
+
+		++file_loader_dbg_loop_;
+
+		/* Берём из очереди тайл с наивысшим приоритетом. Если очередь
+			пуста или декодеры не справляются - засыпаем. Блокировка нужна,
+			чтобы не пропустить wake_up(), пришедший между проверкой
+			очереди и sleep() */
+		{
+			unique_lock<mutex> lock(this_worker->get_mutex());
+
+			if (decode_queue_full() || !file_queue_.pop(item))
+			{
+				sleep(this_worker, lock);
+				continue;
+			}
+		}
+
+		const tile::id &tile_id = item.id;
+		tile::ptr tile_ptr = item.ptr;
+
+		/* Пока тайл ждал в очереди, его могли уже загрузить */
+		if (tile_ptr->state() != tile::file_loading)
+			continue;
+
+		/* ... или он мог покинуть пирамиду - тогда не тратим время на диск */
+		if (item.stale())
+		{
+			++file_loader_dbg_drop_;
+			continue;
+		}
+
+		++file_loader_dbg_load_;
+
+		/* Ищем тайл в индексе хранилища - без обращения к диску.
+			Новые тайлы, которых в хранилище нет, сюда не попадают -
+			их сразу направляет в очередь сервера acquire_tile() */
+		tile_store::ptr store = get_tile_store(tile_id.map_id);
+		tile_store::result found = store
+			? find_stored_tile(tile_id, store) : tile_store::absent;
+
+		/* В любой момент наш тайл может быть вытеснен из кэша,
+			не обращаем на это внимание, т.к. tile::ptr - это не что иное,
+			как shared_ptr, т.е. мы можем быть уверены, что тайл хоть
+			и "висит в воздухе", ожидая удаления, но он так и будет висеть,
+			пока мы его не освободим */
+
+		/* Тайла нет на сервере - и загружать нечего */
+		if (found == tile_store::missing)
+			tile_ptr->set_state(tile::ready);
+
+		/* Если тайла нет на диске, загружаем с сервера */
+		else if (found == tile_store::absent)
+		{
+			/* Приоритет сохраняется тот же */
+			tile_ptr->set_state(tile::server_loading);
+			enqueue_tile(tile_id, tile_ptr, item.prio);
+		}
+		else
+		{
+			/* Сам тайл читают из хранилища и декодируют декодеры */
+			decode_jobs_list jobs(1);
+			jobs.front().item = item;
+			jobs.front().store = store;
+			push_decode_job(jobs);
+		}
+
+	} /* while (!finish()) */
+}
+
+/* Загрузчик тайлов с сервера. Держит запросы "в полёте",
+	передаёт полученные ответы декодерам. Когда делать нечего - засыпает */
+void Base::server_loader_proc(my::worker::ptr this_worker)
+{
+	MY_REGISTER_THREAD(L"cartographer::server_loader");
+
+	while (!finish())
+	{
+		++server_loader_dbg_loop_;
+
+		/* Передаём полученные тайлы декодерам, пока есть место */
+		while (!finish() && !decode_queue_full())
+		{
+			decode_jobs_list jobs;
+
+			{
+				unique_lock<mutex> lock(server_replies_mutex_);
+
+				if (server_replies_.empty())
+					break;
+
+				/* Тело ответа не копируем */
+				jobs.splice(jobs.end(), server_replies_, server_replies_.begin());
+			}
+
+			push_decode_job(jobs);
+		}
+
+		/* Отправляем новые запросы, пока есть свободные места.
+			Тайлы попадают в очередь только от загрузчика файлов,
+			поэтому обогнать его мы не можем */
+		while (!finish() && can_request_tiles())
+		{
+			tiles_queue::item item;
+			if (!server_queue_.pop(item))
+				break;
+
+			if (item.ptr->state() != tile::server_loading)
+				continue;
+
+			/* Тайл покинул пирамиду, пока ждал в очереди */
+			if (item.stale())
+			{
+				++server_loader_dbg_drop_;
+				continue;
+			}
+
+			std::size_t batch_size;
+			{
+				unique_lock<mutex> lock(server_requests_mutex_);
+				batch_size = server_batch_size_;
+			}
+
+			/* Собираем пакет из тайлов того же слоя */
+			items_list items(1, item);
+
+			while (items.size() < batch_size
+				&& server_queue_.pop_layer(item, items[0].id.map_id, items[0].id.z))
+			{
+				if (item.ptr->state() != tile::server_loading)
+					continue;
+
+				if (item.stale())
+					++server_loader_dbg_drop_;
+				else
+					items.push_back(item);
+			}
+
+			if (items.size() == 1)
+				request_tile(items[0]);
+			else
+				request_tiles(items);
+		}
+
+		/* Засыпаем, если нет ни ответов, ни возможности отправить
+			новый запрос. Блокировка нужна, чтобы не пропустить wake_up() */
+		{
+			unique_lock<mutex> lock(this_worker->get_mutex());
+
+			bool has_replies;
+			{
+				unique_lock<mutex> l(server_replies_mutex_);
+				has_replies = !server_replies_.empty();
+			}
+
+			if ( (!has_replies || decode_queue_full())
+				&& (server_queue_.empty() || !can_request_tiles()) )
+			{
+				sleep(this_worker, lock);
+			}
+		}
+
+	} /* while (!finish()) */
+}
+
+bool Base::can_request_tiles()
+{
+	std::size_t limit = http_pool_.max_connections()
+		* http_pool_.pipeline_depth();
+
+	unique_lock<mutex> lock(server_requests_mutex_);
+
+	/* Считаем в тайлах - пакет занимает столько мест, сколько в нём тайлов */
+	if (server_batch_size_ > 1)
+		limit *= server_batch_size_;
+
+	return server_requests_.size() < limit;
+}
+
+void Base::request_tile(const tiles_queue::item &item)
+{
+	const tile::id &tile_id = item.id;
+	map_info &map = maps_[tile_id.map_id];
+
+	std::wstringstream request;
+	request << L"/maps/gettile?map=" << map.sid
+		<< L"&z=" << tile_id.z
+		<< L"&x=" << tile_id.x
+		<< L"&y=" << tile_id.y;
+
+	++server_loader_dbg_load_;
+
+	/* Блокировка удерживается до регистрации запроса, чтобы ответ,
+		пришедший раньше, не разминулся с ним в on_tile_reply() */
+	unique_lock<mutex> lock(server_requests_mutex_);
+
+	server_request_ptr r( new server_request );
+	r->serial = ++server_request_serial_;
+	r->tiles = 1;
+	r->req = http_pool_.async_get( request.str(),
+		boost::bind(&Base::on_tile_reply, this, item, r->serial, _1, _2) );
+
+	server_requests_[tile_id] = r;
+}
+
+/* Выполняется в потоке io_service_ - здесь только передаём
+	ответ на декодирование */
+void Base::on_tile_reply(const tiles_queue::item &item, unsigned int serial,
+	const boost::system::error_code &ec, my::http::reply &reply)
+{
+	finish_tile_request(item.id, serial);
+
+	/* Отменённые запросы игнорируем, при ошибке связи и ошибке
+		сервера (5xx и т.п.) повторяем */
+	if (!ec && final_status(reply.status_code))
+		push_server_reply(item, reply.status_code, reply.body);
+	else if (ec != asio::error::operation_aborted)
+		retry_tiles( items_list(1, item) );
+
+	wake_up(server_loader_);
+}
+
+void Base::request_tiles(const items_list &items)
+{
+	const tile::id &first_id = items[0].id;
+	map_info &map = maps_[first_id.map_id];
+
+	std::wstringstream request;
+	request << L"/maps/gettiles?map=" << map.sid
+		<< L"&z=" << first_id.z
+		<< L"&tiles=";
+
+	for (items_list::const_iterator iter = items.begin();
+		iter != items.end(); ++iter)
+	{
+		if (iter != items.begin())
+			request << L';';
+		request << iter->id.x << L',' << iter->id.y;
+	}
+
+	server_loader_dbg_load_ += (int)items.size();
+
+	unique_lock<mutex> lock(server_requests_mutex_);
+
+	server_batch_ptr batch( new server_batch );
+	batch->items = items;
+	batch->serial = ++server_request_serial_;
+
+	server_request_ptr r( new server_request );
+	r->serial = batch->serial;
+	r->tiles = items.size();
+	r->req = http_pool_.async_get( request.str(),
+		boost::bind(&Base::on_batch_reply, this, batch, _1, _2),
+		boost::bind(&Base::on_batch_data, this, batch, _1, _2, _3) );
+
+	for (items_list::const_iterator iter = items.begin();
+		iter != items.end(); ++iter)
+	{
+		server_requests_[iter->id] = r;
+	}
+}
+
+/* Очередная порция тела пакетного ответа (в потоке io_service_).
+	Каждый тайл передаём на декодирование, как только он получен целиком */
+void Base::on_batch_data(server_batch_ptr batch, const my::http::reply &reply,
+	const char *data, std::size_t size)
+{
+	if (reply.status_code != 200)
+		return;
+
+	std::string &buf = batch->buf;
+	buf.append(data, size);
+
+	std::size_t pos = 0;
+
+	while (true)
+	{
+		std::size_t eol = buf.find("\r\n", pos);
+		if (eol == std::string::npos)
+			break;
 
-	tiles_cache::iterator iter = cache_.begin();
+		/* Заголовок части: x,y,status,length */
+		int x, y;
+		unsigned int status_code;
+		unsigned long length;
 
-	int count = 0;
+		if (std::sscanf(buf.c_str() + pos, "%d,%d,%u,%lu",
+			&x, &y, &status_code, &length) != 4)
+		{
+			buf.clear(); /* Ответ испорчен - остальное не разбираем */
+			return;
+		}
 
-	while (iter != cache_.end() && ++count <= cache_active_tiles_)
-	{
-		tile::ptr tile_ptr = iter->value();
+		std::size_t begin = eol + 2;
+		if (buf.size() - begin < length)
+			break;
 
-		if (tile_ptr->ok())
+		for (items_list::iterator iter = batch->items.begin();
+			iter != batch->items.end(); ++iter)
 		{
-			tile_ptr->convert_to_gl_texture();
-			check_gl_error();
-			++load_texture_debug_counter_;
+			if (iter->id.x == x && iter->id.y == y)
+			{
+				std::string body(buf, begin, length);
+
+				finish_tile_request(iter->id, batch->serial);
+				if (final_status(status_code))
+					push_server_reply(*iter, status_code, body);
+				else
+					retry_tiles( items_list(1, *iter) );
+
+				batch->items.erase(iter);
+				break;
+			}
 		}
 
-		++iter;
+		pos = begin + length;
 	}
+
+	buf.erase(0, pos);
+
+	wake_up(server_loader_);
 }
 
-void Base::delete_texture_later(GLuint texture_id)
+void Base::on_batch_reply(server_batch_ptr batch,
+	const boost::system::error_code &ec, my::http::reply &reply)
 {
-	if (boost::this_thread::get_id() == paint_thread_id_)
+	for (items_list::iterator iter = batch->items.begin();
+		iter != batch->items.end(); ++iter)
 	{
-		delete_texture(texture_id);
+		finish_tile_request(iter->id, batch->serial);
 	}
-	else
+
+	/* Сервер не поддерживает пакетные запросы - отключаем их
+		и возвращаем тайлы в очередь */
+	if (!ec && reply.status_code != 200)
 	{
-		unique_lock<mutex> lock(delete_texture_mutex_);
-		delete_texture_queue_.push_back(texture_id);
+		{
+			unique_lock<mutex> lock(server_requests_mutex_);
+			server_batch_size_ = 0;
+		}
+
+		main_log << L"[cartographer] Сервер не поддерживает пакетные запросы: "
+			<< reply.status_code << main_log;
+
+		/* Кроме покинувших пирамиду, пока шёл запрос */
+		for (items_list::iterator iter = batch->items.begin();
+			iter != batch->items.end(); ++iter)
+		{
+			if (iter->ptr->state() != tile::server_loading)
+				continue;
+
+			if (iter->stale())
+				++server_loader_dbg_drop_;
+			else
+				server_queue_.push(*iter);
+		}
 	}
-}
 
-void Base::delete_texture(GLuint texture_id)
-{
-	glDeleteTextures(1, &texture_id);
-	check_gl_error();
-	++delete_texture_debug_counter_;
+	/* Тайлы, не вошедшие в ответ или потерянные из-за ошибки
+		связи, запрашиваем заново. Отменённые - нет */
+	else if (ec != asio::error::operation_aborted)
+		retry_tiles(batch->items);
+
+	wake_up(server_loader_);
 }
 
-void Base::delete_textures()
+void Base::retry_tiles(const items_list &items)
 {
-	unique_lock<mutex> lock(delete_texture_mutex_);
-
-	while (delete_texture_queue_.size())
+	for (items_list::const_iterator iter = items.begin();
+		iter != items.end(); ++iter)
 	{
-		GLuint texture_id = delete_texture_queue_.front();
-		delete_texture_queue_.pop_front();
-		delete_texture(texture_id);
+		if (iter->ptr->state() != tile::server_loading)
+			continue;
+
+		if (iter->stale())
+		{
+			++server_loader_dbg_drop_;
+			continue;
+		}
+
+		/* Тайл остаётся пустым, но не закреплённым: кэш его вытеснит,
+			и при следующем входе в пирамиду он загрузится заново */
+		if (iter->retries >= server_max_retries)
+		{
+			iter->ptr->set_state(tile::ready);
+			cache_.unpin(iter->id);
+			main_log << L"[cartographer] Сервер не прислал тайл: "
+				<< maps_[iter->id.map_id].sid
+				<< L" z=" << iter->id.z
+				<< L" x=" << iter->id.x
+				<< L" y=" << iter->id.y << main_log;
+			continue;
+		}
+
+		tiles_queue::item item = *iter;
+		++item.retries;
+		server_queue_.push(item);
 	}
 }
 
-bool Base::check_tile_id(const tile::id &tile_id)
+void Base::finish_tile_request(const tile::id &tile_id, unsigned int serial)
 {
-	int sz = tiles_count(tile_id.z);
+	unique_lock<mutex> lock(server_requests_mutex_);
 
-	return tile_id.z >= 1
-		&& tile_id.x >= 0 && tile_id.x < sz
-		&& tile_id.y >= 0 && tile_id.y < sz;
+	/* Запрос мог быть отменён, а тайл - запрошен повторно */
+	server_requests_list::iterator iter = server_requests_.find(tile_id);
+	if (iter != server_requests_.end() && iter->second->serial == serial)
+	{
+		--iter->second->tiles;
+		server_requests_.erase(iter);
+	}
 }
 
-tile::ptr Base::find_tile(const tile::id &tile_id)
+void Base::push_server_reply(const tiles_queue::item &item,
+	unsigned int status_code, std::string &body)
 {
-	/* Блокируем кэш для чтения */
-	shared_lock<shared_mutex> lock(cache_mutex_);
-
-	tiles_cache::iterator iter = cache_.find(tile_id);
+	unique_lock<mutex> lock(server_replies_mutex_);
 
-	return iter == cache_.end() ? tile::ptr() : iter->value();
+	server_replies_.push_back(decode_job());
+	decode_job &job = server_replies_.back();
+	job.item = item;
+	job.reply.status_code = status_code;
+	job.reply.body.swap(body);
 }
 
-void Base::paint_tile(const tile::id &tile_id, int level)
+void Base::push_decode_job(decode_jobs_list &jobs)
 {
-	int z = tile_id.z - level;
-
-	if (z <= 0)
-		return;
-
-	tile::ptr tile_ptr = get_tile( tile::id(
-		tile_id.map_id, z, tile_id.x >> level, tile_id.y >> level) );
-
-	GLuint texture_id = tile_ptr ? tile_ptr->texture_id() : 0;
+	workers_list idle;
 
-	if (texture_id == 0)
-		paint_tile(tile_id, level + 1);
-	else
 	{
-		int mask = 0;
-		int kw = 1;
-
-		for (int i = 0; i < level; ++i)
-		{
-			mask = (mask << 1) | 1;
-			kw <<= 1;
-		}
-
-		double w = 1.0 / (double)kw;
-		double x = (tile_id.x & mask) * w;
-		double y = (tile_id.y & mask) * w;
+		unique_lock<mutex> lock(decode_mutex_);
 
-		glBindTexture(GL_TEXTURE_2D, texture_id);
-		glBegin(GL_QUADS);
-			glTexCoord2d( x, y );
-			glVertex3d( (double)tile_id.x, (double)tile_id.y, 0.0 );
-			glTexCoord2d( x + w, y );
-			glVertex3d( (double)tile_id.x + 1.0, (double)tile_id.y, 0.0 );
-			glTexCoord2d( x + w, y + w );
-			glVertex3d( (double)tile_id.x + 1.0, (double)tile_id.y + 1.0, 0.0 );
-			glTexCoord2d( x, y + w);
-			glVertex3d( (double)tile_id.x, (double)tile_id.y + 1.0, 0.0 );
-		glEnd();
+		/* По спящему декодеру на задание. Занятые возьмут
+			оставшиеся задания сами, закончив текущее */
+		std::size_t count = std::min(jobs.size(), idle_decoders_.size());
+		idle.assign(idle_decoders_.end() - count, idle_decoders_.end());
+		idle_decoders_.resize(idle_decoders_.size() - count);
 
-		/*-
-		magic_exec();
-
-		glColor3d(1.0, 1.0, 1.0);
-		glBegin(GL_LINE_LOOP);
-			glVertex3d( (double)tile_id.x, (double)tile_id.y, 0.0 );
-			glVertex3d( (double)tile_id.x + 1.0, (double)tile_id.y, 0.0 );
-			glVertex3d( (double)tile_id.x + 1.0, (double)tile_id.y + 1.0, 0.0 );
-			glVertex3d( (double)tile_id.x, (double)tile_id.y + 1.0, 0.0 );
-		glEnd();
-		-*/
+		decode_queue_.splice(decode_queue_.end(), jobs);
+	}
 
-		check_gl_error();
+	/* Декодер попадает в список под своей блокировкой и отпускает её,
+		только заснув, поэтому wake_up() не будет пропущен */
+	for (workers_list::iterator iter = idle.begin();
+		iter != idle.end(); ++iter)
+	{
+		wake_up(*iter);
 	}
 }
 
-tile::ptr Base::get_tile(const tile::id &tile_id)
+bool Base::decode_queue_full()
 {
-	//if ( !check_tile_id(tile_id))
-	//	return tile::ptr();
-
-	tile::ptr tile_ptr = find_tile(tile_id);
-
-	return tile_ptr;
+	unique_lock<mutex> lock(decode_mutex_);
+	return decode_queue_.size() >= decode_queue_limit_;
 }
 
-/* Загрузчик тайлов с диска. При пустой очереди - засыпает */
-void Base::file_loader_proc(my::worker::ptr this_worker)
+/* Декодер тайлов. При пустой очереди - засыпает */
+void Base::decoder_proc(my::worker::ptr this_worker)
 {
-	MY_REGISTER_THREAD(L"cartographer::file_loader");
+	MY_REGISTER_THREAD(L"cartographer::decoder");
 
 	while (!finish())
 	{
-		tile::id tile_id;
-		tile::ptr tile_ptr;
-
-		++file_loader_dbg_loop_;
+		decode_jobs_list jobs;
+		int opaque_bpp;
 
-		/* Ищем в кэше тайл, требующий загрузки */
 		{
-			shared_lock<shared_mutex> lock(cache_mutex_);
+			unique_lock<mutex> lock(this_worker->get_mutex());
 
-			while (file_iterator_ != cache_.end())
 			{
-				tile_ptr = file_iterator_->value();
+				unique_lock<mutex> l(decode_mutex_);
+				if (!decode_queue_.empty())
+					jobs.splice(jobs.end(), decode_queue_, decode_queue_.begin());
+				else
+					idle_decoders_.push_back(this_worker);
+				opaque_bpp = tiles_opaque_bpp_;
+			}
 
-				if (tile_ptr->state() == tile::file_loading)
-				{
-					tile_id = file_iterator_->key();
-					++file_iterator_;
-					break;
-				}
+			if (jobs.empty())
+			{
+				sleep(this_worker, lock);
 
-				++file_iterator_;
+				/* Разбудить могли и не из push_decode_job() */
+				unique_lock<mutex> l(decode_mutex_);
+				workers_list::iterator iter = std::find(idle_decoders_.begin(),
+					idle_decoders_.end(), this_worker);
+				if (iter != idle_decoders_.end())
+					idle_decoders_.erase(iter);
+				continue;
 			}
 		}
 
-		/* Если нет такого - засыпаем */
-		if (!tile_id)
-		{
-			sleep(this_worker);
-			continue;
-		}
+		/* В очереди освободилось место - загрузчики могли его ждать */
+		wake_up(file_loader_);
+		if (server_loader_)
+			wake_up(server_loader_);
 
-		++file_loader_dbg_load_;
+		decode_job &job = jobs.front();
+
+		if (!job.store)
+			decode_tile(job, opaque_bpp);
+		else
+			decode_file(job, opaque_bpp);
+	}
+}
 
-		/* Загружаем тайл с диска */
-		std::wstringstream path;
+void Base::decode_file(decode_job &job, int opaque_bpp)
+{
+	tile::ptr tile_ptr = job.item.ptr;
 
-		map_info &map = maps_[tile_id.map_id];
+	if (tile_ptr->state() != tile::file_loading)
+		return;
 
-		path << cache_path_
-			<< L"/" << map.sid
-			<< L"/z" << tile_id.z
-			<< L'/' << (tile_id.x >> 10)
-			<< L"/x" << tile_id.x
-			<< L'/' << (tile_id.y >> 10)
-			<< L"/y" << tile_id.y;
+	/* Тайл покинул пирамиду, пока ждал декодирования */
+	if (job.item.stale())
+	{
+		++file_loader_dbg_drop_;
+		return;
+	}
 
-		std::wstring filename = path.str() + map.ext;
+	std::string &data = job.reply.body;
+	tile_store::ptr raw_store = get_raw_store(job.item.id.map_id);
 
-		/* В любой момент наш тайл может быть вытеснен из кэша,
-			не обращаем на это внимание, т.к. tile::ptr - это не что иное,
-			как shared_ptr, т.е. мы можем быть уверены, что тайл хоть
-			и "висит в воздухе", ожидая удаления, но он так и будет висеть,
-			пока мы его не освободим */
+	/* Сначала - уже декодированные пиксели: распаковка вместо
+		декодирования. Нет их (или они в другом формате) - декодируем */
+	bool unpacked = false;
 
-		/* Если файла нет на диске, загружаем с сервера */
-		if (!fs::exists(filename))
+	if (raw_store && raw_store->read(job.item.id, data) == tile_store::found)
+	{
+		try
 		{
-			/* Но только если нет файла-метки об отсутствии тайла и там */
-			if ( fs::exists(path.str() + L".tne") )
-				tile_ptr->set_state(tile::ready);
-			else
-				tile_ptr->set_state(tile::server_loading);
+			unpacked = tile_ptr->load_from_packed(data.c_str(), data.size(),
+				opaque_bpp, &pbo_ring_);
 		}
-		else
+		catch (std::exception &)
 		{
-			if (!tile_ptr->load_from_file(filename))
-			{
-				tile_ptr->set_state(tile::ready);
-				main_log << L"[cartographer] Ошибка загрузки wxImage: "
-					<< filename << main_log;
-			}
+			/* Испорченная запись (нехватка памяти) - как промах */
 		}
+	}
 
-	} /* while (!finish()) */
-}
-
-/* Загрузчик тайлов с сервера. При пустой очереди - засыпает */
-void Base::server_loader_proc(my::worker::ptr this_worker)
-{
-	MY_REGISTER_THREAD(L"cartographer::server_loader");
-
-	while (!finish())
+	if (unpacked)
 	{
-		tile::id tile_id;
-		tile::ptr tile_ptr;
-
-		++server_loader_dbg_loop_;
+		++unpacked_count_;
+		load_texture_later(job.item);
 
-		/* Ищем в кэше тайл, требующий загрузки */
-		{
-			shared_lock<shared_mutex> lock(cache_mutex_);
+		/* Основное хранилище тайл не читало, но обращение к нему -
+			для LRU: иначе самые ходовые тайлы вытеснялись бы первыми,
+			а после этого шли бы мимо кэша декодированных на сервер */
+		job.store->touch_key(job.item.id);
 
-			while (server_iterator_ != cache_.end())
-			{
-				tile_ptr = server_iterator_->value();
+		if (raw_store->needs_maintenance() || job.store->needs_maintenance())
+			wake_up(disk_keeper_);
+		return;
+	}
 
-				if (tile_ptr->state() == tile::server_loading)
-				{
-					tile_id = server_iterator_->key();
-					++server_iterator_;
-					break;
-				}
+	/* Одно чтение с диска */
+	if (job.store->read(job.item.id, data) != tile_store::found)
+	{
+		/* Ошибка чтения - пробуем загрузить с сервера */
+		tile_ptr->set_state(tile::server_loading);
+		enqueue_tile(job.item.id, tile_ptr, job.item.prio);
+		return;
+	}
 
-				/* Не даём обогнать загрузчик файлов */
-				if (tile_ptr->state() == tile::file_loading)
-					break;
+	/* Накопился журнал обращений */
+	if (job.store->needs_maintenance())
+		wake_up(disk_keeper_);
 
-				++server_iterator_;
-			}
-		}
+	std::string packed;
 
-		/* Если нет такого - засыпаем */
-		if (!tile_id)
-		{
-			sleep(this_worker);
-			continue;
-		}
+	if (tile_ptr->load_from_mem(data.c_str(), data.size(), opaque_bpp,
+		&pbo_ring_, raw_store ? &packed : 0))
+	{
+		++decoded_count_;
+		load_texture_later(job.item);
 
-		++server_loader_dbg_load_;
+		if (!packed.empty())
+			save_packed(job.item.id, packed);
+	}
+	else
+	{
+		++decode_errors_count_;
+		tile_ptr->set_state(tile::ready);
+		main_log << L"[cartographer] Ошибка загрузки wxImage: "
+			<< maps_[job.item.id.map_id].sid
+			<< L" z=" << job.item.id.z
+			<< L" x=" << job.item.id.x
+			<< L" y=" << job.item.id.y << main_log;
+	}
+}
 
-		/* Загружаем тайл с сервера */
+void Base::decode_tile(decode_job &r, int opaque_bpp)
+{
+	const tile::id &tile_id = r.item.id;
+	tile::ptr tile_ptr = r.item.ptr;
 
-		map_info &map = maps_[tile_id.map_id];
+	if (tile_ptr->state() != tile::server_loading)
+		return;
 
-		std::wstringstream path; /* Путь к локальному файлу  */
-		path << cache_path_
-			<< L"/" << map.sid
-			<< L"/z" << tile_id.z
-			<< L'/' << (tile_id.x >> 10)
-			<< L"/x" << tile_id.x
-			<< L'/' << (tile_id.y >> 10)
-			<< L"/y" << tile_id.y;
+	/* Тайл покинул пирамиду, пока загружался. Декодировать его
+		не для кого - только сохраняем на диск, чтобы при следующем
+		обращении он загрузился оттуда */
+	const bool wanted = (tile_ptr->epoch() != 0);
 
-		std::wstringstream request;
-		request << L"/maps/gettile?map=" << map.sid
-			<< L"&z=" << tile_id.z
-			<< L"&x=" << tile_id.x
-			<< L"&y=" << tile_id.y;
+	tile_store::ptr store = get_tile_store(tile_id.map_id);
+	std::string packed;
 
-		/* В любой момент наш тайл может быть вытеснен из кэша,
-			не обращаем на это внимание, т.к. tile::ptr - это не что иное,
-			как shared_ptr, т.е. мы можем быть уверены, что тайл хоть
-			и "висит в воздухе", ожидая удаления, но он так и будет висеть,
-			пока мы его не освободим */
+	/* В любой момент наш тайл может быть вытеснен из кэша,
+		не обращаем на это внимание, т.к. tile::ptr - это не что иное,
+		как shared_ptr, т.е. мы можем быть уверены, что тайл хоть
+		и "висит в воздухе", ожидая удаления, но он так и будет висеть,
+		пока мы его не освободим */
 
-		try
+	try
+	{
+		if (r.reply.status_code == 404)
 		{
-			/* Загружаем тайл с сервера ... */
-			my::http::reply reply;
-			get(reply, request.str());
-
-			if (reply.status_code == 404)
+			/* Тайла нет на сервере - сохраняем метку */
+			tile_ptr->set_state(image::ready);
+			if (store)
+				store->write_missing(tile_id);
+		}
+		else if (r.reply.status_code == 200)
+		{
+			/* При успешной загрузке с сервера, создаём тайл из буфера
+				и сохраняем файл на диске */
+			if (!wanted)
 			{
-				/* Тайла нет на сервере - создаём файл-метку */
-				tile_ptr->set_state(image::ready);
-				reply.save(path.str() + L".tne");
+				++server_loader_dbg_drop_;
+				tile_ptr->set_state(tile::file_loading);
+				if (store)
+					store->write(tile_id, r.reply.body.c_str(), r.reply.body.size());
 			}
-			else if (reply.status_code == 200)
+			else if ( tile_ptr->load_from_mem(r.reply.body.c_str(),
+				r.reply.body.size(), opaque_bpp, &pbo_ring_,
+				get_raw_store(tile_id.map_id) ? &packed : 0) )
 			{
-				/* При успешной загрузке с сервера, создаём тайл из буфера
-					и сохраняем файл на диске */
-				if ( tile_ptr->load_from_mem(reply.body.c_str(), reply.body.size()) )
-					reply.save(path.str() + map.ext);
-				else
-				{
-					tile_ptr->set_state(tile::ready);
-					main_log << L"[cartographer] Ошибка загрузки wxImage: "
-						<< request.str() << main_log;
-				}
+				++decoded_count_;
+				load_texture_later(r.item);
+				if (store)
+					store->write(tile_id, r.reply.body.c_str(), r.reply.body.size());
+				if (!packed.empty())
+					save_packed(tile_id, packed);
+			}
+			else
+			{
+				++decode_errors_count_;
+				tile_ptr->set_state(tile::ready);
+				main_log << L"[cartographer] Ошибка загрузки wxImage: "
+					<< maps_[tile_id.map_id].sid
+					<< L" z=" << tile_id.z
+					<< L" x=" << tile_id.x
+					<< L" y=" << tile_id.y << main_log;
 			}
 		}
-		catch (...)
-		{
-			/* Игнорируем любые ошибки связи */
-		}
+	}
+	catch (...)
+	{
+		/* Игнорируем ошибки сохранения */
+	}
 
-	} /* while (!finish()) */
+	if (store)
+	{
+		wake_up(disk_writer_);
+
+		/* Хранилище выросло - возможно, пора освобождать место */
+		if (disk_keeper_needed())
+			wake_up(disk_keeper_);
+	}
+}
+
+void Base::save_packed(const tile::id &tile_id, const std::string &packed)
+{
+	tile_store::ptr raw_store = get_raw_store(tile_id.map_id);
+
+	try
+	{
+		raw_store->write(tile_id, packed.c_str(), packed.size());
+	}
+	catch (...)
+	{
+		/* Игнорируем ошибки сохранения */
+	}
+
+	wake_up(disk_writer_);
+
+	if (disk_keeper_needed(raw_stores_, raw_limit_))
+		wake_up(disk_keeper_);
 }
 
 void Base::anim_thread_proc(my::worker::ptr this_worker)
@@ -741,15 +2014,7 @@ void Base::anim_thread_proc(my::worker::ptr this_worker)
 void Base::get(my::http::reply &reply,
 	const std::wstring &request)
 {
-	asio::ip::tcp::socket socket(io_service_);
-	socket.connect(server_endpoint_);
-
-	std::string full_request
-		= "GET "
-		+ my::http::percent_encode(my::utf8::encode(request))
-		+ " HTTP/1.1\r\n\r\n";
-
-	reply.get(socket, full_request);
+	http_pool_.get(reply, request);
 }
 
 unsigned int Base::load_and_save(const std::wstring &request,
@@ -814,6 +2079,20 @@ void Base::paint_debug_info_int(DC &gc, int width, int height)
 	__swprintf(buf, sizeof(buf)/sizeof(*buf), L"textures deleted: %d", delete_texture_debug_counter_);
 	gc.DrawText(buf, x, y), y += 12;
 
+	__swprintf(buf, sizeof(buf)/sizeof(*buf), L"upload: %d (%0.1f ms), queue: %d",
+		upload_last_count_, upload_last_time_, (int)load_texture_queue_.size());
+	gc.DrawText(buf, x, y), y += 12;
+
+	__swprintf(buf, sizeof(buf)/sizeof(*buf), L"draws: %d (primitives: %d, states: %d)%s",
+		batch_.draw_calls(), batch_.primitives(), batch_.state_changes(),
+		batch_.shaders() ? L", glsl" : L"");
+	gc.DrawText(buf, x, y), y += 12;
+
+	__swprintf(buf, sizeof(buf)/sizeof(*buf), L"atlas pages: %d (%d MB, freed: %d MB)",
+		(int)textures_.pages_count(), (int)(textures_.pages_bytes() >> 20),
+		(int)(textures_.freed_bytes() >> 20));
+	gc.DrawText(buf, x, y), y += 12;
+
 	__swprintf(buf, sizeof(buf)/sizeof(*buf), L"painter: %d", painter_debug_counter_);
 	gc.DrawText(buf, x, y), y += 12;
 
@@ -823,10 +2102,13 @@ void Base::paint_debug_info_int(DC &gc, int width, int height)
 	__swprintf(buf, sizeof(buf)/sizeof(*buf), L"builder: %d", builder_debug_counter_);
 	gc.DrawText(buf, x, y), y += 12;
 
-	__swprintf(buf, sizeof(buf)/sizeof(*buf), L"file_loader: loop=%d load=%d", file_loader_dbg_loop_, file_loader_dbg_load_);
+	__swprintf(buf, sizeof(buf)/sizeof(*buf), L"file_loader: loop=%d load=%d drop=%d", file_loader_dbg_loop_, file_loader_dbg_load_, (int)file_loader_dbg_drop_);
+	gc.DrawText(buf, x, y), y += 12;
+
+	__swprintf(buf, sizeof(buf)/sizeof(*buf), L"server_loader: loop=%d load=%d drop=%d", server_loader_dbg_loop_, server_loader_dbg_load_, (int)server_loader_dbg_drop_);
 	gc.DrawText(buf, x, y), y += 12;
 
-	__swprintf(buf, sizeof(buf)/sizeof(*buf), L"server_loader: loop=%d load=%d", server_loader_dbg_loop_, server_loader_dbg_load_);
+	__swprintf(buf, sizeof(buf)/sizeof(*buf), L"decoders: %d decoded=%d unpacked=%d errors=%d", (int)decoders_.size(), (int)decoded_count_, (int)unpacked_count_, (int)decode_errors_count_);
 	gc.DrawText(buf, x, y), y += 12;
 
 	__swprintf(buf, sizeof(buf)/sizeof(*buf), L"z: %0.1f", z_);
@@ -955,10 +2237,6 @@ void Base::repaint()
 			|| basis_tile_x2_ != basis_tile_x2
 			|| basis_tile_y2_ != basis_tile_y2 )
 		{
-			unique_lock<shared_mutex> lock(cache_mutex_);
-
-			int tiles_count = 0; /* Считаем кол-во тайлов в пирамиде */
-
 			/* Сохраняем новое основание */
 			basis_map_id_ = map_id_;
 			basis_z_ = basis_z;
@@ -967,31 +2245,13 @@ void Base::repaint()
 			basis_tile_x2_ = basis_tile_x2;
 			basis_tile_y2_ = basis_tile_y2;
 
-			/* Добавляем новые тайлы */
+			/* Строим области новой пирамиды по слоям */
+			pyramid_t pyramid(basis_z + 1);
+
 			while (basis_z)
 			{
-				for (int tile_x = basis_tile_x1; tile_x < basis_tile_x2; ++tile_x)
-				{
-					for (int tile_y = basis_tile_y1; tile_y < basis_tile_y2; ++tile_y)
-					{
-						tile::id tile_id(map_id_, basis_z, tile_x, tile_y);
-						tiles_cache::iterator iter = cache_.find(tile_id);
-
-						tile::ptr tile_ptr;
-
-						if (iter != cache_.end())
-							tile_ptr = iter->value();
-						else
-						{
-							tile_ptr = tile::ptr( new tile(on_image_delete_) );
-							tile_ptr->set_state(tile::file_loading);
-						}
-
-						cache_.insert(tile_id, tile_ptr);
-
-						++tiles_count;
-					}
-				}
+				pyramid[basis_z] = tiles_rect(basis_tile_x1, basis_tile_y1,
+					basis_tile_x2, basis_tile_y2);
 
 				--basis_z;
 
@@ -1007,16 +2267,8 @@ void Base::repaint()
 				basis_tile_y2 >>= 1;
 			}
 
-			/*TODO: Сортируем */
-			////
-
-			/* Устанавливаем итераторы загрузчиков на начало. Будим их */
-			file_iterator_ = server_iterator_ = cache_.begin();
-			wake_up(file_loader_);
-			wake_up(server_loader_);
-
-			cache_active_tiles_ = tiles_count;
-
+			/* ... и применяем только разницу со старой */
+			update_pyramid(map_id_, pyramid, z_i, central_tile);
 		}
 	}
 
@@ -1038,81 +2290,52 @@ void Base::repaint()
 		glViewport(0, 0, screen_size.width, screen_size.height);
 		glClear(GL_COLOR_BUFFER_BIT);
 
-		/* Уровень GL_PROJECTION */
-		glMatrixMode(GL_PROJECTION);
-		glLoadIdentity();
-
-		/* Зрителя помещаем в центральную точку (тайловые координаты) */
-		size sz = screen_size / 256.0;
-		point pos = -center_pos_.get_pos_for(sz);
-
-		#ifdef TEST_FRUSTRUM
-		glFrustum( pos.x, pos.x + sz.width,
-			-pos.y - sz.height, -pos.y, 0.8, 3.0 );
-		#else
-		glOrtho( pos.x, pos.x + sz.width,
-			-pos.y - sz.height, -pos.y, -1.0, 2.0 );
-		#endif
-
-		/* С вертикалью работаем сверху вниз, а не снизу вверх */
-		glScaled(1.0 + dz, -1.0 - dz, 1.0);
+		/* Весь кадр копится в batch_ (экранные координаты)
+			и выводится одним flush() в конце */
+		batch_.begin(screen_size);
 	}
 
+	/* Тайлы переводим в экранные координаты сами: центральный тайл -
+		в центральной точке, тайл - 256 пикселей с учётом dz */
+	tiles_center_ = center_pos;
+
 	/* Выводим нижний слой */
 	if (dz > 0.01)
 	{
-		glMatrixMode(GL_MODELVIEW);
-		glLoadIdentity();
-
 		/* Тайлы заднего фона меньше в два раза */
-		glScaled(0.5, 0.5, 1.0);
-		glTranslated(-2.0 * central_tile.x, -2.0 * central_tile.y, 0.0);
+		tiles_origin_ = central_tile * 2.0;
+		tiles_scale_ = 128.0 * (1.0 + dz);
+		tiles_color_ = color(1.0, 1.0, 1.0, 1.0);
 
-		glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
-		glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+		batch_.begin_layer();
 
 		/* Границы нижнего слоя в данном случае равны основанию пирамиды тайлов */
 		for (int x = basis_tile_x1_; x < basis_tile_x2_; ++x)
 			for (int y = basis_tile_y1_; y < basis_tile_y2_; ++y)
 				paint_tile( tile::id(map_id_, basis_z_, x, y) );
+
+		batch_.end_layer();
 	}
 
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
-	glTranslated(-central_tile.x, -central_tile.y, 0.0);
+	tiles_origin_ = central_tile;
+	tiles_scale_ = 256.0 * (1.0 + dz);
+	tiles_color_ = color(1.0, 1.0, 1.0, alpha);
 
-	glColor4f(1.0f, 1.0f, 1.0f, alpha);
-	glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
+	batch_.begin_layer();
 
 	for (int x = z_i_tile_x1; x < z_i_tile_x2; ++x)
 		for (int y = z_i_tile_y1; y < z_i_tile_y2; ++y)
 			paint_tile( tile::id(map_id_, z_i, x, y) );
 
-	main_log << L"[cartographer] repaint(): after paint map" << main_log;
-
-	/* Меняем проекцию на проекцию экрана */
-	{
-		glColor4d(1.0, 1.0, 1.0, 1.0);
-		glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
-
-		glMatrixMode(GL_PROJECTION);
-		glLoadIdentity();
-
-		glOrtho(0.0, screen_size.width, -screen_size.height, 0.0, -1.0, 2.0);
-		glScaled(1.0, -1.0, 1.0);
+	batch_.end_layer();
 
-		glMatrixMode(GL_MODELVIEW);
-		glLoadIdentity();
-	}
-
-	magic_exec();
+	main_log << L"[cartographer] repaint(): after paint map" << main_log;
 
 	/* Картинка пользователя */
 	if (on_paint_handler_)
 	{
 		my::scope sc(L"on_paint()", L"[cartographer] repaint():");
 		on_paint_handler_(z_, screen_size);
-		magic_exec();
 	}
 
 	/* Показываем fix-точку при изменении масштаба */
@@ -1129,17 +2352,16 @@ void Base::repaint()
 			--central_cross_step_;
 		}
 
-		glLineWidth(3);
-		glColor4d( 1.0, 0.0, 0.0, central_cross_alpha_ );
+		const color cross_color(1.0, 0.0, 0.0, central_cross_alpha_);
 
-		glBegin(GL_LINES);
-			glVertex3d( center_pos.x - 8, center_pos.y - 8, 0.0 );
-			glVertex3d( center_pos.x + 8, center_pos.y + 8, 0.0 );
-			glVertex3d( center_pos.x - 8, center_pos.y + 8, 0.0 );
-			glVertex3d( center_pos.x + 8, center_pos.y - 8, 0.0 );
-		glEnd();
+		point line[2];
+		line[0] = point(center_pos.x - 8, center_pos.y - 8);
+		line[1] = point(center_pos.x + 8, center_pos.y + 8);
+		batch_.add_lines(line, 2, false, 3.0, cross_color);
 
-		check_gl_error();
+		line[0] = point(center_pos.x - 8, center_pos.y + 8);
+		line[1] = point(center_pos.x + 8, center_pos.y - 8);
+		batch_.add_lines(line, 2, false, 3.0, cross_color);
 	}
 
 	{
@@ -1147,6 +2369,18 @@ void Base::repaint()
 		after_repaint(screen_size);
 	}
 
+	/* Выводим накопленное за кадр */
+	{
+		my::scope sc(L"flush()", L"[cartographer] repaint():");
+
+		/* Шейдерам состояние фиксированного конвейера не мешает */
+		if (!batch_.shaders())
+			magic_exec();
+
+		batch_.flush();
+		check_gl_error();
+	}
+
 	{
 		my::scope sc(L"glGlush()", L"[cartographer] repaint():");
 		glFlush();
@@ -1158,9 +2392,11 @@ void Base::repaint()
 	delete_textures();
 
 	/* Загружаем текстуры из пирамиды, делаем это в конце функции,
-		чтобы не тормозить отрисовку */
+		чтобы не тормозить отрисовку, и не больше бюджета кадра */
 	load_textures();
 
+	snapshot_paint_stats();
+
 
 	/* Измеряем скорость и частоту отрисовки:
 		anim_speed - средняя скорость выполнения repaint()
@@ -1351,7 +2587,13 @@ void Base::on_image_delete_proc(image &img)
 {
 	GLuint texture_id = img.texture_id();
 	if (texture_id)
-		delete_texture_later(texture_id);
+		delete_texture_later( texture_pool::texture(texture_id,
+			img.raw().width(), img.raw().height(), img.raw().bpp(),
+			img.atlas_slot()) );
+
+	/* Пиксели так и не дождались загрузки в текстуру */
+	if (img.pbo_slot() >= 0)
+		pbo_ring_.release(img.pbo_slot());
 }
 
 } /* namespace cartographer */
@@ -4,6 +4,11 @@
 #include "config.h" /* Обязательно первым */
 #include "defs.h" /* point, coord, size */
 #include "image.h" /* image, sprite, tile */
+#include "tiles_queue.h"
+#include "tiles_cache.h"
+#include "tile_store.h"
+#include "render_batch.h"
+#include "http_pool.h"
 #include "font.h"
 #include "geodesic.h"
 
@@ -17,6 +22,8 @@
 
 #include <boost/unordered_map.hpp>
 #include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/detail/atomic_count.hpp>
 
 #include <wx/dcgraph.h> /* wxGCDC и wxGraphicsContext */
 #include <wx/mstream.h>  /* wxMemoryInputStream */
@@ -55,6 +62,103 @@ struct map_info
 };
 
 
+/*
+	Прямоугольная область тайлов одного слоя: [x1, x2) x [y1, y2)
+*/
+struct tiles_rect
+{
+	int x1;
+	int y1;
+	int x2;
+	int y2;
+
+	tiles_rect()
+		: x1(0), y1(0), x2(0), y2(0) {}
+
+	tiles_rect(int x1, int y1, int x2, int y2)
+		: x1(x1), y1(y1), x2(x2), y2(y2) {}
+
+	inline bool empty() const
+		{ return x1 >= x2 || y1 >= y2; }
+
+	inline bool operator==(const tiles_rect &other) const
+	{
+		return x1 == other.x1 && y1 == other.y1
+			&& x2 == other.x2 && y2 == other.y2;
+	}
+
+	inline bool operator!=(const tiles_rect &other) const
+		{ return !(*this == other); }
+};
+
+
+/*
+	Объёмы кэшей тайлов (в байтах) - см. конструктор Painter
+*/
+struct cache_sizes
+{
+	std::size_t ram; /* ОЗУ: декодированные тайлы */
+	std::size_t gpu; /* Видеопамять: текстуры */
+	boost::uint64_t raw; /* Диск: декодированные тайлы (0 - не использовать) */
+
+	cache_sizes()
+		: ram(64 * 1024 * 1024)
+		, gpu(128 * 1024 * 1024)
+		, raw(0) {}
+};
+
+
+/*
+	Счётчики загрузки тайлов по стадиям: диск/сервер -> декодирование
+	-> загрузка в текстуры
+*/
+struct loader_stats
+{
+	std::size_t file_queue; /* Ждут загрузки с диска */
+	std::size_t server_queue; /* Ждут загрузки с сервера */
+	std::size_t server_in_flight; /* Запрошены у сервера (в тайлах) */
+	std::size_t decode_queue; /* Ждут декодирования */
+	std::size_t texture_queue; /* Ждут загрузки в текстуры */
+	std::size_t decoders; /* Потоков декодирования */
+	long file_loaded; /* Найдено на диске */
+	long index_routed; /* Направлено по индексу хранилища мимо файлового загрузчика */
+	long server_loaded; /* Запрошено у сервера */
+	long decoded; /* Декодировано */
+	long unpacked; /* Загружено без декодирования (из кэша декодированных) */
+	long decode_errors; /* Ошибки декодирования */
+	long dropped; /* Отброшено - тайл покинул пирамиду */
+	int textures_uploaded; /* Загружено в текстуры за последний кадр */
+	std::size_t texture_upload_bytes; /* ... байт */
+	double texture_upload_time; /* ... затрачено времени (в мс) */
+	std::size_t upload_buffers; /* Буферов PBO (0 - PBO нет) */
+	std::size_t upload_buffers_busy; /* ... занято тайлами */
+	std::size_t free_textures; /* Свободных мест в атласе */
+	std::size_t atlas_pages; /* Страниц атласа */
+	std::size_t atlas_bytes; /* ... видеопамяти под ними */
+	unsigned long long textures_freed_bytes; /* Видеопамяти действительно освобождено при вытеснении */
+	long textures_created; /* Создано текстур */
+	long textures_recycled; /* Повторно использовано мест в атласе */
+	int draw_calls; /* Вызовов вывода за последний кадр */
+	int draw_primitives; /* ... примитивов в них (раньше - по вызову на каждый) */
+	int draw_state_changes; /* ... смен состояния OpenGL между ними */
+	bool draw_shaders; /* Вывод шейдерами (GLSL) */
+
+	loader_stats()
+		: file_queue(0), server_queue(0), server_in_flight(0)
+		, decode_queue(0), texture_queue(0), decoders(0)
+		, file_loaded(0), index_routed(0), server_loaded(0), decoded(0), unpacked(0)
+		, decode_errors(0), dropped(0)
+		, textures_uploaded(0), texture_upload_bytes(0)
+		, texture_upload_time(0.0)
+		, upload_buffers(0), upload_buffers_busy(0)
+		, free_textures(0), atlas_pages(0), atlas_bytes(0)
+		, textures_freed_bytes(0)
+		, textures_created(0), textures_recycled(0)
+		, draw_calls(0), draw_primitives(0)
+		, draw_state_changes(0), draw_shaders(false) {}
+};
+
+
 /*
 	Картографер
 */
@@ -66,7 +170,8 @@ public:
 
 	/* Конструктор */
 	Base(wxWindow *parent, const std::wstring &server_addr,
-		const std::wstring &init_map, std::size_t cache_size);
+		const std::wstring &init_map, const cache_sizes &caches,
+		std::size_t server_connections, std::size_t decoder_threads);
 
 	virtual ~Base();
 
@@ -75,9 +180,11 @@ public:
 protected:
 	typedef std::map<int, map_info> maps_list;
 	typedef boost::unordered_map<std::wstring, int> maps_name_to_id_list;
-	typedef my::mru::list<tile::id, tile::ptr> tiles_cache;
+	typedef std::map<int, tile_store::ptr> tile_stores_list;
 	typedef boost::unordered_map<int, sprite::ptr> sprites_list;
 	typedef boost::unordered_map<int, font::ptr> fonts_list;
+	typedef std::vector<tiles_rect> pyramid_t; /* Индекс - масштаб (z) */
+	typedef std::vector<my::worker::ptr> workers_list;
 
 	void stop(); /* Остановка Картографера */
 	void update(); /* Сейчас не действует. Только перерисовка за счёт анимации! */
@@ -87,13 +194,43 @@ protected:
 		Open GL
 	*/
 
-	typedef std::list<GLuint> texture_id_list;
+	typedef std::vector<texture_pool::texture> textures_list;
 	wxGLContext gl_context_;
 	GLuint magic_id_;
 	int load_texture_debug_counter_;
-	texture_id_list delete_texture_queue_;
+	texture_pool textures_; /* Пул текстур тайлов (только поток отрисовки) */
+	textures_list delete_texture_queue_; /* Освобождённые в других потоках */
 	mutex delete_texture_mutex_;
+	boost::detail::atomic_count delete_texture_pending_; /* Размер очереди */
 	int delete_texture_debug_counter_;
+	tiles_queue load_texture_queue_; /* Тайлы, готовые к загрузке в текстуры */
+
+	/* Загрузка текстур за один кадр ограничена по объёму и по времени
+		(хотя бы один тайл загружается всегда), остальное - в следующих
+		кадрах. Всё это - только в потоке отрисовки */
+	std::size_t upload_budget_bytes_;
+	posix_time::time_duration upload_budget_time_;
+	int upload_last_count_; /* Статистика последнего кадра */
+	std::size_t upload_last_bytes_;
+	double upload_last_time_;
+
+	/* Буферы PBO, в которые декодеры кладут пиксели тайлов */
+	pbo_ring pbo_ring_;
+
+	/* Всё, что рисуется за кадр, выводится пачками в конце кадра */
+	render_batch batch_;
+
+	/* Счётчики текстур и вывода (textures_, batch_, upload_last_*)
+		принадлежат потоку отрисовки - другим потокам (GetLoaderStats())
+		достаётся их снимок, сделанный в конце кадра */
+	loader_stats paint_stats_;
+	mutex paint_stats_mutex_;
+
+	/* Перевод тайлов выводимого слоя в экранные координаты */
+	point tiles_center_;
+	point tiles_origin_;
+	double tiles_scale_;
+	color tiles_color_;
 
 	void magic_init();
 	void magic_deinit();
@@ -101,10 +238,12 @@ protected:
 
 	static void check_gl_error();
 	void paint_tile(const tile::id &tile_id, int level = 0);
+	void load_texture_later(const tiles_queue::item &item);
 	void load_textures();
-	void delete_texture_later(GLuint texture_id);
-	void delete_texture(GLuint id);
+	void delete_texture_later(const texture_pool::texture &tex);
+	void delete_texture(const texture_pool::texture &tex);
 	void delete_textures();
+	void snapshot_paint_stats();
 
 
 	/*
@@ -112,7 +251,10 @@ protected:
 	*/
 
 	asio::io_service io_service_; /* Служба, обрабатывающая запросы к серверу */
+	boost::scoped_ptr<asio::io_service::work> io_work_; /* Не даёт io_service_ завершиться */
+	boost::thread io_thread_; /* Поток io_service_ */
 	asio::ip::tcp::endpoint server_endpoint_; /* Адрес сервера */
+	http_pool http_pool_; /* Постоянные соединения с сервером */
 
 	/* Загрузка данных с сервера */
 	void get(my::http::reply &reply, const std::wstring &request);
@@ -130,15 +272,16 @@ protected:
 	*/
 
 	std::wstring cache_path_; /* Путь к кэшу */
-	tiles_cache cache_; /* Кэш */
-	int cache_active_tiles_;
+	tiles_cache cache_; /* Кэш (имеет собственные блокировки) */
 	int basis_map_id_;
 	int basis_z_;
 	int basis_tile_x1_;
 	int basis_tile_y1_;
 	int basis_tile_x2_;
 	int basis_tile_y2_;
-	shared_mutex cache_mutex_; /* Мьютекс для кэша */
+	int pyramid_map_id_;
+	unsigned int pyramid_epoch_; /* Поколение пирамиды (меняется при каждой перестройке) */
+	pyramid_t pyramid_; /* Активная пирамида: области тайлов по слоям */
 
 	/* Проверка корректности координат тайла */
 	inline bool check_tile_id(const tile::id &tile_id);
@@ -150,24 +293,150 @@ protected:
 	int builder_debug_counter_;
 	inline tile::ptr get_tile(const tile::id &tile_id);
 
+	/* Перестройка активной пирамиды. Обрабатываются только тайлы,
+		вошедшие в пирамиду или покинувшие её */
+	void update_pyramid(int map_id, const pyramid_t &pyramid,
+		int z_i, const point &central_tile);
+
+	/* Тайл вошёл в пирамиду: закрепляем в кэше, ставим в очередь */
+	void acquire_tile(const tile::id &tile_id, int z_i,
+		const point &central_tile);
+
+	/* Тайл покинул пирамиду: открепляем, убираем из очередей */
+	void release_tile(const tile::id &tile_id);
+
+	/* Начальное состояние нового тайла - по индексу хранилища:
+		есть на диске - в файловую очередь, нет - сразу в серверную,
+		нет на сервере - готов (пустой) */
+	int initial_tile_state(const tile::id &tile_id);
+
 
 	/*
 		Загрузка тайлов
 	*/
 
 	my::worker::ptr file_loader_; /* "Работник" файловой очереди (синхронизация) */
-	tiles_cache::iterator file_iterator_; /* Итератор по кэшу */
+	tiles_queue file_queue_; /* Очередь на загрузку с диска */
 	int file_loader_dbg_loop_;
 	int file_loader_dbg_load_;
+	boost::detail::atomic_count file_loader_dbg_drop_;
+	boost::detail::atomic_count stores_imported_; /* Старый кэш перенесён в хранилища */
+	boost::detail::atomic_count index_routed_dbg_; /* Тайлов, направленных по индексу */
 
+	/* Задание на декодирование: файл на диске или ответ сервера */
+	struct decode_job
+	{
+		tiles_queue::item item;
+		tile_store::ptr store; /* Хранилище (если пусто - ответ сервера) */
+		my::http::reply reply;
+	};
+	typedef std::list<decode_job> decode_jobs_list;
+	typedef std::vector<tiles_queue::item> items_list;
+
+	/* Запрос "в полёте" (один на тайл или на пакет тайлов) */
+	struct server_request
+	{
+		http_pool::request_ptr req;
+		unsigned int serial; /* Отличает повторный запрос того же тайла */
+		std::size_t tiles; /* Сколько тайлов ещё ждут этот запрос */
+	};
+	typedef shared_ptr<server_request> server_request_ptr;
+	typedef boost::unordered_map<tile::id, server_request_ptr> server_requests_list;
+
+	/* Пакетный запрос: /maps/gettiles?map=..&z=..&tiles=x1,y1;x2,y2...
+		Тело ответа - последовательность частей "x,y,status,length\r\n"
+		+ length байт тайла. Части разбираются по мере поступления */
+	struct server_batch
+	{
+		items_list items; /* Ещё не полученные тайлы */
+		unsigned int serial;
+		std::string buf; /* Неразобранный остаток тела */
+	};
+	typedef shared_ptr<server_batch> server_batch_ptr;
+
+	/* Загрузка с сервера асинхронная: server_loader_ держит до
+		http_pool_.max_connections() запросов "в полёте", ответы
+		(в потоке io_service_) складываются в server_replies_,
+		откуда он передаёт их декодерам */
 	my::worker::ptr server_loader_; /* "Работник" серверной очереди (синхронизация) */
-	tiles_cache::iterator server_iterator_; /* Итератор по кэшу */
+	tiles_queue server_queue_; /* Очередь на загрузку с сервера */
+	server_requests_list server_requests_; /* Запросы "в полёте" */
+	mutex server_requests_mutex_;
+	unsigned int server_request_serial_;
+	std::size_t server_batch_size_; /* Тайлов в пакете (0, 1 - без пакетов) */
+	decode_jobs_list server_replies_; /* Полученные, но не переданные декодерам */
+	mutex server_replies_mutex_;
 	int server_loader_dbg_loop_;
 	int server_loader_dbg_load_;
+	boost::detail::atomic_count server_loader_dbg_drop_;
+
+	/* Декодирование - пулом потоков. Очередь ограничена: когда она
+		заполнена, загрузчики ждут, а не копят в памяти сжатые тайлы */
+	workers_list decoders_;
+	workers_list idle_decoders_; /* Спящие без работы - их и будим */
+	decode_jobs_list decode_queue_;
+	std::size_t decode_queue_limit_;
+	int tiles_opaque_bpp_; /* Формат тайлов без альфы: 24 (RGB) или 16 (RGB565) */
+	mutex decode_mutex_;
+	boost::detail::atomic_count decoded_count_;
+	boost::detail::atomic_count decode_errors_count_;
+	boost::detail::atomic_count unpacked_count_; /* Без декодирования (raw_stores_) */
+
+	/* Приоритет загрузки тайла относительно видимого слоя z_i
+		и центрального тайла (в координатах слоя z_i) */
+	static tiles_queue::priority tile_priority(const tile::id &tile_id,
+		int z_i, const point &central_tile);
+
+	/* Освобождение буфера PBO тайла, загрузка которого
+		в текстуру откладывается (поток отрисовки) */
+	void unload_pbo(const tile::id &tile_id, const tile::ptr &tile_ptr);
+
+	/* Постановка тайла в очередь в соответствии с его состоянием */
+	void enqueue_tile(const tile::id &tile_id, const tile::ptr &tile_ptr,
+		const tiles_queue::priority &prio);
 
 	/* Функции потоков */
 	void file_loader_proc(my::worker::ptr this_worker);
 	void server_loader_proc(my::worker::ptr this_worker);
+	void decoder_proc(my::worker::ptr this_worker);
+
+	/* Можно ли отправить ещё запрос (с учётом конвейера и пакетов) */
+	bool can_request_tiles();
+
+	/* Отправка запроса на тайл и обработка ответа (в потоке io_service_) */
+	void request_tile(const tiles_queue::item &item);
+	void on_tile_reply(const tiles_queue::item &item, unsigned int serial,
+		const boost::system::error_code &ec, my::http::reply &reply);
+
+	/* То же для пакета тайлов одного слоя */
+	void request_tiles(const items_list &items);
+	void on_batch_data(server_batch_ptr batch, const my::http::reply &reply,
+		const char *data, std::size_t size);
+	void on_batch_reply(server_batch_ptr batch,
+		const boost::system::error_code &ec, my::http::reply &reply);
+
+	/* Возврат в очередь тайлов, которые сервер не прислал (ошибка связи
+		или сервера, тайл пропущен в пакетном ответе). После нескольких
+		неудач тайл остаётся пустым и открепляется */
+	void retry_tiles(const items_list &items);
+
+	/* Тайл больше не ждёт запрос serial. Ответ передаётся на декодирование */
+	void finish_tile_request(const tile::id &tile_id, unsigned int serial);
+	void push_server_reply(const tiles_queue::item &item,
+		unsigned int status_code, std::string &body);
+
+	/* Постановка в очередь декодирования и проверка её заполненности */
+	void push_decode_job(decode_jobs_list &jobs);
+	bool decode_queue_full();
+
+	/* Декодирование тайла из хранилища */
+	void decode_file(decode_job &job, int opaque_bpp);
+
+	/* Декодирование и сохранение полученного с сервера тайла */
+	void decode_tile(decode_job &job, int opaque_bpp);
+
+	/* Декодированные пиксели - во второй уровень дискового кэша */
+	void save_packed(const tile::id &tile_id, const std::string &packed);
 
 
 	/*
@@ -193,6 +462,61 @@ protected:
 	maps_list maps_; /* Список карт (по числовому id) */
 	maps_name_to_id_list maps_name_to_id_; /* name -> id */
 
+	/* Дисковый кэш тайлов (по id карты). Заполняется при создании,
+		дальше только читается - без блокировок */
+	tile_stores_list tile_stores_;
+
+	/* Второй уровень дискового кэша (по id карты, если включён):
+		декодированные пиксели (image::load_from_packed) - повторная
+		загрузка тайла без декодирования JPEG/PNG. Своя квота */
+	tile_stores_list raw_stores_;
+	boost::uint64_t raw_limit_;
+
+	/* Хранилища карты (пустое - нет) */
+	tile_store::ptr get_tile_store(int map_id);
+	tile_store::ptr get_raw_store(int map_id);
+
+	/* Поиск тайла в хранилищах карты. Тайл, вытесненный из основного
+		хранилища, может остаться в кэше декодированных - он найден */
+	tile_store::result find_stored_tile(const tile::id &tile_id,
+		const tile_store::ptr &store);
+
+	/* Перенос в хранилища старого кэша (файл на тайл) */
+	void import_cache_trees();
+
+	/* Отложенная запись в хранилища: декодеры только ставят тайлы
+		в очередь, пишет отдельный поток - пачками */
+	my::worker::ptr disk_writer_; /* "Работник" записи (синхронизация) */
+	void disk_writer_proc(my::worker::ptr this_worker);
+	bool disk_writes_pending();
+	void flush_tile_stores(tile_stores_list &stores);
+
+	/* Обслуживание хранилищ - фоновый поток: учёт обращений,
+		вытеснение давно не читанных тайлов по квоте, сжатие файлов.
+		Будят его декодеры, когда хранилищу требуется обслуживание */
+	my::worker::ptr disk_keeper_; /* "Работник" обслуживания (синхронизация) */
+	mutex disk_limit_mutex_;
+	boost::uint64_t disk_limit_; /* Квота на все хранилища (0 - без ограничения) */
+
+	boost::uint64_t disk_limit();
+	bool disk_keeper_needed();
+	bool disk_keeper_needed(tile_stores_list &stores, boost::uint64_t limit);
+	void disk_keeper_proc(my::worker::ptr this_worker);
+
+	/* Учёт обращений, вытеснение и сжатие хранилищ одного уровня.
+		false - были ошибки */
+	bool maintain_stores(tile_stores_list &stores, boost::uint64_t limit,
+		boost::uint32_t tick);
+
+	/* finish() - для boost::bind (my::employer - закрытая база) */
+	bool finishing()
+		{ return finish(); }
+
+	/* Вытеснение по квоте: общий LRU по хранилищам уровня.
+		Возвращает хранилища, из которых вытеснены тайлы */
+	void evict_cold_tiles(tile_stores_list &stores, boost::uint64_t limit,
+		std::vector<tile_store::ptr> &evicted_from);
+
 	/* Уникальный идентификатор загруженный карты */
 	static int get_new_map_id()
 	{
@@ -15,8 +15,10 @@ namespace cartographer
 {
 
 Painter::Painter(wxWindow *parent, const std::wstring &server_addr,
-	const std::wstring &init_map, std::size_t cache_size)
-	: Base(parent, server_addr, init_map, cache_size)
+	const std::wstring &init_map, const cache_sizes &caches,
+	std::size_t server_connections, std::size_t decoder_threads)
+	: Base(parent, server_addr, init_map, caches,
+		server_connections, decoder_threads)
 	, sprites_index_(0)
 	, MY_MUTEX_DEF(sprites_mutex_,true)
 	, fonts_index_(0)
@@ -436,19 +438,8 @@ void Painter::DrawImage(int image_id, const point &pos, const ratio &scale,
 		rb = rb.rotate(a) + screen_offset;
 		lb = lb.rotate(a) + screen_offset;
 
-		glColor4dv(&blend_color.r);
-
-		glBindTexture(GL_TEXTURE_2D, texture_id);
-		glBegin(GL_QUADS);
-			glTexCoord2d(0.0, 0.0); glVertex3d(lt.x, lt.y, 0);
-			glTexCoord2d(1.0, 0.0); glVertex3d(rt.x, rt.y, 0);
-			glTexCoord2d(1.0, 1.0); glVertex3d(rb.x, rb.y, 0);
-			glTexCoord2d(0.0, 1.0); glVertex3d(lb.x, lb.y, 0);
-		glEnd();
-
-		magic_exec();
-
-		check_gl_error();
+		batch_.add_quad(texture_id, lt, rt, rb, lb,
+			0.0, 0.0, 1.0, 1.0, blend_color);
 	}
 }
 
@@ -490,12 +481,9 @@ size Painter::DrawText(int font_id, const std::wstring &str, const point &pos,
 	{
 		font::ptr font_ptr = iter->second;
 
-		glColor4dv(&text_color.r);
-		sz = font_ptr->draw(str, pos, center, scale);
+		sz = font_ptr->draw(batch_, str, pos, text_color, center, scale);
 	}
 
-	magic_exec();
-
 	check_gl_error();
 
 	return sz;
@@ -519,31 +507,18 @@ void Painter::DrawSimpleCircle(const point &center, double radius,
 
 	step *= M_PI / 180.0;
 
-	/* Сначала круг, затем окружность */
-	for (int n = 0; n < 2; ++n)
-	{
-		if (n == 0)
-		{
-			glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-			glBegin(GL_POLYGON);
-			glColor4dv(&fill_color.r);
-		}
-		else
-		{
-			glLineWidth(line_width);
-			glBegin(GL_LINE_LOOP);
-			glColor4dv(&line_color.r);
-		}
+	std::vector<point> pts;
 
-		for (double a = 2.0 * M_PI; a > 0.0; a -= step)
-		{
-			point pos( center.x + radius * cos(a),
-				center.y + radius * sin(a) );
-			glVertex3d(pos.x, pos.y, 0);
-		}
+	for (double a = 2.0 * M_PI; a > 0.0; a -= step)
+		pts.push_back( point( center.x + radius * cos(a),
+			center.y + radius * sin(a) ) );
 
-		glEnd();
-	}
+	if (pts.empty())
+		return;
+
+	/* Сначала круг, затем окружность */
+	batch_.add_polygon(&pts[0], pts.size(), fill_color);
+	batch_.add_lines(&pts[0], pts.size(), true, line_width, line_color);
 }
 
 void Painter::DrawSimpleCircle(const coord &center, double radius_in_m,
@@ -574,47 +549,35 @@ void Painter::DrawCircle(const coord &center, double radius_in_m,
 
 	point center_pos = CoordToScreen(center);
 
-	/* Сначала круг, затем окружность */
-	for (int n = 0; n < 2; ++n)
+	std::vector<point> pts;
+
+	for (double a = 0.0; a < 360.0; a += step)
 	{
-		if (n == 0)
-		{
-			glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-			glBegin(GL_POLYGON);
-			glColor4dv(&fill_color.r);
-		}
-		else
-		{
-			glLineWidth(line_width);
-			glBegin(GL_LINE_LOOP);
-			glColor4dv(&line_color.r);
-		}
+		coord ptN = Direct(center, a, radius_in_m);
+		point ptN_pos = CoordToScreen(ptN);
 
-		for (double a = 0.0; a < 360.0; a += step)
+		if (a == 0.0)
 		{
-			coord ptN = Direct(center, a, radius_in_m);
-			point ptN_pos = CoordToScreen(ptN);
-
-			if (a == 0.0)
-			{
-				/* При малых радиусах - нет необходимости в мелком шаге */
-				double radius = center_pos.y - ptN_pos.y;
+			/* При малых радиусах - нет необходимости в мелком шаге */
+			double radius = center_pos.y - ptN_pos.y;
 
-				step = 180.0 / (M_PI * radius);
+			step = 180.0 / (M_PI * radius);
 
-				if (step < 1.0)
-					step = 1.0;
+			if (step < 1.0)
+				step = 1.0;
 
-				/* Применяем такое хитрое сравнение на случай,
-					если step получился NAN или INF */
-				if ( !(step < 60.0) )
-					step = 60.0;
-			}
-
-			glVertex3d(ptN_pos.x, ptN_pos.y, 0);
+			/* Применяем такое хитрое сравнение на случай,
+				если step получился NAN или INF */
+			if ( !(step < 60.0) )
+				step = 60.0;
 		}
-		glEnd();
+
+		pts.push_back(ptN_pos);
 	}
+
+	/* Сначала круг, затем окружность */
+	batch_.add_polygon(&pts[0], pts.size(), fill_color);
+	batch_.add_lines(&pts[0], pts.size(), true, line_width, line_color);
 }
 
 coord Painter::DrawPath(const coord &pt, double azimuth, double distance,
@@ -622,14 +585,12 @@ coord Painter::DrawPath(const coord &pt, double azimuth, double distance,
 {
 	my::scope sc(L"DrawPath(direct)", L"[cartographer]");
 
-	glLineWidth(line_width);
-	glBegin(GL_LINE_STRIP);
-	glColor4dv(&line_color.r);
+	std::vector<point> pts;
 
 	coord ptN = pt;
 	point ptN_pos = CoordToScreen(ptN);
 
-	glVertex3d(ptN_pos.x, ptN_pos.y, 0);
+	pts.push_back(ptN_pos);
 
 	/* Делим путь на равные промежутки и вычисляем координаты узлов */
 	double step = distance / 10.0;
@@ -675,18 +636,18 @@ coord Painter::DrawPath(const coord &pt, double azimuth, double distance,
 			point ptM_P_pos = CoordToScreen(ptM_P);
 
 			/* Дочерчиваем линию на предыдущей стороне */
-			glVertex3d(ptM_P_pos.x, ptM_P_pos.y, 0);
-			glEnd();
+			pts.push_back(ptM_P_pos);
+			batch_.add_lines(&pts[0], pts.size(), false, line_width, line_color);
 
 			/* ... и переходим на новую сторону */
-			glBegin(GL_LINE_STRIP);
-			glColor4dv(&line_color.r);
-			glVertex3d(ptM_N_pos.x, ptM_N_pos.y, 0);
+			pts.clear();
+			pts.push_back(ptM_N_pos);
 		}
 
-		glVertex3d(ptN_pos.x, ptN_pos.y, 0);
+		pts.push_back(ptN_pos);
 	}
-	glEnd();
+
+	batch_.add_lines(&pts[0], pts.size(), false, line_width, line_color);
 
 	return ptN;
 }
@@ -709,6 +670,162 @@ double Painter::DrawPath(const coord &pt1, const coord &pt2,
 	return distance;
 }
 
+void Painter::SetServerPipelining(std::size_t depth)
+{
+	my::scope sc(L"SetServerPipelining()", L"[cartographer]");
+
+	http_pool_.set_pipeline_depth(depth);
+
+	if (server_loader_)
+		wake_up(server_loader_);
+}
+
+void Painter::SetServerBatch(std::size_t max_tiles)
+{
+	my::scope sc(L"SetServerBatch()", L"[cartographer]");
+
+	{
+		unique_lock<mutex> lock(server_requests_mutex_);
+		server_batch_size_ = max_tiles;
+	}
+
+	if (server_loader_)
+		wake_up(server_loader_);
+}
+
+void Painter::SetTilesLowMemory(bool on)
+{
+	my::scope sc(L"SetTilesLowMemory()", L"[cartographer]");
+
+	unique_lock<mutex> lock(decode_mutex_);
+	tiles_opaque_bpp_ = on ? 16 : 24;
+}
+
+void Painter::SetTextureUploadBudget(std::size_t max_bytes, int max_ms)
+{
+	my::scope sc(L"SetTextureUploadBudget()", L"[cartographer]");
+
+	upload_budget_bytes_ = max_bytes;
+	upload_budget_time_ = posix_time::milliseconds(max_ms);
+}
+
+void Painter::UseHugePages(bool on)
+{
+	my::scope sc(L"UseHugePages()", L"[cartographer]");
+
+	use_huge_pages_for_pixels(on);
+}
+
+bool Painter::UseShaders(bool on)
+{
+	my::scope sc(L"UseShaders()", L"[cartographer]");
+
+	SetCurrent(gl_context_);
+
+	bool ok = batch_.use_shaders(on);
+
+	if (on && !ok)
+		main_log << L"[cartographer] GLSL: "
+			<< my::utf8::decode(batch_.shaders_error()) << main_log;
+
+	return ok;
+}
+
+pixel_buffers_stats Painter::GetPixelBuffersStats()
+{
+	my::scope sc(L"GetPixelBuffersStats()", L"[cartographer]");
+
+	return get_pixel_buffers_stats();
+}
+
+void Painter::SetDiskCacheLimit(boost::uint64_t max_bytes)
+{
+	my::scope sc(L"SetDiskCacheLimit()", L"[cartographer]");
+
+	{
+		unique_lock<mutex> lock(disk_limit_mutex_);
+		disk_limit_ = max_bytes;
+	}
+
+	wake_up(disk_keeper_);
+}
+
+tile_store::stats Painter::GetDiskCacheStats()
+{
+	my::scope sc(L"GetDiskCacheStats()", L"[cartographer]");
+
+	tile_store::stats st;
+
+	for (tile_stores_list::iterator iter = tile_stores_.begin();
+		iter != tile_stores_.end(); ++iter)
+	{
+		st += iter->second->get_stats();
+	}
+
+	return st;
+}
+
+tile_store::stats Painter::GetRawCacheStats()
+{
+	my::scope sc(L"GetRawCacheStats()", L"[cartographer]");
+
+	tile_store::stats st;
+
+	for (tile_stores_list::iterator iter = raw_stores_.begin();
+		iter != raw_stores_.end(); ++iter)
+	{
+		st += iter->second->get_stats();
+	}
+
+	return st;
+}
+
+tiles_cache::stats Painter::GetCacheStats()
+{
+	my::scope sc(L"GetCacheStats()", L"[cartographer]");
+
+	return cache_.get_stats();
+}
+
+loader_stats Painter::GetLoaderStats()
+{
+	my::scope sc(L"GetLoaderStats()", L"[cartographer]");
+
+	loader_stats st;
+
+	/* Счётчики потока отрисовки - из снимка последнего кадра */
+	{
+		unique_lock<mutex> lock(paint_stats_mutex_);
+		st = paint_stats_;
+	}
+
+	st.file_queue = file_queue_.size();
+	st.server_queue = server_queue_.size();
+	st.texture_queue = load_texture_queue_.size();
+	st.decoders = decoders_.size();
+	st.file_loaded = file_loader_dbg_load_;
+	st.index_routed = index_routed_dbg_;
+	st.server_loaded = server_loader_dbg_load_;
+	st.decoded = decoded_count_;
+	st.unpacked = unpacked_count_;
+	st.decode_errors = decode_errors_count_;
+	st.dropped = file_loader_dbg_drop_ + server_loader_dbg_drop_;
+	st.upload_buffers = pbo_ring_.size();
+	st.upload_buffers_busy = pbo_ring_.in_use();
+
+	{
+		unique_lock<mutex> lock(server_requests_mutex_);
+		st.server_in_flight = server_requests_.size();
+	}
+
+	{
+		unique_lock<mutex> lock(decode_mutex_);
+		st.decode_queue = decode_queue_.size();
+	}
+
+	return st;
+}
+
 void Painter::after_repaint(const size &screen_size)
 {
 	my::scope sc(L"after_repaint()", L"[cartographer]");
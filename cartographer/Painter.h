@@ -25,13 +25,28 @@ public:
 			init_map - Исходная карта:
 				L"Яндекс.Карта", L"Яндекс.Спутник", L"Google.Спутник".
 				Если строка пустая - устанавливается первая из имеющихся.
-			cache_size - Количество тайлов, хранимых в кэше:
-				для экрана 1280 на 1024 минимальное кол-во - ~300
+			caches - Объёмы кэшей (в байтах):
+				ram - ОЗУ под декодированные, но ещё не загруженные
+					в текстуры тайлы (по умолчанию 64 МБ);
+				gpu - видеопамять под текстуры тайлов. Тайл 256x256
+					с альфой занимает 256 КБ, без альфы (JPEG) - 192 КБ,
+					для экрана 1280 на 1024 необходимо ~300 тайлов,
+					т.е. ~56-75 МБ (по умолчанию 128 МБ);
+				raw - диск под уже декодированные тайлы (сжатые LZ4):
+					повторная загрузка тайла без декодирования JPEG/PNG.
+					Тайл 256x256 занимает до 256 КБ. 0 - не использовать
+					(по умолчанию)
+			server_connections - Количество одновременных (постоянных)
+				соединений с сервером
+			decoder_threads - Количество потоков декодирования тайлов.
+				0 - по количеству ядер процессора
 	*/
 	Painter(wxWindow *parent,
 		const std::wstring &server_addr = std::wstring(),
 		const std::wstring &init_map = std::wstring(),
-		std::size_t cache_size = 500);
+		const cache_sizes &caches = cache_sizes(),
+		std::size_t server_connections = 4,
+		std::size_t decoder_threads = 0);
 
 	~Painter();
 
@@ -273,6 +288,63 @@ public:
 	double FlashAlpha()
 		{ return flash_alpha_; }
 
+	/* Конвейерная отправка запросов (HTTP pipelining): не более depth
+		запросов на одно соединение. 1 - без конвейера (по умолчанию) */
+	void SetServerPipelining(std::size_t depth);
+
+	/* Пакетная загрузка тайлов (/maps/gettiles): не более max_tiles
+		тайлов одного слоя в запросе. 0 - без пакетов (по умолчанию).
+		Если сервер пакетные запросы не поддерживает, они отключаются */
+	void SetServerBatch(std::size_t max_tiles);
+
+	/* Режим экономии памяти: непрозрачные тайлы (JPEG, PNG без альфы)
+		хранятся в RGB565 вместо RGB - вдвое меньше RGBA, но с потерей
+		точности цвета. Касается тайлов, загруженных после вызова */
+	void SetTilesLowMemory(bool on);
+
+	/* Бюджет загрузки текстур за кадр: не более max_bytes пикселей
+		и max_ms миллисекунд (по умолчанию 4 МБ и 4 мс). Остальные тайлы
+		загружаются в следующих кадрах, сначала - видимые и ближе к центру.
+		Вызывать из потока отрисовки (главного) */
+	void SetTextureUploadBudget(std::size_t max_bytes, int max_ms);
+
+	/* Большие страницы (huge pages) под пиксели тайлов. Действует
+		на память, которую пул буферов возьмёт у системы после вызова,
+		поэтому вызывать лучше сразу после создания. Требует настройки
+		системы (Linux: vm.nr_hugepages, Windows: SeLockMemoryPrivilege),
+		без неё используются обычные страницы */
+	void UseHugePages(bool on);
+
+	/* Вывод шейдерами (GLSL 1.20, OpenGL 2.0) вместо фиксированного
+		конвейера: цвет и наложение текстуры - явные параметры программы,
+		без обходных манёвров с состоянием OpenGL. Возвращает, включены ли
+		шейдеры (false - OpenGL их не поддерживает, вывод по-старому).
+		Вызывать из потока отрисовки (главного) */
+	bool UseShaders(bool on);
+
+	/* Квота дискового кэша (в байтах, на все карты). 0 - без
+		ограничения (по умолчанию). При превышении фоновый поток
+		вытесняет давно не читанные тайлы и сжимает файлы хранилищ */
+	void SetDiskCacheLimit(boost::uint64_t max_bytes);
+
+	/* Статистика дискового кэша (сумма по картам): объём, попадания,
+		промахи, вытеснения, сжатия, очередь на запись */
+	tile_store::stats GetDiskCacheStats();
+
+	/* ... то же для декодированных тайлов (см. cache_sizes::raw) */
+	tile_store::stats GetRawCacheStats();
+
+	/* Статистика пула буферов под пиксели: объём, пиковое использование */
+	pixel_buffers_stats GetPixelBuffersStats();
+
+	/* Статистика кэша тайлов: расход памяти (в т.ч. по форматам
+		пикселей), закреплённые тайлы, превышение лимитов (если
+		активная пирамида в них не умещается) */
+	tiles_cache::stats GetCacheStats();
+
+	/* Счётчики загрузки тайлов по стадиям */
+	loader_stats GetLoaderStats();
+
 protected:
 	int sprites_index_;
 	sprites_list sprites_;
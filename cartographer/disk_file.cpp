@@ -0,0 +1,151 @@
+﻿#include "disk_file.h"
+
+#include <mylib.h> /* my::utf8::encode */
+
+#ifdef BOOST_WINDOWS
+	#include <windows.h> /* CreateFileW, ReadFile, WriteFile */
+#else
+	#include <sys/types.h>
+	#include <sys/stat.h> /* fstat */
+	#include <fcntl.h> /* open */
+	#include <unistd.h> /* pread, pwrite, ftruncate */
+#endif
+
+namespace cartographer
+{
+
+disk_file::disk_file()
+	: handle_( invalid_handle() )
+{
+}
+
+disk_file::~disk_file()
+{
+	close();
+}
+
+bool disk_file::open(const std::wstring &filename, bool read_only)
+{
+	close();
+
+#ifdef BOOST_WINDOWS
+	handle_ = CreateFileW(filename.c_str(),
+		read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, read_only ? OPEN_EXISTING : OPEN_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+#else
+	handle_ = ::open(my::utf8::encode(filename).c_str(),
+		read_only ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+#endif
+
+	return is_open();
+}
+
+void disk_file::close()
+{
+	if (!is_open())
+		return;
+
+#ifdef BOOST_WINDOWS
+	CloseHandle(handle_);
+#else
+	::close(handle_);
+#endif
+
+	handle_ = invalid_handle();
+}
+
+boost::uint64_t disk_file::size() const
+{
+#ifdef BOOST_WINDOWS
+	LARGE_INTEGER sz;
+	if (!GetFileSizeEx(handle_, &sz))
+		return 0;
+	return (boost::uint64_t)sz.QuadPart;
+#else
+	struct stat st;
+	if (fstat(handle_, &st) != 0)
+		return 0;
+	return (boost::uint64_t)st.st_size;
+#endif
+}
+
+bool disk_file::read_at(void *buf, std::size_t size, boost::uint64_t offset) const
+{
+	char *ptr = (char*)buf;
+
+	while (size)
+	{
+#ifdef BOOST_WINDOWS
+		OVERLAPPED ov = {0};
+		ov.Offset = (DWORD)offset;
+		ov.OffsetHigh = (DWORD)(offset >> 32);
+
+		DWORD done = 0;
+		if (!ReadFile(handle_, ptr, (DWORD)size, &done, &ov) || done == 0)
+			return false;
+#else
+		ssize_t done = ::pread(handle_, ptr, size, (off_t)offset);
+		if (done <= 0)
+			return false;
+#endif
+
+		ptr += done;
+		size -= done;
+		offset += done;
+	}
+
+	return true;
+}
+
+bool disk_file::write_at(const void *buf, std::size_t size, boost::uint64_t offset)
+{
+	const char *ptr = (const char*)buf;
+
+	while (size)
+	{
+#ifdef BOOST_WINDOWS
+		OVERLAPPED ov = {0};
+		ov.Offset = (DWORD)offset;
+		ov.OffsetHigh = (DWORD)(offset >> 32);
+
+		DWORD done = 0;
+		if (!WriteFile(handle_, ptr, (DWORD)size, &done, &ov) || done == 0)
+			return false;
+#else
+		ssize_t done = ::pwrite(handle_, ptr, size, (off_t)offset);
+		if (done <= 0)
+			return false;
+#endif
+
+		ptr += done;
+		size -= done;
+		offset += done;
+	}
+
+	return true;
+}
+
+bool disk_file::truncate(boost::uint64_t size)
+{
+#ifdef BOOST_WINDOWS
+	LARGE_INTEGER pos;
+	pos.QuadPart = (LONGLONG)size;
+	return SetFilePointerEx(handle_, pos, NULL, FILE_BEGIN)
+		&& SetEndOfFile(handle_);
+#else
+	return ::ftruncate(handle_, (off_t)size) == 0;
+#endif
+}
+
+void disk_file::sync()
+{
+#ifdef BOOST_WINDOWS
+	FlushFileBuffers(handle_);
+#else
+	::fsync(handle_);
+#endif
+}
+
+} /* namespace cartographer */
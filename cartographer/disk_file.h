@@ -0,0 +1,67 @@
+﻿#ifndef CARTOGRAPHER_DISK_FILE_H
+#define CARTOGRAPHER_DISK_FILE_H
+
+#include "config.h" /* Обязательно первым */
+
+#include <cstddef> /* std::size_t */
+#include <string>
+
+#include <boost/cstdint.hpp> /* boost::uint64_t */
+
+namespace cartographer
+{
+
+/*
+	Файл с чтением и записью по смещению (pread/pwrite, ReadFile
+	с OVERLAPPED) - без общего указателя позиции, поэтому читать
+	из разных потоков можно одновременно и без блокировок
+*/
+class disk_file
+{
+public:
+	disk_file();
+	~disk_file();
+
+	/* Открытие на чтение и запись (если файла нет - создаётся)
+		или только на чтение. false - ошибка */
+	bool open(const std::wstring &filename, bool read_only = false);
+	void close();
+
+	inline bool is_open() const
+		{ return handle_ != invalid_handle(); }
+
+	/* Размер файла */
+	boost::uint64_t size() const;
+
+	/* Чтение и запись size байт по смещению offset. false - ошибка
+		(в т.ч. прочитано меньше size байт) */
+	bool read_at(void *buf, std::size_t size, boost::uint64_t offset) const;
+	bool write_at(const void *buf, std::size_t size, boost::uint64_t offset);
+
+	/* Обрезка файла */
+	bool truncate(boost::uint64_t size);
+
+	/* Сброс на диск */
+	void sync();
+
+private:
+#ifdef BOOST_WINDOWS
+	typedef void* handle_t;
+	static inline handle_t invalid_handle()
+		{ return (handle_t)(-1); } /* INVALID_HANDLE_VALUE */
+#else
+	typedef int handle_t;
+	static inline handle_t invalid_handle()
+		{ return -1; }
+#endif
+
+	handle_t handle_;
+
+	/* Копирование запрещено */
+	disk_file(const disk_file&);
+	disk_file& operator=(const disk_file&);
+};
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_DISK_FILE_H */
@@ -8,8 +8,8 @@
 namespace cartographer
 {
 
-size font::draw(const std::wstring &str, const point &pos,
-	const ratio &center, const ratio &scale)
+size font::draw(render_batch &batch, const std::wstring &str, const point &pos,
+	const color &text_color, const ratio &center, const ratio &scale)
 {
 	size sz;
 
@@ -62,13 +62,8 @@ size font::draw(const std::wstring &str, const point &pos,
 		double tw = ci.width / raw_width;
 		double th = ci.height / raw_height;
 
-		glBindTexture(GL_TEXTURE_2D, texture_id);
-		glBegin(GL_QUADS);
-			glTexCoord2d(tx,      ty);      glVertex3d(x,        y,        0);
-			glTexCoord2d(tx + tw, ty);      glVertex3d(x + ch_w, y,        0);
-			glTexCoord2d(tx + tw, ty + th); glVertex3d(x + ch_w, y + ch_h, 0);
-			glTexCoord2d(tx,      ty + th); glVertex3d(x,        y + ch_h, 0);
-		glEnd();
+		batch.add_rect(texture_id, x, y, x + ch_w, y + ch_h,
+			tx, ty, tx + tw, ty + th, text_color);
 
 		x += (ci.width - 2.0 * ci.border.width) * scale.kx;
 	}
@@ -87,13 +82,8 @@ size font::draw(const std::wstring &str, const point &pos,
 		double w = image_ptr->raw().width();
 		double h = image_ptr->raw().height();
 
-		glBindTexture(GL_TEXTURE_2D, texture_id);
-		glBegin(GL_QUADS);
-			glTexCoord2d(0.0, 0.0); glVertex3d(x,     y,     0);
-			glTexCoord2d(1.0, 0.0); glVertex3d(x + w, y,     0);
-			glTexCoord2d(1.0, 1.0); glVertex3d(x + w, y + h, 0);
-			glTexCoord2d(0.0, 1.0); glVertex3d(x,     y + h, 0);
-		glEnd();
+		batch.add_rect(texture_id, x, y, x + w, y + h,
+			0.0, 0.0, 1.0, 1.0, text_color);
 
 		y += h;
 	}
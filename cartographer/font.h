@@ -4,6 +4,7 @@
 #include "config.h"
 #include "defs.h"
 #include "image.h"
+#include "render_batch.h"
 
 #include <my_ptr.h>
 
@@ -53,10 +54,10 @@ public:
 	inline void prepare(const std::wstring &ranges)
 		{ prepare_chars( chars_from_ranges(ranges) ); }
 	
-	/* Вывод текста. Все символы, для которых ещё
+	/* Вывод текста (в batch). Все символы, для которых ещё
 		не были загружены текстуры, будут загружены */
-	size draw(const std::wstring &str, const point &pos,
-		const ratio &center, const ratio &scale);
+	size draw(render_batch &batch, const std::wstring &str, const point &pos,
+		const color &text_color, const ratio &center, const ratio &scale);
 
 private:
 	typedef boost::unordered_map<int, image::ptr> images_list;
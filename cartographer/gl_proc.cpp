@@ -0,0 +1,47 @@
+﻿#include "gl_proc.h"
+
+#include <cstdio> /* std::sscanf */
+#include <cstring> /* std::strstr */
+
+#ifndef BOOST_WINDOWS
+	#include <GL/glx.h> /* glXGetProcAddressARB */
+#endif
+
+namespace cartographer
+{
+
+void* get_gl_proc(const char *name)
+{
+#if defined(BOOST_WINDOWS)
+	return (void*)wglGetProcAddress(name);
+#else
+	return (void*)glXGetProcAddressARB((const GLubyte*)name);
+#endif
+}
+
+void get_gl_version(int &major, int &minor)
+{
+	const char *version = (const char*)glGetString(GL_VERSION);
+
+	major = 0;
+	minor = 0;
+
+	if (version)
+		std::sscanf(version, "%d.%d", &major, &minor);
+}
+
+bool gl_supports(int major, int minor, const char *extension)
+{
+	int gl_major, gl_minor;
+	get_gl_version(gl_major, gl_minor);
+
+	if (gl_major > major || (gl_major == major && gl_minor >= minor))
+		return true;
+
+	const char *extensions = (const char*)glGetString(GL_EXTENSIONS);
+
+	return extension && extensions
+		&& std::strstr(extensions, extension) != 0;
+}
+
+} /* namespace cartographer */
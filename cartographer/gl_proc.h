@@ -0,0 +1,27 @@
+﻿#ifndef CARTOGRAPHER_GL_PROC_H
+#define CARTOGRAPHER_GL_PROC_H
+
+#include "config.h" /* Обязательно первым */
+
+#include <GL/gl.h> /* OpenGL */
+
+namespace cartographer
+{
+
+/*
+	Доступ к функциям OpenGL выше 1.1 (в gl.h Windows их нет).
+	Только в потоке OpenGL при активном контексте
+*/
+
+/* Адрес функции (0 - нет) */
+void* get_gl_proc(const char *name);
+
+/* Версия OpenGL */
+void get_gl_version(int &major, int &minor);
+
+/* Версия не ниже major.minor или есть расширение extension */
+bool gl_supports(int major, int minor, const char *extension);
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_GL_PROC_H */
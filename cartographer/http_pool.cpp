@@ -0,0 +1,813 @@
+﻿#include "http_pool.h"
+
+#include <istream>
+#include <sstream>
+#include <cstdlib> /* std::strtoul */
+#include <iterator> /* std::advance */
+#include <algorithm> /* std::search, std::min */
+
+#include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+
+namespace cartographer
+{
+
+typedef asio::streambuf::const_buffers_type const_buffers;
+typedef asio::buffers_iterator<const_buffers> buffers_iterator;
+
+/* Извлечение из буфера первых n байт */
+static std::string take(asio::streambuf &buf, std::size_t n)
+{
+	const_buffers data = buf.data();
+	std::string str( buffers_iterator::begin(data),
+		buffers_iterator::begin(data) + n );
+	buf.consume(n);
+	return str;
+}
+
+
+/*
+	http_reply_parser
+*/
+
+void http_reply_parser::reset()
+{
+	state_ = st_status;
+	keep_alive_ = true;
+	chunked_ = false;
+	has_length_ = false;
+	length_ = 0;
+	bytes_needed_ = 0;
+}
+
+bool http_reply_parser::get_line(asio::streambuf &buf, std::string &line)
+{
+	static const char crlf[] = "\r\n";
+
+	const_buffers data = buf.data();
+	buffers_iterator begin = buffers_iterator::begin(data);
+	buffers_iterator end = buffers_iterator::end(data);
+	buffers_iterator iter = std::search(begin, end, crlf, crlf + 2);
+
+	if (iter == end)
+		return false;
+
+	line.assign(begin, iter);
+	buf.consume(iter - begin + 2);
+
+	return true;
+}
+
+void http_reply_parser::on_header(const std::string &line)
+{
+	std::size_t pos = line.find(':');
+	if (pos == std::string::npos)
+		return;
+
+	std::string name = boost::algorithm::trim_copy(line.substr(0, pos));
+	std::string value = boost::algorithm::trim_copy(line.substr(pos + 1));
+
+	if (boost::algorithm::iequals(name, "Content-Length"))
+	{
+		has_length_ = true;
+		length_ = (std::size_t)std::strtoul(value.c_str(), 0, 10);
+	}
+	else if (boost::algorithm::iequals(name, "Transfer-Encoding"))
+		chunked_ = boost::algorithm::icontains(value, "chunked");
+	else if (boost::algorithm::iequals(name, "Connection"))
+	{
+		if (boost::algorithm::iequals(value, "close"))
+			keep_alive_ = false;
+		else if (boost::algorithm::iequals(value, "keep-alive"))
+			keep_alive_ = true;
+	}
+}
+
+void http_reply_parser::on_body(asio::streambuf &buf, std::size_t size)
+{
+	if (!body_handler_)
+		reply_.body += take(buf, size);
+	else
+	{
+		body_handler_( reply_,
+			asio::buffer_cast<const char*>(buf.data()), size );
+		buf.consume(size);
+	}
+}
+
+http_reply_parser::result http_reply_parser::parse(asio::streambuf &buf)
+{
+	std::string line;
+
+	while (true)
+	{
+		switch (state_)
+		{
+			/* Строка статуса: HTTP/1.1 200 OK */
+			case st_status:
+			{
+				if (!get_line(buf, line))
+					return need_line;
+
+				std::string version;
+				std::istringstream in(line);
+				in >> version >> reply_.status_code;
+
+				if (!in || version.compare(0, 5, "HTTP/") != 0)
+					throw my::exception(L"Некорректный ответ сервера");
+
+				keep_alive_ = (version != "HTTP/1.0");
+				state_ = st_headers;
+				break;
+			}
+
+			case st_headers:
+				if (!get_line(buf, line))
+					return need_line;
+
+				if (!line.empty())
+				{
+					on_header(line);
+					break;
+				}
+
+				/* Заголовки закончились */
+				reply_.body.clear();
+
+				if (reply_.status_code / 100 == 1
+					|| reply_.status_code == 204 || reply_.status_code == 304)
+				{
+					state_ = st_done; /* Ответы без тела */
+				}
+				else if (chunked_)
+					state_ = st_chunk_size;
+				else if (has_length_)
+					state_ = st_body;
+				else
+				{
+					/* Длина не указана - читаем до закрытия соединения */
+					keep_alive_ = false;
+					state_ = st_body_eof;
+				}
+				break;
+
+			/* Тело ответа или очередной его кусок (chunk). Если тело
+				отдаётся по частям, передаём всё, что уже есть */
+			case st_body:
+			case st_chunk_data:
+			{
+				std::size_t size = std::min(buf.size(), length_);
+
+				if (size < length_ && !body_handler_)
+				{
+					bytes_needed_ = length_;
+					return need_bytes;
+				}
+
+				if (size)
+				{
+					on_body(buf, size);
+					length_ -= size;
+				}
+
+				if (length_)
+				{
+					bytes_needed_ = 1;
+					return need_bytes;
+				}
+
+				state_ = (state_ == st_body ? st_done : st_chunk_end);
+				break;
+			}
+
+			case st_chunk_size:
+				if (!get_line(buf, line))
+					return need_line;
+
+				length_ = (std::size_t)std::strtoul(line.c_str(), 0, 16);
+				state_ = length_ ? st_chunk_data : st_chunk_trailer;
+				break;
+
+			/* \r\n после куска */
+			case st_chunk_end:
+				if (!get_line(buf, line))
+					return need_line;
+
+				state_ = st_chunk_size;
+				break;
+
+			/* Трейлеры пропускаем */
+			case st_chunk_trailer:
+				if (!get_line(buf, line))
+					return need_line;
+
+				if (line.empty())
+					state_ = st_done;
+				break;
+
+			case st_body_eof:
+				if (buf.size())
+					on_body(buf, buf.size());
+				return need_eof;
+
+			case st_done:
+				return done;
+		}
+	}
+}
+
+void http_reply_parser::finish(asio::streambuf &buf)
+{
+	if (buf.size())
+		on_body(buf, buf.size());
+	keep_alive_ = false;
+	state_ = st_done;
+}
+
+
+/*
+	http_pool
+*/
+
+struct http_pool::async_request
+{
+	std::string full_request;
+	handler_t handler;
+	connection_ptr conn;
+	my::http::reply reply;
+	http_reply_parser parser;
+	bool reading_eof; /* Читаем до закрытия соединения */
+	bool cancelled;
+	bool completed;
+	bool reused; /* Ответ мог не прийти не по нашей вине */
+	int attempt;
+
+	async_request(const std::string &full_request, handler_t handler)
+		: full_request(full_request)
+		, handler(handler)
+		, parser(reply)
+		, reading_eof(false)
+		, cancelled(false)
+		, completed(false)
+		, reused(false)
+		, attempt(0) {}
+};
+
+http_pool::http_pool(asio::io_service &io_service, std::size_t max_connections)
+	: io_service_(io_service)
+	, max_connections_(max_connections ? max_connections : 1)
+	, connections_count_(0)
+	, pipeline_depth_(1)
+	, MY_MUTEX_DEF(mutex_,true)
+{
+}
+
+http_pool::~http_pool()
+{
+	close_idle();
+}
+
+void http_pool::set_server(const asio::ip::tcp::endpoint &endpoint,
+	const std::string &host)
+{
+	close_idle();
+
+	unique_lock<mutex> lock(mutex_);
+	endpoint_ = endpoint;
+	host_ = host;
+}
+
+void http_pool::close_idle()
+{
+	unique_lock<mutex> lock(mutex_);
+
+	connections_count_ -= idle_.size();
+	idle_.clear();
+
+	cond_.notify_all();
+}
+
+std::size_t http_pool::pipeline_depth()
+{
+	unique_lock<mutex> lock(mutex_);
+	return pipeline_depth_;
+}
+
+void http_pool::set_pipeline_depth(std::size_t depth)
+{
+	unique_lock<mutex> lock(mutex_);
+	pipeline_depth_ = depth ? depth : 1;
+}
+
+std::string http_pool::make_request(const std::wstring &request) const
+{
+	return "GET "
+		+ my::http::percent_encode(my::utf8::encode(request))
+		+ " HTTP/1.1\r\n"
+		+ "Host: " + host_ + "\r\n"
+		+ "Connection: keep-alive\r\n"
+		+ "\r\n";
+}
+
+http_pool::connection_ptr http_pool::take_connection(bool pipelined)
+{
+	connection_ptr conn;
+
+	if (!idle_.empty())
+	{
+		conn = idle_.front();
+		idle_.pop_front();
+	}
+	else if (connections_count_ < max_connections_)
+	{
+		++connections_count_;
+		conn = connection_ptr( new connection(io_service_) );
+	}
+	else if (pipelined)
+	{
+		/* Выбираем соединение с самым коротким конвейером */
+		for (connections_list::iterator iter = busy_.begin();
+			iter != busy_.end(); ++iter)
+		{
+			connection &c = **iter;
+
+			if (c.confirmed && !c.failed
+				&& c.pipeline.size() < pipeline_depth_
+				&& (!conn || c.pipeline.size() < conn->pipeline.size()))
+			{
+				conn = *iter;
+			}
+		}
+
+		/* Уже в списке занятых */
+		return conn;
+	}
+	else
+		return conn;
+
+	busy_.push_back(conn);
+	return conn;
+}
+
+http_pool::connection_ptr http_pool::acquire()
+{
+	unique_lock<mutex> lock(mutex_);
+
+	/* Ждём, пока не освободится соединение или не появится
+		возможность открыть новое */
+	connection_ptr conn;
+	while ( !(conn = take_connection()) )
+		cond_.wait(lock);
+
+	return conn;
+}
+
+void http_pool::release(connection_ptr conn, bool keep_alive)
+{
+	request_ptr next;
+
+	{
+		unique_lock<mutex> lock(mutex_);
+
+		busy_.remove(conn);
+
+		if (!keep_alive || conn->failed || !conn->socket.is_open())
+		{
+			conn.reset();
+			--connections_count_;
+		}
+
+		if (!waiting_.empty())
+		{
+			/* Соединение сразу отдаём ожидающему запросу */
+			next = waiting_.front();
+			waiting_.pop_front();
+
+			if (!conn)
+			{
+				conn = connection_ptr( new connection(io_service_) );
+				++connections_count_;
+			}
+
+			busy_.push_back(conn);
+		}
+		else if (conn)
+			idle_.push_front(conn); /* Последнее использованное - первым */
+
+		cond_.notify_one();
+	}
+
+	if (next)
+		io_service_.post( boost::bind(&http_pool::assign, this, conn, next) );
+}
+
+void http_pool::get(my::http::reply &reply, const std::wstring &request)
+{
+	const std::string full_request = make_request(request);
+
+	/* Сервер мог закрыть простаивающее соединение - в этом случае
+		повторяем запрос один раз через новое соединение */
+	for (int attempt = 0; ; ++attempt)
+	{
+		connection_ptr conn = acquire();
+		const bool reused = conn->requests != 0;
+
+		try
+		{
+			bool keep_alive = execute(*conn, reply, full_request);
+			release(conn, keep_alive);
+			return;
+		}
+		catch (...)
+		{
+			release(conn, false);
+
+			if (!reused || attempt != 0)
+				throw;
+		}
+	}
+}
+
+bool http_pool::execute(connection &conn, my::http::reply &reply,
+	const std::string &full_request)
+{
+	if (!conn.socket.is_open())
+		conn.socket.connect(endpoint_);
+
+	++conn.requests;
+
+	asio::write(conn.socket, asio::buffer(full_request));
+
+	http_reply_parser parser(reply);
+
+	while (true)
+	{
+		switch (parser.parse(conn.buf))
+		{
+			case http_reply_parser::done:
+				return parser.keep_alive();
+
+			case http_reply_parser::need_line:
+				asio::read_until(conn.socket, conn.buf, "\r\n");
+				break;
+
+			case http_reply_parser::need_bytes:
+				asio::read(conn.socket, conn.buf, asio::transfer_exactly(
+					parser.bytes_needed() - conn.buf.size()));
+				break;
+
+			case http_reply_parser::need_eof:
+			{
+				boost::system::error_code ec;
+				asio::read(conn.socket, conn.buf, asio::transfer_all(), ec);
+				if (ec && ec != asio::error::eof)
+					throw boost::system::system_error(ec);
+
+				parser.finish(conn.buf);
+				return false;
+			}
+		}
+	}
+}
+
+http_pool::request_ptr http_pool::async_get(const std::wstring &request,
+	handler_t handler, body_handler_t body_handler)
+{
+	request_ptr req( new async_request(make_request(request), handler) );
+	req->parser.set_body_handler(body_handler);
+
+	io_service_.post( boost::bind(&http_pool::start, this, req) );
+
+	return req;
+}
+
+void http_pool::cancel(const request_ptr &req)
+{
+	if (req)
+		io_service_.post( boost::bind(&http_pool::do_cancel, this, req) );
+}
+
+void http_pool::start(request_ptr req)
+{
+	if (req->cancelled)
+	{
+		complete(req, asio::error::operation_aborted);
+		return;
+	}
+
+	connection_ptr conn;
+
+	{
+		unique_lock<mutex> lock(mutex_);
+
+		conn = take_connection(pipeline_depth_ > 1);
+
+		/* Свободных соединений нет - ждём, соединение
+			будет передано нам в release() или reply_done() */
+		if (!conn)
+		{
+			waiting_.push_back(req);
+			return;
+		}
+	}
+
+	assign(conn, req);
+}
+
+/* Постановка запроса в конвейер соединения */
+void http_pool::assign(connection_ptr conn, request_ptr req)
+{
+	if (req->cancelled)
+	{
+		complete(req, asio::error::operation_aborted);
+
+		if (conn->pipeline.empty())
+			release(conn, true);
+		return;
+	}
+
+	req->conn = conn;
+	req->reused = (conn->requests != 0 || !conn->pipeline.empty());
+	req->reading_eof = false;
+	req->parser.reset();
+
+	++conn->requests;
+	conn->pipeline.push_back(req);
+
+	pump(conn);
+}
+
+/* Продвижение конвейера: соединяемся, отправляем очередной запрос,
+	читаем ответ на первый. Запись и чтение идут параллельно */
+void http_pool::pump(connection_ptr conn)
+{
+	if (conn->failed)
+		return;
+
+	if (!conn->socket.is_open())
+	{
+		if (!conn->connecting)
+		{
+			conn->connecting = true;
+			conn->socket.async_connect(endpoint_, boost::bind(
+				&http_pool::on_connect, this, conn, asio::placeholders::error));
+		}
+		return;
+	}
+
+	if (conn->connecting)
+		return;
+
+	if (!conn->writing && conn->written < conn->pipeline.size())
+	{
+		requests_list::iterator iter = conn->pipeline.begin();
+		std::advance(iter, conn->written);
+
+		conn->writing = true;
+		asio::async_write(conn->socket, asio::buffer((*iter)->full_request),
+			boost::bind(&http_pool::on_write, this, conn, asio::placeholders::error));
+	}
+
+	if (!conn->reading && conn->written)
+	{
+		conn->reading = true;
+		read_next(conn);
+	}
+}
+
+void http_pool::on_connect(connection_ptr conn, const boost::system::error_code &ec)
+{
+	if (conn->failed)
+		return;
+
+	conn->connecting = false;
+
+	if (ec)
+		fail(conn, ec);
+	else
+		pump(conn);
+}
+
+void http_pool::on_write(connection_ptr conn, const boost::system::error_code &ec)
+{
+	if (conn->failed)
+		return;
+
+	conn->writing = false;
+
+	if (ec)
+		fail(conn, ec);
+	else
+	{
+		++conn->written;
+		pump(conn);
+	}
+}
+
+void http_pool::read_next(connection_ptr conn)
+{
+	request_ptr req = conn->pipeline.front();
+	http_reply_parser::result res;
+
+	try
+	{
+		res = req->parser.parse(conn->buf);
+	}
+	catch (...)
+	{
+		fail(conn, boost::system::errc::make_error_code(
+			boost::system::errc::protocol_error));
+		return;
+	}
+
+	switch (res)
+	{
+		case http_reply_parser::done:
+			reply_done(conn);
+			break;
+
+		case http_reply_parser::need_line:
+			asio::async_read_until(conn->socket, conn->buf, "\r\n",
+				boost::bind(&http_pool::on_read, this, conn,
+					asio::placeholders::error));
+			break;
+
+		case http_reply_parser::need_bytes:
+			asio::async_read(conn->socket, conn->buf,
+				asio::transfer_exactly(req->parser.bytes_needed() - conn->buf.size()),
+				boost::bind(&http_pool::on_read, this, conn,
+					asio::placeholders::error));
+			break;
+
+		/* Читаем порциями, чтобы тело можно было отдавать по частям */
+		case http_reply_parser::need_eof:
+			req->reading_eof = true;
+			asio::async_read(conn->socket, conn->buf, asio::transfer_at_least(1),
+				boost::bind(&http_pool::on_read, this, conn,
+					asio::placeholders::error));
+			break;
+	}
+}
+
+void http_pool::on_read(connection_ptr conn, const boost::system::error_code &ec)
+{
+	if (conn->failed)
+		return;
+
+	request_ptr req = conn->pipeline.front();
+
+	if (ec == asio::error::eof && req->reading_eof)
+	{
+		req->parser.finish(conn->buf);
+		reply_done(conn);
+	}
+	else if (ec)
+		fail(conn, ec);
+	else
+		read_next(conn);
+}
+
+/* Ответ на первый запрос конвейера получен полностью */
+void http_pool::reply_done(connection_ptr conn)
+{
+	request_ptr req = conn->pipeline.front();
+	conn->pipeline.pop_front();
+	--conn->written;
+	conn->reading = false;
+	req->conn.reset();
+
+	const bool keep_alive = req->parser.keep_alive();
+
+	complete(req, req->cancelled
+		? boost::system::error_code(asio::error::operation_aborted)
+		: boost::system::error_code());
+
+	/* Сервер закрывает соединение - на остальные запросы
+		конвейера ответа не будет, их надо повторить */
+	if (!keep_alive)
+	{
+		if (conn->pipeline.empty())
+		{
+			boost::system::error_code ec;
+			conn->socket.close(ec);
+			release(conn, false);
+		}
+		else
+			fail(conn, asio::error::eof);
+		return;
+	}
+
+	conn->confirmed = true;
+
+	/* Добираем в конвейер ожидающие запросы */
+	std::size_t depth = pipeline_depth();
+
+	while (conn->pipeline.size() < depth)
+	{
+		request_ptr next;
+
+		{
+			unique_lock<mutex> lock(mutex_);
+
+			if (waiting_.empty())
+				break;
+
+			next = waiting_.front();
+			waiting_.pop_front();
+		}
+
+		assign(conn, next);
+	}
+
+	if (conn->pipeline.empty())
+		release(conn, true);
+	else
+		pump(conn);
+}
+
+/* Разрыв соединения. Запросы конвейера, на которые ответ мог не прийти
+	по вине сервера, повторяем один раз через новое соединение */
+void http_pool::fail(connection_ptr conn, const boost::system::error_code &ec)
+{
+	if (conn->failed)
+		return;
+
+	conn->failed = true;
+
+	boost::system::error_code close_ec;
+	conn->socket.close(close_ec);
+
+	requests_list pipeline;
+	pipeline.swap(conn->pipeline);
+	conn->written = 0;
+
+	release(conn, false);
+
+	for (requests_list::iterator iter = pipeline.begin();
+		iter != pipeline.end(); ++iter)
+	{
+		request_ptr req = *iter;
+		req->conn.reset();
+
+		if (!req->cancelled && req->reused && req->attempt == 0)
+		{
+			++req->attempt;
+			start(req);
+		}
+		else
+			complete(req, req->cancelled
+				? boost::system::error_code(asio::error::operation_aborted)
+				: ec);
+	}
+}
+
+void http_pool::complete(request_ptr req, const boost::system::error_code &ec)
+{
+	if (req->completed)
+		return;
+
+	req->completed = true;
+
+	if (req->handler)
+		req->handler(ec, req->reply);
+}
+
+void http_pool::do_cancel(request_ptr req)
+{
+	if (req->completed)
+		return;
+
+	req->cancelled = true;
+
+	if (req->conn)
+	{
+		/* Запрос в конвейере один - закрываем соединение. Иначе
+			ответ будет дочитан и выброшен */
+		if (req->conn->pipeline.size() == 1)
+			fail(req->conn, asio::error::operation_aborted);
+		return;
+	}
+
+	/* Запрос ещё ждёт соединения */
+	bool found = false;
+
+	{
+		unique_lock<mutex> lock(mutex_);
+
+		for (requests_list::iterator iter = waiting_.begin();
+			iter != waiting_.end(); ++iter)
+		{
+			if (*iter == req)
+			{
+				waiting_.erase(iter);
+				found = true;
+				break;
+			}
+		}
+	}
+
+	if (found)
+		complete(req, asio::error::operation_aborted);
+}
+
+} /* namespace cartographer */
@@ -0,0 +1,229 @@
+﻿#ifndef CARTOGRAPHER_HTTP_POOL_H
+#define CARTOGRAPHER_HTTP_POOL_H
+
+#include "config.h" /* Обязательно первым */
+
+#include <mylib.h>
+
+#include <cstddef> /* std::size_t */
+#include <string>
+#include <list>
+
+#include <boost/function.hpp>
+#include <boost/utility.hpp> /* boost::noncopyable */
+
+namespace cartographer
+{
+
+/*
+	Разбор HTTP-ответа по мере поступления данных. Сам ничего
+	не читает - лишь сообщает, чего ему не хватает для продолжения.
+	Это позволяет использовать его и в синхронном, и в асинхронном режимах
+*/
+class http_reply_parser : boost::noncopyable
+{
+public:
+	/* Получатель тела ответа по частям (по мере поступления) */
+	typedef boost::function<void (const my::http::reply &reply,
+		const char *data, std::size_t size)> body_handler_t;
+
+	/* Результат разбора */
+	enum result
+	{
+		need_line, /* Нужна ещё одна строка (до \r\n) */
+		need_bytes, /* В буфере должно быть не менее bytes_needed() байт */
+		need_eof, /* Тело ответа - до закрытия соединения */
+		done
+	};
+
+	http_reply_parser(my::http::reply &reply)
+		: reply_(reply)
+	{
+		reset();
+	}
+
+	void reset();
+
+	/* Если задан - тело ответа передаётся ему частями
+		и в reply.body не накапливается */
+	inline void set_body_handler(body_handler_t body_handler)
+		{ body_handler_ = body_handler; }
+
+	/* Разбор имеющихся в буфере данных. Разобранное из буфера удаляется */
+	result parse(asio::streambuf &buf);
+
+	/* Соединение закрыто сервером (для need_eof) - забираем остаток */
+	void finish(asio::streambuf &buf);
+
+	inline std::size_t bytes_needed() const
+		{ return bytes_needed_; }
+
+	inline bool keep_alive() const
+		{ return keep_alive_; }
+
+private:
+	enum state
+	{
+		st_status,
+		st_headers,
+		st_body,
+		st_chunk_size,
+		st_chunk_data,
+		st_chunk_end,
+		st_chunk_trailer,
+		st_body_eof,
+		st_done
+	};
+
+	my::http::reply &reply_;
+	body_handler_t body_handler_;
+	state state_;
+	bool keep_alive_;
+	bool chunked_;
+	bool has_length_;
+	std::size_t length_;
+	std::size_t bytes_needed_;
+
+	static bool get_line(asio::streambuf &buf, std::string &line);
+	void on_header(const std::string &line);
+	void on_body(asio::streambuf &buf, std::size_t size);
+};
+
+
+/*
+	Пул постоянных (HTTP/1.1 keep-alive) соединений с сервером.
+	Соединение после запроса возвращается в пул и используется
+	повторно, пока сервер его не закроет. Одновременно открыто
+	не более max_connections соединений - остальные запросы ждут.
+
+	Асинхронные запросы выполняются на io_service, который должен
+	крутиться в одном отдельном потоке (io_service::run()).
+	При pipeline_depth > 1 через одно соединение отправляется до
+	pipeline_depth запросов, не дожидаясь ответов (HTTP pipelining).
+	Конвейер используется только на соединениях, уже подтвердивших
+	keep-alive, а запросы, на которые не пришёл ответ из-за разрыва,
+	повторяются один раз через новое соединение
+*/
+class http_pool
+{
+public:
+	/* Обработчик завершения асинхронного запроса (вызывается
+		в потоке io_service). При отмене - asio::error::operation_aborted */
+	typedef boost::function<void (const boost::system::error_code &ec,
+		my::http::reply &reply)> handler_t;
+	typedef http_reply_parser::body_handler_t body_handler_t;
+
+	struct async_request;
+	typedef shared_ptr<async_request> request_ptr;
+
+	http_pool(asio::io_service &io_service, std::size_t max_connections);
+	~http_pool();
+
+	/* Адрес сервера и значение заголовка Host */
+	void set_server(const asio::ip::tcp::endpoint &endpoint,
+		const std::string &host);
+
+	/* Синхронный GET-запрос */
+	void get(my::http::reply &reply, const std::wstring &request);
+
+	/* Асинхронный GET-запрос. Возвращённый указатель нужен для отмены.
+		body_handler (если задан) получает тело ответа по мере поступления */
+	request_ptr async_get(const std::wstring &request, handler_t handler,
+		body_handler_t body_handler = body_handler_t());
+
+	/* Отмена асинхронного запроса. Если ответ уже получается и за ним
+		в соединении ничего нет, соединение закрывается - передавать
+		данные, которые никому не нужны, бессмысленно. Иначе ответ
+		дочитывается и выбрасывается */
+	void cancel(const request_ptr &req);
+
+	/* Закрытие всех свободных соединений */
+	void close_idle();
+
+	inline std::size_t max_connections() const
+		{ return max_connections_; }
+
+	/* Глубина конвейера (1 - без конвейера) */
+	std::size_t pipeline_depth();
+	void set_pipeline_depth(std::size_t depth);
+
+private:
+	typedef std::list<request_ptr> requests_list;
+
+	struct connection
+	{
+		asio::ip::tcp::socket socket;
+		asio::streambuf buf; /* Данные, прочитанные сверх предыдущего ответа */
+		int requests; /* Кол-во запросов, выполненных через соединение */
+
+		/* Состояние конвейера (только в потоке io_service) */
+		requests_list pipeline; /* Запросы в порядке отправки */
+		std::size_t written; /* Сколько из них уже отправлено */
+		bool connecting;
+		bool writing;
+		bool reading;
+		bool confirmed; /* Сервер подтвердил keep-alive */
+		bool failed; /* Соединение разорвано - больше не используется */
+
+		connection(asio::io_service &io_service)
+			: socket(io_service)
+			, requests(0)
+			, written(0)
+			, connecting(false)
+			, writing(false)
+			, reading(false)
+			, confirmed(false)
+			, failed(false) {}
+	};
+
+	typedef shared_ptr<connection> connection_ptr;
+	typedef std::list<connection_ptr> connections_list;
+
+	asio::io_service &io_service_;
+	asio::ip::tcp::endpoint endpoint_;
+	std::string host_;
+	std::size_t max_connections_;
+	std::size_t connections_count_; /* Всего открыто (свободные + занятые) */
+	std::size_t pipeline_depth_;
+	connections_list idle_; /* Свободные соединения */
+	connections_list busy_; /* Занятые соединения */
+	requests_list waiting_; /* Асинхронные запросы, ждущие соединения */
+	mutex mutex_;
+	condition_variable cond_;
+
+	/* Получение соединения из пула (или создание нового).
+		take_connection() не ждёт, а возвращает пустой указатель,
+		вызывается под блокировкой mutex_. При pipelined == true
+		может вернуть и занятое соединение с неполным конвейером */
+	connection_ptr acquire();
+	connection_ptr take_connection(bool pipelined = false);
+
+	/* Возврат соединения в пул. Соединение, которое нельзя
+		использовать повторно, закрывается. Если есть асинхронные
+		запросы, ожидающие соединения, - оно передаётся им */
+	void release(connection_ptr conn, bool keep_alive);
+
+	/* Выполнение синхронного запроса через соединение. Возвращает
+		признак того, что соединение можно использовать повторно */
+	bool execute(connection &conn, my::http::reply &reply,
+		const std::string &full_request);
+
+	std::string make_request(const std::wstring &request) const;
+
+	/* Этапы асинхронного запроса (выполняются в потоке io_service) */
+	void start(request_ptr req);
+	void assign(connection_ptr conn, request_ptr req);
+	void pump(connection_ptr conn);
+	void on_connect(connection_ptr conn, const boost::system::error_code &ec);
+	void on_write(connection_ptr conn, const boost::system::error_code &ec);
+	void read_next(connection_ptr conn);
+	void on_read(connection_ptr conn, const boost::system::error_code &ec);
+	void reply_done(connection_ptr conn);
+	void fail(connection_ptr conn, const boost::system::error_code &ec);
+	void complete(request_ptr req, const boost::system::error_code &ec);
+	void do_cancel(request_ptr req);
+};
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_HTTP_POOL_H */
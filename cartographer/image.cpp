@@ -1,18 +1,46 @@
 ﻿#include "image.h"
+#include "image_decoder.h"
+#include "pixel_convert.h"
+#include "lz4_block.h"
+
+#include <mylib.h> /* my::time::utc_now */
 
 #include <cstring>
+#include <string>
+#include <sstream>
+
+#include <boost/cstdint.hpp> /* boost::uint8_t, boost::uint16_t, boost::uint32_t */
+#include <boost/static_assert.hpp>
+
 #include <wx/mstream.h> /* wxMemoryInputStream */
 
 namespace cartographer
 {
 
-/* Число кратное 2, большее или равное a */
-inline int __p2(int a)
+/* Заголовок упакованных пикселей (load_from_packed) */
+struct packed_header
 {
-	int res = 1;
-	while (res < a)
-		res <<= 1;
-	return res;
+	char magic[4];
+	boost::uint16_t width; /* Размеры изображения */
+	boost::uint16_t height;
+	boost::uint16_t raw_width; /* ... и буфера пикселей (кратны 2) */
+	boost::uint16_t raw_height;
+	boost::uint8_t bpp;
+	boost::uint8_t codec; /* 0 - без сжатия, 1 - LZ4 */
+	boost::uint16_t reserved;
+	boost::uint32_t size; /* Размер данных после заголовка */
+};
+
+static const char packed_magic[4] = {'C', 'T', 'P', 'X'};
+enum {codec_none = 0, codec_lz4 = 1};
+
+/* Упаковываются только тайлы, а они не больше 256x256 */
+static const int max_packed_size = 256;
+
+/* Размер буфера тайла: степень двойки, не больше max_packed_size */
+static inline bool valid_packed_size(int size)
+{
+	return size > 0 && size <= max_packed_size && (size & (size - 1)) == 0;
 }
 
 void image::create(int width, int height)
@@ -31,7 +59,16 @@ void image::create(int width, int height)
 	set_state(ready);
 }
 
-bool image::convert_from(const wxImage &src)
+bool image::convert_from(const wxImage &src, int opaque_bpp)
+{
+	if (!convert_pixels(src, opaque_bpp))
+		return false;
+
+	set_state(ready);
+	return true;
+}
+
+bool image::convert_pixels(const wxImage &src, int opaque_bpp)
 {
 	if (!src.IsOk())
 		return false;
@@ -47,27 +84,37 @@ bool image::convert_from(const wxImage &src)
 	int raw_height = __p2(height_);
 	int dw = raw_width - width_;
 
-	/* Т.к., возможно, понадобится дополнять текстуру прозрачными точками,
-		делаем RGBA-изображение вне зависимости от его исходного bpp */
-	raw_.create(raw_width, raw_height, 32);
+	/* Без альфы - в заказанном формате. Дополнять текстуру
+		прозрачными точками тогда не обязательно: за пределы
+		изображения текстурные координаты не выходят */
+	const int bpp = src_a ? 32 : opaque_bpp;
+	const int pixel_size = bpp / 8;
+	raw_.create(raw_width, raw_height, bpp);
 
 	unsigned char *ptr = raw_.data();
 	unsigned char *end = raw_.end();
 
 	for (int i = 0; i < height_; ++i)
 	{
-		for (int j = 0; j < width_; ++j)
+		if (src_a)
 		{
-			*ptr++ = *src_rgb++;
-			*ptr++ = *src_rgb++;
-			*ptr++ = *src_rgb++;
-			*ptr++ = src_a ? *src_a++ : 255;
+			convert_rgb_a_to_rgba(ptr, src_rgb, src_a, width_);
+			src_a += width_;
 		}
-		
+		else if (bpp == 32)
+			convert_rgb_to_rgba(ptr, src_rgb, width_);
+		else if (bpp == 24)
+			std::memcpy(ptr, src_rgb, width_ * 3);
+		else
+			convert_rgb_to_rgb565((unsigned short*)ptr, src_rgb, width_);
+
+		src_rgb += width_ * 3;
+		ptr += width_ * pixel_size;
+
 		/* Дополняем ширину прозрачными точками */
 		if (dw)
 		{
-			unsigned char *line_end = ptr + dw * 4;
+			unsigned char *line_end = ptr + dw * pixel_size;
 			std::memset(ptr, 0, line_end - ptr);
 			ptr = line_end;
 		}
@@ -76,23 +123,200 @@ bool image::convert_from(const wxImage &src)
 	/* Дополняем ширину прозрачными точками */
 	std::memset(ptr, 0, end - ptr);
 
+	return true;
+}
+
+void image::move_to_pbo(pbo_ring *pbo)
+{
+	if (!pbo)
+		return;
+
+	int slot = pbo->acquire(raw_.bytes());
+	if (slot < 0)
+		return;
+
+	/* Копируем в потоке загрузчика - поток отрисовки
+		пикселей уже не касается */
+	std::memcpy(pbo->data(slot), raw_.data(), raw_.bytes());
+	raw_.clear(false);
+	pbo_slot_ = slot;
+}
+
+void image::move_from_pbo(pbo_ring *pbo)
+{
+	if (!pbo || pbo_slot_ < 0)
+		return;
+
+	/* Размеры и bpp у raw_ после move_to_pbo() сохранились */
+	raw_.create(raw_.width(), raw_.height(), raw_.bpp(), raw_.tag());
+	std::memcpy(raw_.data(), pbo->data(pbo_slot_), raw_.bytes());
+
+	pbo->release(pbo_slot_);
+	pbo_slot_ = -1;
+}
+
+bool image::load_from_file(const std::wstring &filename, int opaque_bpp,
+	pbo_ring *pbo)
+{
+	bool ok = false;
+
+	/* Собственные декодеры работают с памятью - читаем файл целиком */
+	if (native_decoders())
+	{
+		std::string data;
+
+		ok = read_file(filename, data)
+			&& decode_image(data.data(), data.size(), raw_, width_, height_, opaque_bpp);
+	}
+
+	/* Остальное - через wxImage */
+	if (!ok)
+	{
+		wxImage wx_image(filename);
+		ok = convert_pixels(wx_image, opaque_bpp);
+	}
+
+	if (!ok)
+		return false;
+
+	/* Готовность - только после переноса в PBO, иначе поток
+		отрисовки может взяться за пиксели раньше */
+	move_to_pbo(pbo);
 	set_state(ready);
 
 	return true;
 }
 
-bool image::load_from_file(const std::wstring &filename)
+void image::pack_pixels(std::string &packed) const
 {
-	wxImage wx_image(filename);
-	return convert_from(wx_image);
+	BOOST_STATIC_ASSERT(sizeof(packed_header) == 20);
+
+	/* Не тайл - такой не загрузит и load_from_packed() */
+	if (!valid_packed_size(raw_.width()) || !valid_packed_size(raw_.height()))
+	{
+		packed.clear();
+		return;
+	}
+
+	const std::size_t bytes = raw_.bytes();
+
+	packed.resize( sizeof(packed_header) + lz4_bound(bytes) );
+
+	std::size_t size = lz4_compress(raw_.data(), bytes,
+		(unsigned char*)&packed[sizeof(packed_header)],
+		packed.size() - sizeof(packed_header));
+
+	/* Сжимается плохо (фотографии) - храним как есть. Распаковка
+		таких данных - множество коротких совпадений, она не быстрее
+		декодирования JPEG, а копирование - в десятки раз быстрее */
+	boost::uint8_t codec = codec_lz4;
+	if (size == 0 || size > bytes / 2)
+	{
+		std::memcpy(&packed[sizeof(packed_header)], raw_.data(), bytes);
+		size = bytes;
+		codec = codec_none;
+	}
+
+	packed.resize(sizeof(packed_header) + size);
+
+	packed_header *h = (packed_header*)&packed[0];
+	std::memcpy(h->magic, packed_magic, 4);
+	h->width = (boost::uint16_t)width_;
+	h->height = (boost::uint16_t)height_;
+	h->raw_width = (boost::uint16_t)raw_.width();
+	h->raw_height = (boost::uint16_t)raw_.height();
+	h->bpp = (boost::uint8_t)raw_.bpp();
+	h->codec = codec;
+	h->reserved = 0;
+	h->size = (boost::uint32_t)size;
 }
 
-bool image::load_from_mem(const void *data, std::size_t size)
+bool image::load_from_packed(const void *data, std::size_t size,
+	int opaque_bpp, pbo_ring *pbo)
 {
-	wxImage wx_image;
-	wxMemoryInputStream stream(data, size);
-	return wx_image.LoadFile(stream, wxBITMAP_TYPE_ANY)
-		&& convert_from(wx_image);
+	if (size < sizeof(packed_header))
+		return false;
+
+	packed_header h;
+	std::memcpy(&h, data, sizeof(h));
+
+	/* Непрозрачные тайлы при другом opaque_bpp - декодируем заново.
+		Размеры - с диска, поэтому проверяем их до выделения памяти:
+		испорченная запись не должна требовать гигабайты */
+	if ( std::memcmp(h.magic, packed_magic, 4) != 0
+		|| h.size != size - sizeof(h)
+		|| !valid_packed_size(h.raw_width) || !valid_packed_size(h.raw_height)
+		|| h.width > h.raw_width || h.height > h.raw_height
+		|| (h.bpp != 32 && h.bpp != opaque_bpp) )
+	{
+		return false;
+	}
+
+	const unsigned char *src = (const unsigned char*)data + sizeof(h);
+
+	raw_.create(h.raw_width, h.raw_height, h.bpp);
+	const std::size_t bytes = raw_.bytes();
+
+	/* Распаковываем сразу в PBO, минуя raw_ */
+	int slot = pbo ? pbo->acquire(bytes) : -1;
+	unsigned char *dst = slot >= 0 ? pbo->data(slot) : raw_.data();
+
+	bool ok = false;
+
+	if (h.codec == codec_lz4)
+		ok = lz4_decompress(src, h.size, dst, bytes);
+	else if (h.codec == codec_none && h.size == bytes)
+	{
+		std::memcpy(dst, src, bytes);
+		ok = true;
+	}
+
+	if (!ok)
+	{
+		if (slot >= 0)
+			pbo->release(slot);
+		raw_.clear();
+		return false;
+	}
+
+	width_ = h.width;
+	height_ = h.height;
+
+	if (slot >= 0)
+	{
+		raw_.clear(false);
+		pbo_slot_ = slot;
+	}
+
+	set_state(ready);
+
+	return true;
+}
+
+bool image::load_from_mem(const void *data, std::size_t size, int opaque_bpp,
+	pbo_ring *pbo, std::string *packed)
+{
+	bool ok = decode_image(data, size, raw_, width_, height_, opaque_bpp);
+
+	if (!ok)
+	{
+		wxImage wx_image;
+		wxMemoryInputStream stream(data, size);
+		ok = wx_image.LoadFile(stream, wxBITMAP_TYPE_ANY)
+			&& convert_pixels(wx_image, opaque_bpp);
+	}
+
+	if (!ok)
+		return false;
+
+	/* Упаковываем, пока пиксели не ушли в PBO */
+	if (packed)
+		pack_pixels(*packed);
+
+	move_to_pbo(pbo);
+	set_state(ready);
+
+	return true;
 }
 
 void image::load_from_raw(const unsigned char *data,
@@ -115,14 +339,20 @@ void image::load_from_raw(const unsigned char *data,
 
 	for (int i = 0; i < height_; ++i)
 	{
-		for (int j = 0; j < width_; ++j)
+		/* RGBA копируем как есть */
+		if (with_alpha)
 		{
-			*ptr++ = *data++;
-			*ptr++ = *data++;
-			*ptr++ = *data++;
-			*ptr++ = with_alpha ? *data++ : 255;
+			std::memcpy(ptr, data, width_ * 4);
+			data += width_ * 4;
 		}
-		
+		else
+		{
+			convert_rgb_to_rgba(ptr, data, width_);
+			data += width_ * 3;
+		}
+
+		ptr += width_ * 4;
+
 		/* Дополняем ширину прозрачными точками */
 		if (dw)
 		{
@@ -140,34 +370,88 @@ void image::load_from_raw(const unsigned char *data,
 
 GLuint image::load_as_gl_texture()
 {
-	GLuint id;
+	return create_gl_texture(raw_.data(), 0);
+}
+
+GLuint image::create_gl_texture(const void *pixels, texture_pool *pool)
+{
+	GLint internal_format;
+	GLenum format, type;
+	texture_pool::gl_format(raw_.bpp(), internal_format, format, type);
 
-	glGenTextures(1, &id);
+	bool recycled = false;
+	texture_pool::texture tex;
 
-	glBindTexture(GL_TEXTURE_2D, id);
-	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-	//glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-	//glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, 0x812F); /* GL_CLAMP_TO_EDGE */
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, 0x812F); /* GL_CLAMP_TO_EDGE */
-	//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	if (pool)
+		tex = pool->take(raw_.width(), raw_.height(), raw_.bpp(), recycled);
+	else
+		glGenTextures(1, &tex.id);
 
+	glBindTexture(GL_TEXTURE_2D, tex.id);
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, raw_.width(), raw_.height(),
-		0, raw_.bpp() == 32 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, raw_.data());
 
-	return glGetError() == GL_NO_ERROR ? id : 0;
+	/* Место в атласе уже выделено - только заливаем пиксели */
+	if (recycled)
+	{
+		int x, y;
+		pool->slot_offset(tex.slot, x, y);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, raw_.width(), raw_.height(),
+			format, type, pixels);
+	}
+	else
+	{
+		texture_pool::set_params();
+		glTexImage2D(GL_TEXTURE_2D, 0, internal_format, raw_.width(), raw_.height(),
+			0, format, type, pixels);
+	}
+
+	if (glGetError() != GL_NO_ERROR)
+	{
+		if (pool)
+			pool->give_back(tex);
+		else
+			glDeleteTextures(1, &tex.id);
+		return 0;
+	}
+
+	atlas_slot_ = tex.slot;
+	return tex.id;
 }
 
-GLuint image::convert_to_gl_texture()
+GLuint image::convert_to_gl_texture(pbo_ring *pbo, texture_pool *pool)
 {
 	if (texture_id_ != 0)
-		glDeleteTextures(1, &texture_id_);
+	{
+		/* Страницу атласа не удаляем - только освобождаем место */
+		if (atlas_slot_ >= 0 && pool)
+			pool->give_back( texture_pool::texture(texture_id_,
+				raw_.width(), raw_.height(), raw_.bpp(), atlas_slot_) );
+		else if (atlas_slot_ < 0)
+			glDeleteTextures(1, &texture_id_);
+
+		texture_id_ = 0;
+		atlas_slot_ = -1;
+	}
+
+	if (pbo_slot_ >= 0)
+	{
+		/* Из буфера PBO: вместо указателя - смещение в буфере */
+		texture_id_ = 0;
+
+		if (pbo)
+		{
+			if (pbo->begin_upload(pbo_slot_))
+				texture_id_ = create_gl_texture(0, pool);
+			pbo->end_upload(pbo_slot_);
+		}
+
+		/* При неудаче пикселей больше нет нигде: ok() вернёт false,
+			и тайл придётся загрузить заново (Base::load_textures()) */
+		pbo_slot_ = -1;
+		return texture_id_;
+	}
 
-	texture_id_ = load_as_gl_texture();
+	texture_id_ = create_gl_texture(raw_.data(), pool);
 
 	if (texture_id_)
 		raw_.clear(false);
@@ -175,4 +459,64 @@ GLuint image::convert_to_gl_texture()
 	return texture_id_;
 }
 
+std::wstring image::packed_benchmark(const void *data, std::size_t size,
+	int opaque_bpp, int iterations)
+{
+	std::wostringstream out;
+	out << L"packed tiles (" << size << L" байт, opaque_bpp=" << opaque_bpp
+		<< L" x " << iterations << L", мкс на тайл):";
+
+	if (iterations <= 0)
+		return out.str();
+
+	image decoded;
+	image unpacked;
+	std::string packed;
+
+	/* Декодирование - как при загрузке с диска или сервера */
+	posix_time::ptime start = my::time::utc_now();
+
+	for (int n = 0; n < iterations; ++n)
+		if (!decoded.load_from_mem(data, size, opaque_bpp))
+			return out.str() + L" ошибка декодирования";
+
+	long long decode_time = (my::time::utc_now() - start).total_microseconds();
+
+	/* Упаковка - вдобавок к декодированию при первой загрузке */
+	start = my::time::utc_now();
+
+	for (int n = 0; n < iterations; ++n)
+		decoded.pack_pixels(packed);
+
+	long long pack_time = (my::time::utc_now() - start).total_microseconds();
+
+	/* Распаковка - вместо декодирования при повторной загрузке */
+	start = my::time::utc_now();
+
+	for (int n = 0; n < iterations; ++n)
+		if (!unpacked.load_from_packed(packed.c_str(), packed.size(), opaque_bpp))
+			return out.str() + L" ошибка распаковки";
+
+	long long unpack_time = (my::time::utc_now() - start).total_microseconds();
+
+	const packed_header *h = (const packed_header*)packed.c_str();
+
+	out << L" decode=" << decode_time / iterations
+		<< L" pack=" << pack_time / iterations
+		<< L" unpack=" << unpack_time / iterations
+		<< L" raw=" << decoded.raw().bytes()
+		<< L" packed=" << packed.size()
+		<< (h->codec == codec_lz4 ? L" (lz4)" : L" (как есть)");
+
+	/* Заодно сверяем */
+	if (unpacked.raw().bytes() != decoded.raw().bytes()
+		|| std::memcmp(unpacked.raw().data(), decoded.raw().data(),
+			decoded.raw().bytes()) != 0)
+	{
+		out << L" (ОШИБКА)";
+	}
+
+	return out.str();
+}
+
 } /* namespace cartographer */
@@ -4,9 +4,13 @@
 #include "config.h" /* Обязательно первым */
 #include "defs.h"
 #include "raw_image.h"
+#include "pbo_ring.h"
+#include "texture_pool.h"
 
 #include <my_ptr.h> /* shared_ptr */
 
+#include <string>
+
 #include <boost/function.hpp>
 
 #include <wx/image.h> /* wxImage */
@@ -31,6 +35,8 @@ public:
 		, height_(0)
 		, scale_(1.0, 1.0)
 		, texture_id_(0)
+		, pbo_slot_(-1)
+		, atlas_slot_(-1)
 		, on_delete_(on_delete) {}
 
 	~image()
@@ -41,14 +47,37 @@ public:
 
 	void create(int width, int height);
 
-	bool convert_from(const wxImage &src);
-	bool load_from_file(const std::wstring &filename);
-	bool load_from_mem(const void *data, std::size_t size);
+	/* Изображения с альфой хранятся в RGBA, без альфы - в формате
+		opaque_bpp: 32 (RGBA), 24 (RGB) или 16 (RGB565).
+		Если задан pbo и в нём есть свободный буфер, пиксели сразу
+		переносятся туда, и в текстуру загружаются уже из него */
+	bool convert_from(const wxImage &src, int opaque_bpp = 32);
+	bool load_from_file(const std::wstring &filename, int opaque_bpp = 32,
+		pbo_ring *pbo = 0);
+	bool load_from_mem(const void *data, std::size_t size, int opaque_bpp = 32,
+		pbo_ring *pbo = 0, std::string *packed = 0);
+
+	/* Декодированные пиксели "про запас" (см. packed в load_from_mem):
+		формат raw_ как есть (размеры кратны 2, bpp), сжатый LZ4, если
+		это даёт выигрыш. Загрузка - без декодирования, только распаковка,
+		и сразу в буфер PBO, если он есть. false - данные испорчены или
+		упакованы при другом opaque_bpp */
+	bool load_from_packed(const void *data, std::size_t size,
+		int opaque_bpp = 32, pbo_ring *pbo = 0);
+
+	/* Замер для тайла data: декодирование против распаковки
+		упакованных пикселей (load_from_packed). Результат - текст для лога.
+		Только для замеров - сам Картограф его не вызывает */
+	static std::wstring packed_benchmark(const void *data, std::size_t size,
+		int opaque_bpp = 32, int iterations = 50);
 	void load_from_raw(const unsigned char *data,
 		int width, int height, bool with_alpha);
 
 	GLuint load_as_gl_texture();
-	GLuint convert_to_gl_texture();
+
+	/* pbo - кольцо, в буфере которого лежат пиксели (см. load_from_*),
+		pool - пул, из которого берётся текстура */
+	GLuint convert_to_gl_texture(pbo_ring *pbo = 0, texture_pool *pool = 0);
 
 
 	inline raw_image& raw()
@@ -62,7 +91,7 @@ public:
 		{ state_ = state; }
 
 	inline bool ok() const
-		{ return state_ == ready && raw_.data() != 0; }
+		{ return state_ == ready && (raw_.data() != 0 || pbo_slot_ >= 0); }
 
 	inline size get_size() const
 		{ return size(width_, height_); }
@@ -85,6 +114,32 @@ public:
 	inline void set_texture_id(GLuint texture_id)
 		{ texture_id_ = texture_id; }
 
+	/* Место в атласе (texture_pool), если texture_id() - страница
+		атласа, а не отдельная текстура (-1) */
+	inline int atlas_slot() const
+		{ return atlas_slot_; }
+
+	/* Буфер PBO с пикселями, ожидающими загрузки в текстуру (-1 - нет) */
+	inline int pbo_slot() const
+		{ return pbo_slot_; }
+
+	/* Возвращает пиксели из буфера PBO в ОЗУ и освобождает буфер -
+		для тайлов, загрузка которых в текстуру откладывается */
+	void move_from_pbo(pbo_ring *pbo);
+
+	/* Память, занимаемая пикселями в ОЗУ (в байтах) */
+	inline std::size_t ram_size() const
+		{ return raw_.bytes(); }
+
+	/* Память, занимаемая текстурой (в байтах). Формат текстуры тот же,
+		что у raw_, его размеры и bpp после выгрузки в текстуру сохраняются */
+	inline std::size_t gpu_size() const
+		{ return texture_id_ ? (std::size_t)raw_.width() * raw_.height() * (raw_.bpp() / 8) : 0; }
+
+	/* Формат пикселей (32 - RGBA, 24 - RGB, 16 - RGB565) */
+	inline int bpp() const
+		{ return raw_.bpp(); }
+
 protected:
 	raw_image raw_;
 	int state_;
@@ -92,7 +147,14 @@ protected:
 	int height_;
 	ratio scale_;
 	GLuint texture_id_;
+	int pbo_slot_;
+	int atlas_slot_;
 	on_delete_t on_delete_;
+
+	bool convert_pixels(const wxImage &src, int opaque_bpp);
+	void pack_pixels(std::string &packed) const;
+	void move_to_pbo(pbo_ring *pbo);
+	GLuint create_gl_texture(const void *pixels, texture_pool *pool);
 };
 
 
@@ -196,7 +258,19 @@ public:
 
 
 	tile(on_delete_t on_delete = on_delete_t())
-		: image(on_delete) {}
+		: image(on_delete)
+		, epoch_(0) {}
+
+	/* Поколение пирамиды, в котором тайл в неё вошёл.
+		0 - тайл в активную пирамиду не входит */
+	inline unsigned int epoch() const
+		{ return epoch_; }
+
+	inline void set_epoch(unsigned int epoch)
+		{ epoch_ = epoch; }
+
+private:
+	unsigned int epoch_;
 };
 
 } /* namespace cartographer */
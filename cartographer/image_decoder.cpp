@@ -0,0 +1,362 @@
+﻿#include "image_decoder.h"
+#include "pixel_convert.h"
+
+#include <mylib.h> /* my::utf8::encode */
+
+#include <cstdio>
+#include <cstdlib> /* std::malloc, std::free */
+#include <cstring> /* std::memset, std::memcpy */
+#include <csetjmp>
+
+#include <boost/config.hpp> /* BOOST_WINDOWS */
+
+#ifdef CARTOGRAPHER_USE_LIBJPEG
+extern "C" {
+#include <jpeglib.h>
+}
+#endif
+
+#ifdef CARTOGRAPHER_USE_LIBPNG
+#include <png.h>
+#endif
+
+namespace cartographer
+{
+
+/* Больше тайлов такого размера не бывает - если в заголовке
+	больше, данные испорчены */
+static const int max_image_size = 8192;
+
+/* Заполнение прозрачными точками того, что лежит
+	за пределами изображения */
+static void clear_padding(raw_image &raw, int width, int height)
+{
+	const std::size_t stride = raw.width() * (raw.bpp() / 8);
+	const std::size_t used = width * (raw.bpp() / 8);
+	unsigned char *ptr = raw.data();
+
+	if (used < stride)
+		for (int i = 0; i < height; ++i)
+			std::memset(ptr + i * stride + used, 0, stride - used);
+
+	std::memset(ptr + height * stride, 0, raw.end() - (ptr + height * stride));
+}
+
+#ifdef CARTOGRAPHER_USE_LIBJPEG
+
+/* Ошибки libjpeg - через longjmp, иначе он завершает программу */
+struct jpeg_error : jpeg_error_mgr
+{
+	std::jmp_buf jmp;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	std::longjmp( static_cast<jpeg_error*>(cinfo->err)->jmp, 1 );
+}
+
+static void jpeg_output_message(j_common_ptr)
+{
+}
+
+static bool decode_jpeg(const unsigned char *data, std::size_t size,
+	raw_image &raw, int &width, int &height, int opaque_bpp)
+{
+	jpeg_decompress_struct cinfo;
+	jpeg_error err;
+
+	cinfo.err = jpeg_std_error(&err);
+	err.error_exit = jpeg_error_exit;
+	err.output_message = jpeg_output_message;
+
+	/* longjmp пропускает деструкторы, поэтому после setjmp - только
+		простые объекты, а буфер освобождаем сами */
+	unsigned char *volatile buf = 0;
+
+	if (setjmp(err.jmp))
+	{
+		std::free(buf);
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), (unsigned long)size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	/* В JPEG альфы нет - RGBA нужен только по просьбе вызывающего.
+		libjpeg-turbo сразу выдаёт RGBA (и делает это SIMD'ом),
+		обычному libjpeg - расширяем RGB на месте */
+	cinfo.out_color_space = JCS_RGB;
+#ifdef JCS_EXTENSIONS
+	if (opaque_bpp == 32)
+		cinfo.out_color_space = JCS_EXT_RGBA;
+#endif
+
+	jpeg_start_decompress(&cinfo);
+
+	if (cinfo.output_width > (JDIMENSION)max_image_size
+		|| cinfo.output_height > (JDIMENSION)max_image_size)
+	{
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+
+	width = cinfo.output_width;
+	height = cinfo.output_height;
+	raw.create(__p2(width), __p2(height), opaque_bpp);
+
+	const std::size_t stride = raw.width() * (opaque_bpp / 8);
+
+	/* RGB565 строка занимает меньше, чем выдаёт libjpeg,
+		поэтому декодируем через отдельный буфер */
+	if (opaque_bpp == 16)
+	{
+		buf = static_cast<unsigned char*>( std::malloc(width * 3) );
+		if (!buf)
+		{
+			jpeg_destroy_decompress(&cinfo);
+			return false;
+		}
+	}
+
+	while (cinfo.output_scanline < cinfo.output_height)
+	{
+		unsigned char *dst = raw.data() + cinfo.output_scanline * stride;
+		unsigned char *row = buf ? buf : dst;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+
+		if (opaque_bpp == 16)
+			convert_rgb_to_rgb565((unsigned short*)dst, row, width);
+#ifndef JCS_EXTENSIONS
+		else if (opaque_bpp == 32)
+		{
+			/* С конца, чтобы не затереть ещё не обработанное */
+			for (int j = width - 1; j >= 0; --j)
+			{
+				row[j * 4 + 3] = 255;
+				row[j * 4 + 2] = row[j * 3 + 2];
+				row[j * 4 + 1] = row[j * 3 + 1];
+				row[j * 4] = row[j * 3];
+			}
+		}
+#endif
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	std::free(buf);
+
+	clear_padding(raw, width, height);
+
+	return true;
+}
+
+#endif /* CARTOGRAPHER_USE_LIBJPEG */
+
+#ifdef CARTOGRAPHER_USE_LIBPNG
+
+struct png_source
+{
+	const unsigned char *data;
+	std::size_t size;
+	std::size_t pos;
+};
+
+static void png_read_mem(png_structp png, png_bytep out, png_size_t count)
+{
+	png_source *src = static_cast<png_source*>(png_get_io_ptr(png));
+
+	if (src->size - src->pos < count)
+		png_error(png, "unexpected end of data");
+
+	std::memcpy(out, src->data + src->pos, count);
+	src->pos += count;
+}
+
+/* Ошибки - молча через longjmp, как и у libjpeg: испорченный
+	тайл - не повод писать в stderr */
+static void png_error_silent(png_structp png, png_const_charp)
+{
+	png_longjmp(png, 1);
+}
+
+static void png_warning_silent(png_structp, png_const_charp)
+{
+}
+
+static bool decode_png(const unsigned char *data, std::size_t size,
+	raw_image &raw, int &width, int &height, int opaque_bpp)
+{
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+		0, png_error_silent, png_warning_silent);
+	if (!png)
+		return false;
+
+	png_infop info = png_create_info_struct(png);
+	if (!info)
+	{
+		png_destroy_read_struct(&png, 0, 0);
+		return false;
+	}
+
+	png_source src = {data, size, 0};
+
+	/* longjmp пропускает деструкторы (см. decode_jpeg) */
+	unsigned char *volatile buf = 0;
+
+	if (setjmp(png_jmpbuf(png)))
+	{
+		std::free(buf);
+		png_destroy_read_struct(&png, &info, 0);
+		return false;
+	}
+
+	png_set_read_fn(png, &src, png_read_mem);
+	png_read_info(png, info);
+
+	png_uint_32 w, h;
+	int bit_depth, color_type;
+	png_get_IHDR(png, info, &w, &h, &bit_depth, &color_type, 0, 0, 0);
+
+	if (w > (png_uint_32)max_image_size || h > (png_uint_32)max_image_size)
+	{
+		png_destroy_read_struct(&png, &info, 0);
+		return false;
+	}
+
+	/* RGBA - только если у изображения есть прозрачность */
+	const bool has_alpha = (color_type & PNG_COLOR_MASK_ALPHA)
+		|| png_get_valid(png, info, PNG_INFO_tRNS);
+	const int bpp = has_alpha ? 32 : opaque_bpp;
+
+	/* Приводим всё к 8-битному RGB(A) */
+	if (bit_depth == 16)
+		png_set_strip_16(png);
+	if (color_type == PNG_COLOR_TYPE_PALETTE)
+		png_set_palette_to_rgb(png);
+	if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+		png_set_expand_gray_1_2_4_to_8(png);
+	if (png_get_valid(png, info, PNG_INFO_tRNS))
+		png_set_tRNS_to_alpha(png);
+	if (color_type == PNG_COLOR_TYPE_GRAY
+		|| color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+	{
+		png_set_gray_to_rgb(png);
+	}
+	if (bpp == 32)
+		png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+
+	int passes = png_set_interlace_handling(png);
+	png_read_update_info(png, info);
+
+	width = (int)w;
+	height = (int)h;
+	raw.create(__p2(width), __p2(height), bpp);
+
+	const std::size_t stride = raw.width() * (bpp / 8);
+
+	if (bpp != 16)
+	{
+		/* Строки читаем сразу на место, без массива указателей */
+		for (int pass = 0; pass < passes; ++pass)
+			for (int i = 0; i < height; ++i)
+				png_read_row(png, raw.data() + i * stride, 0);
+	}
+	else
+	{
+		/* RGB565 - через буфер: строку, а для чересстрочных
+			изображений - всё изображение, т.к. проходы дописывают
+			строки друг друга */
+		const std::size_t row_size = width * 3;
+		buf = static_cast<unsigned char*>(
+			std::malloc(passes > 1 ? row_size * height : row_size) );
+		if (!buf)
+		{
+			png_destroy_read_struct(&png, &info, 0);
+			return false;
+		}
+
+		for (int pass = 0; pass < passes; ++pass)
+			for (int i = 0; i < height; ++i)
+			{
+				unsigned char *row = &buf[passes > 1 ? i * row_size : 0];
+				png_read_row(png, row, 0);
+
+				if (pass == passes - 1)
+					convert_rgb_to_rgb565(
+						(unsigned short*)(raw.data() + i * stride), row, width);
+			}
+	}
+
+	png_read_end(png, 0);
+	png_destroy_read_struct(&png, &info, 0);
+	std::free(buf);
+
+	clear_padding(raw, width, height);
+
+	return true;
+}
+
+#endif /* CARTOGRAPHER_USE_LIBPNG */
+
+bool native_decoders()
+{
+#if defined(CARTOGRAPHER_USE_LIBJPEG) || defined(CARTOGRAPHER_USE_LIBPNG)
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool decode_image(const void *data, std::size_t size,
+	raw_image &raw, int &width, int &height, int opaque_bpp)
+{
+#if defined(CARTOGRAPHER_USE_LIBJPEG) || defined(CARTOGRAPHER_USE_LIBPNG)
+	const unsigned char *ptr = static_cast<const unsigned char*>(data);
+#endif
+
+	/* Формат определяем по сигнатуре, а не по расширению */
+#ifdef CARTOGRAPHER_USE_LIBJPEG
+	if (size > 3 && ptr[0] == 0xFF && ptr[1] == 0xD8 && ptr[2] == 0xFF)
+		return decode_jpeg(ptr, size, raw, width, height, opaque_bpp);
+#endif
+
+#ifdef CARTOGRAPHER_USE_LIBPNG
+	if (size > 8 && png_sig_cmp(const_cast<png_bytep>(ptr), 0, 8) == 0)
+		return decode_png(ptr, size, raw, width, height, opaque_bpp);
+#endif
+
+	return false;
+}
+
+bool read_file(const std::wstring &filename, std::string &data)
+{
+#ifdef BOOST_WINDOWS
+	std::FILE *file = _wfopen(filename.c_str(), L"rb");
+#else
+	std::FILE *file = std::fopen(my::utf8::encode(filename).c_str(), "rb");
+#endif
+
+	if (!file)
+		return false;
+
+	bool ok = false;
+
+	if (std::fseek(file, 0, SEEK_END) == 0)
+	{
+		long size = std::ftell(file);
+
+		if (size > 0 && std::fseek(file, 0, SEEK_SET) == 0)
+		{
+			data.resize(size);
+			ok = std::fread(&data[0], 1, size, file) == (std::size_t)size;
+		}
+	}
+
+	std::fclose(file);
+
+	return ok;
+}
+
+} /* namespace cartographer */
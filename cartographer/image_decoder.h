@@ -0,0 +1,42 @@
+﻿#ifndef CARTOGRAPHER_IMAGE_DECODER_H
+#define CARTOGRAPHER_IMAGE_DECODER_H
+
+#include "raw_image.h"
+
+#include <cstddef> /* std::size_t */
+#include <string>
+
+/* Собственные декодеры подключаются при сборке:
+	CARTOGRAPHER_USE_LIBJPEG - JPEG через libjpeg(-turbo),
+	CARTOGRAPHER_USE_LIBPNG - PNG через libpng.
+	Без них всё декодирует wxImage */
+
+namespace cartographer
+{
+
+/* Число кратное 2, большее или равное a */
+inline int __p2(int a)
+{
+	int res = 1;
+	while (res < a)
+		res <<= 1;
+	return res;
+}
+
+/* Есть ли хоть один собственный декодер */
+bool native_decoders();
+
+/* Декодирование JPEG или PNG сразу в буфер текстуры (размеры
+	кратны 2, лишнее заполняется прозрачными точками) - без wxImage
+	и промежуточных копий. Изображения с альфой - всегда RGBA,
+	без альфы - в формате opaque_bpp: 32 (RGBA), 24 (RGB) или 16 (RGB565).
+	false - формат не поддерживается или данные испорчены */
+bool decode_image(const void *data, std::size_t size,
+	raw_image &raw, int &width, int &height, int opaque_bpp = 32);
+
+/* Чтение файла целиком */
+bool read_file(const std::wstring &filename, std::string &data);
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_IMAGE_DECODER_H */
@@ -0,0 +1,243 @@
+﻿#include "lz4_block.h"
+
+#include <cstring> /* std::memcpy */
+#include <vector>
+
+#include <boost/cstdint.hpp> /* boost::uint32_t */
+
+namespace cartographer
+{
+
+/* Ограничения формата: совпадение - не короче 4 байт и не дальше
+	64 КБ, последние 5 байт - всегда литералы, последнее совпадение
+	начинается не ближе 12 байт к концу */
+static const std::size_t min_match = 4;
+static const std::size_t last_literals = 5;
+static const std::size_t mf_limit = 12;
+static const std::size_t max_offset = 65535;
+
+/* Копирование постоянной длины при распаковке */
+static const std::size_t fast_copy = 16;
+
+/* Хэш-таблица последних позиций: 2^hash_log записей */
+static const int hash_log = 12;
+
+static inline boost::uint32_t read32(const unsigned char *p)
+{
+	boost::uint32_t v;
+	std::memcpy(&v, p, 4);
+	return v;
+}
+
+static inline std::size_t hash32(boost::uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - hash_log);
+}
+
+/* Длина (литералов или совпадения) сверх 15 - байтами по 255 */
+static inline bool put_length(unsigned char *&op, const unsigned char *oend,
+	std::size_t len)
+{
+	for (; len >= 255; len -= 255)
+	{
+		if (op >= oend)
+			return false;
+		*op++ = 255;
+	}
+
+	if (op >= oend)
+		return false;
+	*op++ = (unsigned char)len;
+
+	return true;
+}
+
+static inline bool get_length(const unsigned char *&ip, const unsigned char *iend,
+	std::size_t &len)
+{
+	unsigned char b;
+
+	do
+	{
+		if (ip >= iend)
+			return false;
+		b = *ip++;
+		len += b;
+	} while (b == 255);
+
+	return true;
+}
+
+/* Последовательность: литералы, затем совпадение (если match_len) */
+static bool put_sequence(unsigned char *&op, const unsigned char *oend,
+	const unsigned char *literals, std::size_t lit_len,
+	std::size_t offset, std::size_t match_len)
+{
+	if (op >= oend)
+		return false;
+
+	unsigned char *token = op++;
+	std::size_t ml = match_len ? match_len - min_match : 0;
+
+	*token = (unsigned char)( ((lit_len < 15 ? lit_len : 15) << 4)
+		| (ml < 15 ? ml : 15) );
+
+	if (lit_len >= 15 && !put_length(op, oend, lit_len - 15))
+		return false;
+
+	if ((std::size_t)(oend - op) < lit_len)
+		return false;
+	if (lit_len)
+		std::memcpy(op, literals, lit_len);
+	op += lit_len;
+
+	if (!match_len)
+		return true;
+
+	if (oend - op < 2)
+		return false;
+	*op++ = (unsigned char)(offset & 0xff);
+	*op++ = (unsigned char)(offset >> 8);
+
+	if (ml >= 15 && !put_length(op, oend, ml - 15))
+		return false;
+
+	return true;
+}
+
+std::size_t lz4_bound(std::size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+std::size_t lz4_compress(const unsigned char *src, std::size_t size,
+	unsigned char *dst, std::size_t capacity)
+{
+	unsigned char *op = dst;
+	const unsigned char *oend = dst + capacity;
+	std::size_t anchor = 0;
+
+	if (size > mf_limit)
+	{
+		/* Позиции храним со сдвигом на 1: 0 - пусто */
+		std::vector<boost::uint32_t> table(1 << hash_log, 0);
+
+		const std::size_t limit = size - mf_limit;
+		const std::size_t match_limit = size - last_literals;
+		std::size_t ip = 0;
+
+		while (ip < limit)
+		{
+			boost::uint32_t seq = read32(src + ip);
+			std::size_t h = hash32(seq);
+			std::size_t ref = table[h];
+			table[h] = (boost::uint32_t)(ip + 1);
+
+			if (ref == 0 || ip - (ref - 1) > max_offset
+				|| read32(src + ref - 1) != seq)
+			{
+				/* Чем дольше нет совпадений, тем крупнее шаг -
+					несжимаемые данные проходим быстро */
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			--ref;
+
+			std::size_t len = min_match;
+			while (ip + len < match_limit && src[ref + len] == src[ip + len])
+				++len;
+
+			if (!put_sequence(op, oend, src + anchor, ip - anchor, ip - ref, len))
+				return 0;
+
+			ip += len;
+			anchor = ip;
+		}
+	}
+
+	if (!put_sequence(op, oend, src + anchor, size - anchor, 0, 0))
+		return 0;
+
+	return op - dst;
+}
+
+bool lz4_decompress(const unsigned char *src, std::size_t size,
+	unsigned char *dst, std::size_t dst_size)
+{
+	const unsigned char *ip = src;
+	const unsigned char *iend = src + size;
+	unsigned char *op = dst;
+	unsigned char *oend = dst + dst_size;
+
+	while (ip < iend)
+	{
+		const unsigned char token = *ip++;
+
+		/* Литералы */
+		std::size_t len = token >> 4;
+		if (len == 15 && !get_length(ip, iend, len))
+			return false;
+
+		if ((std::size_t)(iend - ip) < len || (std::size_t)(oend - op) < len)
+			return false;
+
+		/* Короткие литералы (их большинство) - копированием
+			постоянной длины, если есть запас: лишнее перезапишется */
+		if (len <= fast_copy && (std::size_t)(iend - ip) >= fast_copy
+			&& (std::size_t)(oend - op) >= fast_copy)
+			std::memcpy(op, ip, fast_copy);
+		else
+			std::memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		/* Последняя последовательность - без совпадения */
+		if (ip == iend)
+			break;
+
+		/* Совпадение */
+		if (iend - ip < 2)
+			return false;
+
+		std::size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (offset == 0 || offset > (std::size_t)(op - dst))
+			return false;
+
+		len = token & 15;
+		if (len == 15 && !get_length(ip, iend, len))
+			return false;
+		len += min_match;
+
+		if ((std::size_t)(oend - op) < len)
+			return false;
+
+		/* Совпадение может перекрываться с собой (повтор короткого
+			фрагмента) - копируем кусками, каждый раз вдвое длиннее */
+		const unsigned char *match = op - offset;
+		unsigned char *end = op + len;
+
+		if (len <= fast_copy && offset >= fast_copy
+			&& (std::size_t)(oend - op) >= fast_copy)
+		{
+			std::memcpy(op, match, fast_copy);
+			op = end;
+		}
+
+		while (op < end)
+		{
+			std::size_t n = op - match;
+			if (n > (std::size_t)(end - op))
+				n = end - op;
+
+			std::memcpy(op, match, n);
+			op += n;
+		}
+	}
+
+	return ip == iend && op == oend;
+}
+
+} /* namespace cartographer */
@@ -0,0 +1,31 @@
+﻿#ifndef CARTOGRAPHER_LZ4_BLOCK_H
+#define CARTOGRAPHER_LZ4_BLOCK_H
+
+#include <cstddef> /* std::size_t */
+
+namespace cartographer
+{
+
+/*
+	Сжатие блока в формате LZ4 (block format, без кадра) - быстрое
+	и простое, распаковка - почти со скоростью копирования памяти.
+	Собственная реализация: жадный поиск совпадений по хэшу 4 байт,
+	без зависимостей. Совместим с LZ4_decompress_safe()
+*/
+
+/* Размер буфера под сжатые данные в худшем случае */
+std::size_t lz4_bound(std::size_t size);
+
+/* Сжатие. Возвращает размер сжатых данных,
+	0 - не уместились в capacity */
+std::size_t lz4_compress(const unsigned char *src, std::size_t size,
+	unsigned char *dst, std::size_t capacity);
+
+/* Распаковка ровно в dst_size байт. false - данные испорчены
+	или не того размера */
+bool lz4_decompress(const unsigned char *src, std::size_t size,
+	unsigned char *dst, std::size_t dst_size);
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_LZ4_BLOCK_H */
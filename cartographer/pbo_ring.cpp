@@ -0,0 +1,227 @@
+﻿#include "pbo_ring.h"
+#include "gl_proc.h"
+
+#include <cstdio> /* std::sprintf */
+
+/* Константы OpenGL 1.5/2.1 (в gl.h Windows их нет) */
+#define CARTOGRAPHER_GL_PIXEL_UNPACK_BUFFER 0x88EC
+#define CARTOGRAPHER_GL_STREAM_DRAW 0x88E0
+#define CARTOGRAPHER_GL_WRITE_ONLY 0x88B9
+
+namespace cartographer
+{
+
+pbo_ring::pbo_ring()
+	: MY_MUTEX_DEF(mutex_,true)
+	, slot_size_(0)
+	, enabled_(false)
+	, gen_buffers_(0)
+	, delete_buffers_(0)
+	, bind_buffer_(0)
+	, buffer_data_(0)
+	, map_buffer_(0)
+	, unmap_buffer_(0)
+{
+}
+
+bool pbo_ring::load_functions()
+{
+	if (!gl_supports(2, 1, "GL_ARB_pixel_buffer_object"))
+		return false;
+
+	bool core = gl_supports(2, 1, 0);
+
+	/* В ядре функции без суффикса, в расширении - с суффиксом ARB */
+	const char *sfx = core ? "" : "ARB";
+	char name[64];
+
+	#define LOAD_GL_PROC(var, type, proc) \
+		std::sprintf(name, "%s%s", proc, sfx); \
+		var = (type)get_gl_proc(name);
+
+	LOAD_GL_PROC(gen_buffers_, gen_buffers_t, "glGenBuffers")
+	LOAD_GL_PROC(delete_buffers_, delete_buffers_t, "glDeleteBuffers")
+	LOAD_GL_PROC(bind_buffer_, bind_buffer_t, "glBindBuffer")
+	LOAD_GL_PROC(buffer_data_, buffer_data_t, "glBufferData")
+	LOAD_GL_PROC(map_buffer_, map_buffer_t, "glMapBuffer")
+	LOAD_GL_PROC(unmap_buffer_, unmap_buffer_t, "glUnmapBuffer")
+
+	#undef LOAD_GL_PROC
+
+	return gen_buffers_ && delete_buffers_ && bind_buffer_
+		&& buffer_data_ && map_buffer_ && unmap_buffer_;
+}
+
+bool pbo_ring::init(std::size_t count, std::size_t slot_size)
+{
+	deinit();
+
+	if (count == 0 || !load_functions())
+		return false;
+
+	std::vector<GLuint> buffers(count);
+	gen_buffers_((GLsizei)count, &buffers[0]);
+
+	if (glGetError() != GL_NO_ERROR)
+		return false;
+
+	{
+		unique_lock<mutex> lock(mutex_);
+
+		slots_.resize(count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			slots_[i].buffer = buffers[i];
+			slots_[i].ptr = 0;
+			slots_[i].state = st_unmapped;
+		}
+
+		slot_size_ = slot_size;
+		enabled_ = true;
+	}
+
+	prepare();
+
+	return true;
+}
+
+void pbo_ring::deinit()
+{
+	std::vector<slot> slots;
+
+	{
+		unique_lock<mutex> lock(mutex_);
+		enabled_ = false;
+		slots.swap(slots_);
+	}
+
+	/* Занятые тайлами буферы тоже удаляются (их пиксели теряются),
+		поэтому вызывать - только когда декодеры остановлены */
+	for (std::size_t i = 0; i < slots.size(); ++i)
+	{
+		if (slots[i].ptr)
+		{
+			bind_buffer_(CARTOGRAPHER_GL_PIXEL_UNPACK_BUFFER, slots[i].buffer);
+			unmap_buffer_(CARTOGRAPHER_GL_PIXEL_UNPACK_BUFFER);
+		}
+		delete_buffers_(1, &slots[i].buffer);
+	}
+
+	if (!slots.empty())
+		bind_buffer_(CARTOGRAPHER_GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void pbo_ring::prepare()
+{
+	unique_lock<mutex> lock(mutex_);
+
+	bool bound = false;
+
+	for (std::size_t i = 0; i < slots_.size(); ++i)
+	{
+		slot &s = slots_[i];
+
+		if (s.state != st_unmapped)
+			continue;
+
+		/* Старое содержимое отбрасываем (orphaning): драйвер выделит
+			новую память, не дожидаясь окончания предыдущей загрузки */
+		bind_buffer_(CARTOGRAPHER_GL_PIXEL_UNPACK_BUFFER, s.buffer);
+		buffer_data_(CARTOGRAPHER_GL_PIXEL_UNPACK_BUFFER,
+			(gl_sizeiptr)slot_size_, 0, CARTOGRAPHER_GL_STREAM_DRAW);
+		s.ptr = (unsigned char*)map_buffer_(
+			CARTOGRAPHER_GL_PIXEL_UNPACK_BUFFER, CARTOGRAPHER_GL_WRITE_ONLY);
+		bound = true;
+
+		if (s.ptr)
+			s.state = st_mapped;
+	}
+
+	if (bound)
+		bind_buffer_(CARTOGRAPHER_GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+bool pbo_ring::begin_upload(int slot_index)
+{
+	unique_lock<mutex> lock(mutex_);
+
+	if (!enabled_)
+		return false;
+
+	slot &s = slots_[slot_index];
+	s.state = st_uploading;
+	s.ptr = 0;
+
+	bind_buffer_(CARTOGRAPHER_GL_PIXEL_UNPACK_BUFFER, s.buffer);
+	return unmap_buffer_(CARTOGRAPHER_GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+}
+
+void pbo_ring::end_upload(int slot_index)
+{
+	unique_lock<mutex> lock(mutex_);
+
+	if (!enabled_)
+		return;
+
+	bind_buffer_(CARTOGRAPHER_GL_PIXEL_UNPACK_BUFFER, 0);
+	slots_[slot_index].state = st_unmapped;
+}
+
+int pbo_ring::acquire(std::size_t size)
+{
+	unique_lock<mutex> lock(mutex_);
+
+	if (!enabled_ || size > slot_size_)
+		return -1;
+
+	for (std::size_t i = 0; i < slots_.size(); ++i)
+		if (slots_[i].state == st_mapped)
+		{
+			slots_[i].state = st_taken;
+			return (int)i;
+		}
+
+	return -1;
+}
+
+unsigned char* pbo_ring::data(int slot_index)
+{
+	unique_lock<mutex> lock(mutex_);
+	return slots_[slot_index].ptr;
+}
+
+void pbo_ring::release(int slot_index)
+{
+	unique_lock<mutex> lock(mutex_);
+
+	/* Буфер остаётся отображённым - сразу готов к повторному
+		использованию */
+	if (enabled_ && slots_[slot_index].state == st_taken)
+		slots_[slot_index].state = st_mapped;
+}
+
+bool pbo_ring::enabled()
+{
+	unique_lock<mutex> lock(mutex_);
+	return enabled_;
+}
+
+std::size_t pbo_ring::size()
+{
+	unique_lock<mutex> lock(mutex_);
+	return slots_.size();
+}
+
+std::size_t pbo_ring::in_use()
+{
+	unique_lock<mutex> lock(mutex_);
+
+	std::size_t count = 0;
+	for (std::size_t i = 0; i < slots_.size(); ++i)
+		if (slots_[i].state != st_mapped)
+			++count;
+
+	return count;
+}
+
+} /* namespace cartographer */
@@ -0,0 +1,105 @@
+﻿#ifndef CARTOGRAPHER_PBO_RING_H
+#define CARTOGRAPHER_PBO_RING_H
+
+#include "config.h" /* Обязательно первым */
+
+#include <mylib.h>
+
+#include <cstddef> /* std::size_t, std::ptrdiff_t */
+#include <vector>
+
+#include <GL/gl.h> /* OpenGL */
+
+namespace cartographer
+{
+
+/*
+	Кольцо буферов PBO (GL_PIXEL_UNPACK_BUFFER) для асинхронной
+	загрузки текстур. Поток отрисовки держит свободные буферы
+	отображёнными в память, декодеры занимают их и складывают туда
+	пиксели, а поток отрисовки создаёт текстуру прямо из буфера -
+	пиксели копирует драйвер (DMA), а не поток отрисовки.
+
+	Если PBO нет (OpenGL < 2.1 без GL_ARB_pixel_buffer_object),
+	кольцо выключено: acquire() всегда -1, и тайлы загружаются
+	в текстуры по-старому - из ОЗУ
+*/
+class pbo_ring
+{
+public:
+	pbo_ring();
+
+	/*
+		Только в потоке OpenGL
+	*/
+
+	/* Создание count буферов по slot_size байт. false - PBO нет */
+	bool init(std::size_t count, std::size_t slot_size);
+
+	/* Удаление буферов. Только при остановленных декодерах */
+	void deinit();
+
+	/* Отображение в память освободившихся буферов (раз в кадр) */
+	void prepare();
+
+	/* Загрузка из буфера: begin_upload() привязывает буфер
+		к GL_PIXEL_UNPACK_BUFFER, после чего glTexImage2D() получает
+		вместо указателя на пиксели смещение в буфере (0).
+		false - содержимое буфера потеряно (glUnmapBuffer) */
+	bool begin_upload(int slot);
+	void end_upload(int slot);
+
+	/*
+		В любом потоке
+	*/
+
+	/* Свободный отображённый буфер не меньше size байт. -1 - нет */
+	int acquire(std::size_t size);
+
+	/* Память буфера, полученного acquire() */
+	unsigned char* data(int slot);
+
+	/* Возврат незагруженного буфера (тайл удалён) */
+	void release(int slot);
+
+	bool enabled();
+	std::size_t size();
+	std::size_t in_use();
+
+private:
+	typedef std::ptrdiff_t gl_sizeiptr;
+	typedef void (APIENTRY *gen_buffers_t)(GLsizei n, GLuint *buffers);
+	typedef void (APIENTRY *delete_buffers_t)(GLsizei n, const GLuint *buffers);
+	typedef void (APIENTRY *bind_buffer_t)(GLenum target, GLuint buffer);
+	typedef void (APIENTRY *buffer_data_t)(GLenum target, gl_sizeiptr size,
+		const void *data, GLenum usage);
+	typedef void* (APIENTRY *map_buffer_t)(GLenum target, GLenum access);
+	typedef GLboolean (APIENTRY *unmap_buffer_t)(GLenum target);
+
+	enum {st_unmapped, st_mapped, st_taken, st_uploading};
+
+	struct slot
+	{
+		GLuint buffer;
+		unsigned char *ptr;
+		int state;
+	};
+
+	mutex mutex_;
+	std::vector<slot> slots_;
+	std::size_t slot_size_;
+	bool enabled_;
+
+	gen_buffers_t gen_buffers_;
+	delete_buffers_t delete_buffers_;
+	bind_buffer_t bind_buffer_;
+	buffer_data_t buffer_data_;
+	map_buffer_t map_buffer_;
+	unmap_buffer_t unmap_buffer_;
+
+	bool load_functions();
+};
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_PBO_RING_H */
@@ -0,0 +1,203 @@
+﻿#include "config.h" /* Обязательно первым */
+#include "pixel_buffers.h"
+
+#include <mylib.h> /* mutex */
+
+#include <vector>
+
+#ifdef BOOST_WINDOWS
+	#include <windows.h> /* VirtualAlloc */
+#else
+	#include <sys/mman.h> /* mmap */
+#endif
+
+namespace cartographer
+{
+
+/* Меньшие буферы - мимо пула */
+static const std::size_t min_pooled_size = 16 * 1024;
+
+/* Блок, запрашиваемый у системы (размер большой страницы x86).
+	Большие буферы - мимо пула */
+static const std::size_t block_size = 2 * 1024 * 1024;
+
+/* Больше размеров в пуле не держим - остальные мимо пула */
+static const std::size_t max_size_classes = 8;
+
+class pixel_pool
+{
+public:
+	pixel_pool()
+		: MY_MUTEX_DEF(mutex_,false)
+		, use_huge_pages_(false) {}
+
+	unsigned char* alloc(std::size_t size)
+	{
+		{
+			unique_lock<mutex> lock(mutex_);
+
+			size_class *cl = find_class(size, true);
+
+			if (cl)
+			{
+				if (cl->free.empty())
+					grow(*cl);
+
+				unsigned char *ptr = cl->free.back();
+				cl->free.pop_back();
+
+				++stats_.pooled;
+				++stats_.buffers_in_use;
+				--stats_.buffers_free;
+				stats_.in_use += size;
+				if (stats_.in_use > stats_.high_water)
+					stats_.high_water = stats_.in_use;
+
+				return ptr;
+			}
+
+			++stats_.unpooled;
+		}
+
+		return new unsigned char[size];
+	}
+
+	void release(unsigned char *ptr, std::size_t size)
+	{
+		{
+			unique_lock<mutex> lock(mutex_);
+
+			size_class *cl = find_class(size, false);
+
+			if (cl)
+			{
+				cl->free.push_back(ptr);
+
+				--stats_.buffers_in_use;
+				++stats_.buffers_free;
+				stats_.in_use -= size;
+
+				return;
+			}
+		}
+
+		delete[] ptr;
+	}
+
+	void use_huge_pages(bool on)
+	{
+		unique_lock<mutex> lock(mutex_);
+		use_huge_pages_ = on;
+	}
+
+	pixel_buffers_stats get_stats()
+	{
+		unique_lock<mutex> lock(mutex_);
+		pixel_buffers_stats st = stats_;
+		st.size_classes = classes_.size();
+		return st;
+	}
+
+private:
+	struct size_class
+	{
+		std::size_t size;
+		std::vector<unsigned char*> free;
+	};
+
+	mutex mutex_;
+	std::vector<size_class> classes_;
+	bool use_huge_pages_;
+	pixel_buffers_stats stats_;
+
+	/* Размер, обслуживаемый пулом. Набор размеров только растёт,
+		поэтому решение "из пула или мимо" для размера неизменно
+		и при выделении, и при освобождении */
+	size_class* find_class(std::size_t size, bool create)
+	{
+		for (std::size_t i = 0; i < classes_.size(); ++i)
+			if (classes_[i].size == size)
+				return &classes_[i];
+
+		if (!create || size < min_pooled_size || size > block_size
+			|| classes_.size() >= max_size_classes)
+		{
+			return 0;
+		}
+
+		classes_.push_back(size_class());
+		classes_.back().size = size;
+		return &classes_.back();
+	}
+
+	/* Новый блок у системы, нарезанный на буферы. Блоки системе
+		не возвращаются: объём пула - это пиковая потребность */
+	void grow(size_class &cl)
+	{
+		const std::size_t count = block_size / cl.size;
+		const std::size_t bytes = count * cl.size;
+		unsigned char *block = 0;
+
+		if (use_huge_pages_)
+			block = alloc_huge(bytes);
+
+		if (block)
+			stats_.huge_pages = true;
+		else
+			block = new unsigned char[bytes];
+
+		for (std::size_t i = 0; i < count; ++i)
+			cl.free.push_back(block + i * cl.size);
+
+		stats_.reserved += bytes;
+		stats_.buffers_free += count;
+	}
+
+	static unsigned char* alloc_huge(std::size_t bytes)
+	{
+#if defined(BOOST_WINDOWS)
+		/* Требует привилегии SeLockMemoryPrivilege, без неё - отказ */
+		SIZE_T page = GetLargePageMinimum();
+		if (page == 0 || bytes % page != 0)
+			return 0;
+
+		return (unsigned char*)VirtualAlloc(0, bytes,
+			MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+#elif defined(MAP_HUGETLB)
+		/* Требует зарезервированных страниц (vm.nr_hugepages) */
+		void *ptr = mmap(0, bytes, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		return ptr == MAP_FAILED ? 0 : (unsigned char*)ptr;
+#else
+		(void)bytes;
+		return 0;
+#endif
+	}
+};
+
+/* Пул не уничтожается: буферы могут освобождаться
+	и после выхода из main() */
+static pixel_pool &pool = *new pixel_pool;
+
+unsigned char* alloc_pixel_buffer(std::size_t size)
+{
+	return pool.alloc(size);
+}
+
+void free_pixel_buffer(unsigned char *ptr, std::size_t size)
+{
+	if (ptr)
+		pool.release(ptr, size);
+}
+
+void use_huge_pages_for_pixels(bool on)
+{
+	pool.use_huge_pages(on);
+}
+
+pixel_buffers_stats get_pixel_buffers_stats()
+{
+	return pool.get_stats();
+}
+
+} /* namespace cartographer */
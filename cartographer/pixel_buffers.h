@@ -0,0 +1,51 @@
+﻿#ifndef CARTOGRAPHER_PIXEL_BUFFERS_H
+#define CARTOGRAPHER_PIXEL_BUFFERS_H
+
+#include <cstddef> /* std::size_t */
+
+namespace cartographer
+{
+
+/*
+	Пул буферов под пиксели (raw_image). Тайлы все одного размера,
+	поэтому буферы не возвращаются в кучу, а складываются в пул
+	по размерам и выдаются повторно - без постоянных malloc/free
+	по 128-256 КБ из разных потоков и без фрагментации кучи.
+	Память у системы берётся блоками (по 2 МБ), при желании -
+	в больших страницах (huge pages). Мелкие буферы (спрайты)
+	и буферы редких размеров выделяются как обычно.
+	Все функции потокобезопасны
+*/
+
+struct pixel_buffers_stats
+{
+	std::size_t reserved; /* Взято у системы под пул (в байтах) */
+	std::size_t in_use; /* Выдано из пула */
+	std::size_t high_water; /* Максимум выданного за всё время */
+	std::size_t buffers_in_use; /* Буферов выдано */
+	std::size_t buffers_free; /* Буферов в пуле */
+	std::size_t size_classes; /* Размеров буферов */
+	long pooled; /* Выдано из пула (всего) */
+	long unpooled; /* Выделено мимо пула (всего) */
+	bool huge_pages; /* Хотя бы часть пула - в больших страницах */
+
+	pixel_buffers_stats()
+		: reserved(0), in_use(0), high_water(0)
+		, buffers_in_use(0), buffers_free(0), size_classes(0)
+		, pooled(0), unpooled(0), huge_pages(false) {}
+};
+
+unsigned char* alloc_pixel_buffer(std::size_t size);
+
+/* size - тот же, что при выделении */
+void free_pixel_buffer(unsigned char *ptr, std::size_t size);
+
+/* Использовать большие страницы для новых блоков пула.
+	Если система не даёт, используются обычные */
+void use_huge_pages_for_pixels(bool on);
+
+pixel_buffers_stats get_pixel_buffers_stats();
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_PIXEL_BUFFERS_H */
@@ -0,0 +1,547 @@
+﻿#include "pixel_convert.h"
+
+#include <mylib.h> /* my::time::utc_now */
+
+#include <cstring> /* std::memcmp */
+#include <vector>
+#include <sstream>
+
+/* SIMD-версии - только для x86/x64 и компиляторов, умеющих
+	включать нужные инструкции для отдельных функций */
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	#define CARTOGRAPHER_SSSE3
+	#define CARTOGRAPHER_TARGET(isa)
+	#if _MSC_VER >= 1700
+		#define CARTOGRAPHER_AVX2
+	#endif
+	#include <intrin.h>
+#elif (defined(__i386__) || defined(__x86_64__)) \
+	&& (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+	#define CARTOGRAPHER_SSSE3
+	#define CARTOGRAPHER_AVX2
+	#define CARTOGRAPHER_TARGET(isa) __attribute__((target(isa)))
+	#include <cpuid.h>
+#endif
+
+#ifdef CARTOGRAPHER_SSSE3
+	#include <tmmintrin.h>
+#endif
+#ifdef CARTOGRAPHER_AVX2
+	#include <immintrin.h>
+#endif
+
+namespace cartographer
+{
+
+/* Умножение на альфу с точным округлением x * a / 255 */
+static inline unsigned char premultiply(unsigned int x, unsigned int a)
+{
+	unsigned int t = x * a + 128;
+	return (unsigned char)((t + (t >> 8)) >> 8);
+}
+
+
+/*
+	Обычный C++
+*/
+
+static void rgb_to_rgba_cpp(unsigned char *dst,
+	const unsigned char *rgb, int count)
+{
+	for (int i = 0; i < count; ++i, dst += 4, rgb += 3)
+	{
+		dst[0] = rgb[0];
+		dst[1] = rgb[1];
+		dst[2] = rgb[2];
+		dst[3] = 255;
+	}
+}
+
+static void rgb_a_to_rgba_cpp(unsigned char *dst,
+	const unsigned char *rgb, const unsigned char *alpha, int count)
+{
+	for (int i = 0; i < count; ++i, dst += 4, rgb += 3)
+	{
+		dst[0] = rgb[0];
+		dst[1] = rgb[1];
+		dst[2] = rgb[2];
+		dst[3] = alpha[i];
+	}
+}
+
+static void rgb_a_to_premultiplied_cpp(unsigned char *dst,
+	const unsigned char *rgb, const unsigned char *alpha, int count)
+{
+	for (int i = 0; i < count; ++i, dst += 4, rgb += 3)
+	{
+		unsigned int a = alpha[i];
+		dst[0] = premultiply(rgb[0], a);
+		dst[1] = premultiply(rgb[1], a);
+		dst[2] = premultiply(rgb[2], a);
+		dst[3] = (unsigned char)a;
+	}
+}
+
+
+/*
+	SSSE3: 16 точек за проход. В SSE2 нет перестановки байт (pshufb),
+	без неё раскладка RGB -> RGBA получается медленнее побайтовой
+*/
+
+#ifdef CARTOGRAPHER_SSSE3
+
+/* Четыре группы по 4 точки (48 байт RGB) -> 4 x 4 точки RGBA без альфы */
+#define CARTOGRAPHER_SPLIT_RGB(rgb, p0, p1, p2, p3) \
+	{ \
+		const __m128i mask = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, \
+			6, 7, 8, -1, 9, 10, 11, -1); \
+		__m128i a = _mm_loadu_si128((const __m128i*)(rgb)); \
+		__m128i b = _mm_loadu_si128((const __m128i*)(rgb + 16)); \
+		__m128i c = _mm_loadu_si128((const __m128i*)(rgb + 32)); \
+		p0 = _mm_shuffle_epi8(a, mask); \
+		p1 = _mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), mask); \
+		p2 = _mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), mask); \
+		p3 = _mm_shuffle_epi8(_mm_srli_si128(c, 4), mask); \
+	}
+
+/* Умножение цвета 4-х точек RGBA на их альфу */
+CARTOGRAPHER_TARGET("ssse3")
+static inline __m128i premultiply_ssse3(__m128i p)
+{
+	const __m128i zero = _mm_setzero_si128();
+	/* Для самой альфы множитель - 255 */
+	const __m128i alpha_mask = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+	const __m128i alpha_255 = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+	const __m128i round = _mm_set1_epi16(128);
+
+	__m128i res[2];
+
+	for (int i = 0; i < 2; ++i)
+	{
+		__m128i x = i == 0 ? _mm_unpacklo_epi8(p, zero) : _mm_unpackhi_epi8(p, zero);
+		__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xFF), 0xFF);
+		a = _mm_or_si128(_mm_andnot_si128(alpha_mask, a), alpha_255);
+
+		x = _mm_add_epi16(_mm_mullo_epi16(x, a), round);
+		res[i] = _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+	}
+
+	return _mm_packus_epi16(res[0], res[1]);
+}
+
+/* Альфа 16 точек -> 4 x 4 точки (альфа в старшем байте) */
+CARTOGRAPHER_TARGET("ssse3")
+static inline void split_alpha_ssse3(const unsigned char *alpha,
+	__m128i &a0, __m128i &a1, __m128i &a2, __m128i &a3)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = _mm_loadu_si128((const __m128i*)alpha);
+	__m128i lo = _mm_unpacklo_epi8(zero, a);
+	__m128i hi = _mm_unpackhi_epi8(zero, a);
+	a0 = _mm_unpacklo_epi16(zero, lo);
+	a1 = _mm_unpackhi_epi16(zero, lo);
+	a2 = _mm_unpacklo_epi16(zero, hi);
+	a3 = _mm_unpackhi_epi16(zero, hi);
+}
+
+CARTOGRAPHER_TARGET("ssse3")
+static void rgb_to_rgba_ssse3(unsigned char *dst,
+	const unsigned char *rgb, int count)
+{
+	const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16, rgb += 48, dst += 64)
+	{
+		__m128i p0, p1, p2, p3;
+		CARTOGRAPHER_SPLIT_RGB(rgb, p0, p1, p2, p3);
+		_mm_storeu_si128((__m128i*)dst, _mm_or_si128(p0, alpha));
+		_mm_storeu_si128((__m128i*)(dst + 16), _mm_or_si128(p1, alpha));
+		_mm_storeu_si128((__m128i*)(dst + 32), _mm_or_si128(p2, alpha));
+		_mm_storeu_si128((__m128i*)(dst + 48), _mm_or_si128(p3, alpha));
+	}
+
+	rgb_to_rgba_cpp(dst, rgb, count - i);
+}
+
+CARTOGRAPHER_TARGET("ssse3")
+static void rgb_a_to_rgba_ssse3(unsigned char *dst,
+	const unsigned char *rgb, const unsigned char *alpha, int count)
+{
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16, rgb += 48, alpha += 16, dst += 64)
+	{
+		__m128i p0, p1, p2, p3, a0, a1, a2, a3;
+		CARTOGRAPHER_SPLIT_RGB(rgb, p0, p1, p2, p3);
+		split_alpha_ssse3(alpha, a0, a1, a2, a3);
+		_mm_storeu_si128((__m128i*)dst, _mm_or_si128(p0, a0));
+		_mm_storeu_si128((__m128i*)(dst + 16), _mm_or_si128(p1, a1));
+		_mm_storeu_si128((__m128i*)(dst + 32), _mm_or_si128(p2, a2));
+		_mm_storeu_si128((__m128i*)(dst + 48), _mm_or_si128(p3, a3));
+	}
+
+	rgb_a_to_rgba_cpp(dst, rgb, alpha, count - i);
+}
+
+CARTOGRAPHER_TARGET("ssse3")
+static void rgb_a_to_premultiplied_ssse3(unsigned char *dst,
+	const unsigned char *rgb, const unsigned char *alpha, int count)
+{
+	int i = 0;
+
+	for (; i + 16 <= count; i += 16, rgb += 48, alpha += 16, dst += 64)
+	{
+		__m128i p0, p1, p2, p3, a0, a1, a2, a3;
+		CARTOGRAPHER_SPLIT_RGB(rgb, p0, p1, p2, p3);
+		split_alpha_ssse3(alpha, a0, a1, a2, a3);
+		_mm_storeu_si128((__m128i*)dst, premultiply_ssse3(_mm_or_si128(p0, a0)));
+		_mm_storeu_si128((__m128i*)(dst + 16), premultiply_ssse3(_mm_or_si128(p1, a1)));
+		_mm_storeu_si128((__m128i*)(dst + 32), premultiply_ssse3(_mm_or_si128(p2, a2)));
+		_mm_storeu_si128((__m128i*)(dst + 48), premultiply_ssse3(_mm_or_si128(p3, a3)));
+	}
+
+	rgb_a_to_premultiplied_cpp(dst, rgb, alpha, count - i);
+}
+
+#endif /* CARTOGRAPHER_SSSE3 */
+
+
+/*
+	AVX2: 8 точек за проход. Каждая половина регистра читает по 12 байт
+	RGB (загрузка 16 байт), поэтому последние точки - обычным кодом
+*/
+
+#ifdef CARTOGRAPHER_AVX2
+
+CARTOGRAPHER_TARGET("avx2")
+static inline __m256i load_rgb_avx2(const unsigned char *rgb)
+{
+	const __m256i mask = _mm256_setr_epi8(
+		0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+		0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+
+	__m256i p = _mm256_inserti128_si256( _mm256_castsi128_si256(
+		_mm_loadu_si128((const __m128i*)rgb)),
+		_mm_loadu_si128((const __m128i*)(rgb + 12)), 1 );
+
+	return _mm256_shuffle_epi8(p, mask);
+}
+
+CARTOGRAPHER_TARGET("avx2")
+static inline __m256i load_alpha_avx2(const unsigned char *alpha)
+{
+	return _mm256_slli_epi32( _mm256_cvtepu8_epi32(
+		_mm_loadl_epi64((const __m128i*)alpha) ), 24 );
+}
+
+CARTOGRAPHER_TARGET("avx2")
+static inline __m256i premultiply_avx2(__m256i p)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i alpha_mask = _mm256_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1,
+		0, 0, 0, -1, 0, 0, 0, -1);
+	const __m256i alpha_255 = _mm256_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255,
+		0, 0, 0, 255, 0, 0, 0, 255);
+	const __m256i round = _mm256_set1_epi16(128);
+
+	__m256i res[2];
+
+	/* unpack/pack работают внутри половин - порядок точек сохраняется */
+	for (int i = 0; i < 2; ++i)
+	{
+		__m256i x = i == 0 ? _mm256_unpacklo_epi8(p, zero) : _mm256_unpackhi_epi8(p, zero);
+		__m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, 0xFF), 0xFF);
+		a = _mm256_or_si256(_mm256_andnot_si256(alpha_mask, a), alpha_255);
+
+		x = _mm256_add_epi16(_mm256_mullo_epi16(x, a), round);
+		res[i] = _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+	}
+
+	return _mm256_packus_epi16(res[0], res[1]);
+}
+
+CARTOGRAPHER_TARGET("avx2")
+static void rgb_to_rgba_avx2(unsigned char *dst,
+	const unsigned char *rgb, int count)
+{
+	const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+	int i = 0;
+
+	/* Читаем 28 байт на 8 точек - нужен запас в 2 точки */
+	for (; i + 10 <= count; i += 8, rgb += 24, dst += 32)
+		_mm256_storeu_si256((__m256i*)dst,
+			_mm256_or_si256(load_rgb_avx2(rgb), alpha));
+
+	rgb_to_rgba_cpp(dst, rgb, count - i);
+}
+
+CARTOGRAPHER_TARGET("avx2")
+static void rgb_a_to_rgba_avx2(unsigned char *dst,
+	const unsigned char *rgb, const unsigned char *alpha, int count)
+{
+	int i = 0;
+
+	for (; i + 10 <= count; i += 8, rgb += 24, alpha += 8, dst += 32)
+		_mm256_storeu_si256((__m256i*)dst,
+			_mm256_or_si256(load_rgb_avx2(rgb), load_alpha_avx2(alpha)));
+
+	rgb_a_to_rgba_cpp(dst, rgb, alpha, count - i);
+}
+
+CARTOGRAPHER_TARGET("avx2")
+static void rgb_a_to_premultiplied_avx2(unsigned char *dst,
+	const unsigned char *rgb, const unsigned char *alpha, int count)
+{
+	int i = 0;
+
+	for (; i + 10 <= count; i += 8, rgb += 24, alpha += 8, dst += 32)
+		_mm256_storeu_si256((__m256i*)dst, premultiply_avx2(
+			_mm256_or_si256(load_rgb_avx2(rgb), load_alpha_avx2(alpha))));
+
+	rgb_a_to_premultiplied_cpp(dst, rgb, alpha, count - i);
+}
+
+#endif /* CARTOGRAPHER_AVX2 */
+
+
+/*
+	Выбор реализации
+*/
+
+typedef void (*rgb_proc_t)(unsigned char*, const unsigned char*, int);
+typedef void (*rgb_a_proc_t)(unsigned char*, const unsigned char*,
+	const unsigned char*, int);
+
+struct pixel_kernels
+{
+	const wchar_t *isa;
+	rgb_proc_t rgb_to_rgba;
+	rgb_a_proc_t rgb_a_to_rgba;
+	rgb_a_proc_t rgb_a_to_premultiplied;
+};
+
+static const pixel_kernels cpp_kernels = { L"c++",
+	rgb_to_rgba_cpp, rgb_a_to_rgba_cpp, rgb_a_to_premultiplied_cpp };
+
+#ifdef CARTOGRAPHER_SSSE3
+static const pixel_kernels ssse3_kernels = { L"ssse3",
+	rgb_to_rgba_ssse3, rgb_a_to_rgba_ssse3, rgb_a_to_premultiplied_ssse3 };
+#endif
+
+#ifdef CARTOGRAPHER_AVX2
+static const pixel_kernels avx2_kernels = { L"avx2",
+	rgb_to_rgba_avx2, rgb_a_to_rgba_avx2, rgb_a_to_premultiplied_avx2 };
+#endif
+
+#ifdef CARTOGRAPHER_SSSE3
+static void cpuid(unsigned int leaf, unsigned int regs[4])
+{
+#ifdef _MSC_VER
+	int r[4];
+	__cpuidex(r, (int)leaf, 0);
+	for (int i = 0; i < 4; ++i)
+		regs[i] = (unsigned int)r[i];
+#else
+	__cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+#endif
+
+static const pixel_kernels& select_kernels()
+{
+#ifdef CARTOGRAPHER_SSSE3
+	unsigned int regs[4];
+
+	cpuid(0, regs);
+	const unsigned int max_leaf = regs[0];
+
+	cpuid(1, regs);
+	const bool ssse3 = (regs[2] & (1 << 9)) != 0;
+
+#ifdef CARTOGRAPHER_AVX2
+	/* AVX2 нужна ещё и поддержка ОС (сохранение YMM-регистров) */
+	const bool osxsave = (regs[2] & (1 << 27)) != 0;
+	const bool avx = (regs[2] & (1 << 28)) != 0;
+
+	if (max_leaf >= 7 && osxsave && avx)
+	{
+		unsigned long long xcr0;
+#ifdef _MSC_VER
+		xcr0 = _xgetbv(0);
+#else
+		unsigned int eax, edx;
+		__asm__ ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		xcr0 = ((unsigned long long)edx << 32) | eax;
+#endif
+		cpuid(7, regs);
+
+		if ((xcr0 & 6) == 6 && (regs[1] & (1 << 5)) != 0)
+			return avx2_kernels;
+	}
+#else
+	(void)max_leaf;
+#endif
+
+	if (ssse3)
+		return ssse3_kernels;
+#endif
+
+	return cpp_kernels;
+}
+
+/* Выбор - при первом обращении, а не при инициализации статических
+	объектов: преобразование может понадобиться чьему-то статическому
+	конструктору раньше. Одновременный первый вызов из разных потоков
+	безопасен - результат один и тот же */
+static const pixel_kernels& kernels()
+{
+	static const pixel_kernels &k = select_kernels();
+	return k;
+}
+
+
+void convert_rgb_to_rgba(unsigned char *dst,
+	const unsigned char *rgb, int count)
+{
+	kernels().rgb_to_rgba(dst, rgb, count);
+}
+
+void convert_rgb_a_to_rgba(unsigned char *dst,
+	const unsigned char *rgb, const unsigned char *alpha, int count)
+{
+	kernels().rgb_a_to_rgba(dst, rgb, alpha, count);
+}
+
+void convert_rgb_a_to_premultiplied(unsigned char *dst,
+	const unsigned char *rgb, const unsigned char *alpha, int count)
+{
+	kernels().rgb_a_to_premultiplied(dst, rgb, alpha, count);
+}
+
+void convert_rgb_to_rgb565(unsigned short *dst,
+	const unsigned char *rgb, int count)
+{
+	/* Идём с начала строки: запись всегда отстаёт от чтения */
+	for (int i = 0; i < count; ++i, rgb += 3)
+	{
+		unsigned int r = rgb[0];
+		unsigned int g = rgb[1];
+		unsigned int b = rgb[2];
+		dst[i] = (unsigned short)( ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3) );
+	}
+}
+
+const wchar_t* pixel_convert_isa()
+{
+	return kernels().isa;
+}
+
+
+/*
+	Замер скорости
+*/
+
+/* Цикл, которым преобразование делалось раньше (для сравнения) */
+static void rgb_a_to_rgba_bytewise(unsigned char *dst,
+	const unsigned char *rgb, const unsigned char *alpha, int count)
+{
+	for (int j = 0; j < count; ++j)
+	{
+		*dst++ = *rgb++;
+		*dst++ = *rgb++;
+		*dst++ = *rgb++;
+		*dst++ = alpha ? *alpha++ : 255;
+	}
+}
+
+static long long bench_rgb(rgb_proc_t proc, unsigned char *dst,
+	const unsigned char *rgb, int width, int height, int iterations)
+{
+	posix_time::ptime start = my::time::utc_now();
+
+	for (int n = 0; n < iterations; ++n)
+		for (int i = 0; i < height; ++i)
+			proc(dst + i * width * 4, rgb + i * width * 3, width);
+
+	return (my::time::utc_now() - start).total_microseconds();
+}
+
+static long long bench_rgb_a(rgb_a_proc_t proc, unsigned char *dst,
+	const unsigned char *rgb, const unsigned char *alpha,
+	int width, int height, int iterations)
+{
+	posix_time::ptime start = my::time::utc_now();
+
+	for (int n = 0; n < iterations; ++n)
+		for (int i = 0; i < height; ++i)
+			proc(dst + i * width * 4, rgb + i * width * 3,
+				alpha ? alpha + i * width : 0, width);
+
+	return (my::time::utc_now() - start).total_microseconds();
+}
+
+std::wstring pixel_convert_benchmark(int width, int height, int iterations)
+{
+	const std::size_t count = (std::size_t)width * height;
+
+	std::vector<unsigned char> rgb(count * 3);
+	std::vector<unsigned char> alpha(count);
+	std::vector<unsigned char> dst(count * 4);
+	std::vector<unsigned char> ref(count * 4);
+
+	for (std::size_t i = 0; i < rgb.size(); ++i)
+		rgb[i] = (unsigned char)(i * 7);
+	for (std::size_t i = 0; i < alpha.size(); ++i)
+		alpha[i] = (unsigned char)(i * 13);
+
+	std::wostringstream out;
+	out << L"pixel_convert (" << width << L'x' << height
+		<< L" x " << iterations << L", мкс):";
+
+	/* Только то, что поддерживает процессор */
+	std::vector<const pixel_kernels*> list(1, &cpp_kernels);
+#ifdef CARTOGRAPHER_SSSE3
+	if (&kernels() != &cpp_kernels)
+		list.push_back(&ssse3_kernels);
+#endif
+#ifdef CARTOGRAPHER_AVX2
+	if (&kernels() == &avx2_kernels)
+		list.push_back(&avx2_kernels);
+#endif
+
+	/* Побайтовый цикл */
+	out << L"\n\tbytewise: rgb=" << bench_rgb_a(rgb_a_to_rgba_bytewise,
+			&ref[0], &rgb[0], 0, width, height, iterations)
+		<< L" rgb+a=" << bench_rgb_a(rgb_a_to_rgba_bytewise,
+			&ref[0], &rgb[0], &alpha[0], width, height, iterations);
+
+	for (std::size_t k = 0; k < list.size(); ++k)
+	{
+		const pixel_kernels &kn = *list[k];
+
+		/* Заодно сверяем с эталоном */
+		rgb_a_to_rgba_bytewise(&ref[0], &rgb[0], 0, (int)count);
+		out << L"\n\t" << kn.isa
+			<< L": rgb=" << bench_rgb(kn.rgb_to_rgba,
+				&dst[0], &rgb[0], width, height, iterations);
+		if (std::memcmp(&dst[0], &ref[0], dst.size()) != 0)
+			out << L" (ОШИБКА)";
+
+		rgb_a_to_rgba_bytewise(&ref[0], &rgb[0], &alpha[0], (int)count);
+		out << L" rgb+a=" << bench_rgb_a(kn.rgb_a_to_rgba,
+			&dst[0], &rgb[0], &alpha[0], width, height, iterations);
+		if (std::memcmp(&dst[0], &ref[0], dst.size()) != 0)
+			out << L" (ОШИБКА)";
+
+		rgb_a_to_premultiplied_cpp(&ref[0], &rgb[0], &alpha[0], (int)count);
+		out << L" premultiplied=" << bench_rgb_a(kn.rgb_a_to_premultiplied,
+			&dst[0], &rgb[0], &alpha[0], width, height, iterations);
+		if (std::memcmp(&dst[0], &ref[0], dst.size()) != 0)
+			out << L" (ОШИБКА)";
+	}
+
+	return out.str();
+}
+
+} /* namespace cartographer */
@@ -0,0 +1,44 @@
+﻿#ifndef CARTOGRAPHER_PIXEL_CONVERT_H
+#define CARTOGRAPHER_PIXEL_CONVERT_H
+
+#include <string>
+
+namespace cartographer
+{
+
+/*
+	Преобразование строк пикселей в RGBA. Реализация (AVX2, SSSE3
+	или обычный C++) выбирается при запуске по возможностям процессора.
+	Области dst и src не должны перекрываться
+*/
+
+/* RGB -> RGBA (альфа = 255) */
+void convert_rgb_to_rgba(unsigned char *dst,
+	const unsigned char *rgb, int count);
+
+/* RGB + отдельный канал альфы (как в wxImage) -> RGBA */
+void convert_rgb_a_to_rgba(unsigned char *dst,
+	const unsigned char *rgb, const unsigned char *alpha, int count);
+
+/* То же, но цвет умножается на альфу (premultiplied alpha) */
+void convert_rgb_a_to_premultiplied(unsigned char *dst,
+	const unsigned char *rgb, const unsigned char *alpha, int count);
+
+/* RGB -> RGB565 (для текстур GL_UNSIGNED_SHORT_5_6_5). Единственное
+	исключение из правила: можно на месте (dst == rgb), т.к. результат
+	короче исходных данных */
+void convert_rgb_to_rgb565(unsigned short *dst,
+	const unsigned char *rgb, int count);
+
+/* Выбранный набор инструкций: L"avx2", L"ssse3" или L"c++" */
+const wchar_t* pixel_convert_isa();
+
+/* Замер скорости преобразований в сравнении с побайтовым циклом.
+	Результат - текст для лога. Только для замеров - сам Картограф
+	его не вызывает */
+std::wstring pixel_convert_benchmark(int width = 256, int height = 256,
+	int iterations = 50);
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_PIXEL_CONVERT_H */
@@ -1,6 +1,10 @@
 ﻿#ifndef RAW_IMAGE_H
 #define RAW_IMAGE_H
 
+#include "pixel_buffers.h"
+
+#include <cstddef> /* std::size_t */
+
 class raw_image
 {
 private:
@@ -10,6 +14,9 @@ private:
 	int tag_;
 	unsigned char *data_;
 
+	static inline std::size_t bytes_for(int width, int height, int bpp)
+		{ return (std::size_t)width * height * (bpp / 8); }
+
 	void init()
 	{
 		width_ = 0;
@@ -44,12 +51,13 @@ public:
 		height_ = height;
 		bpp_ = bpp;
 		tag_ = tag;
-		data_ = new unsigned char[ width * height * (bpp / 8) ];
+		data_ = cartographer::alloc_pixel_buffer( bytes_for(width, height, bpp) );
 	}
 
+	/* Буфер возвращается в пул, а не в кучу */
 	void clear(bool with_init = true)
 	{
-		delete[] data_;
+		cartographer::free_pixel_buffer( data_, bytes_for(width_, height_, bpp_) );
 
 		if (with_init)
 			init();
@@ -72,6 +80,10 @@ public:
 	inline int tag() const
 		{ return tag_; }
 
+	/* Объём занимаемой памяти (в байтах) */
+	inline std::size_t bytes() const
+		{ return data_ ? (std::size_t)width_ * height_ * (bpp_ / 8) : 0; }
+
 	inline unsigned char* data()
 		{ return data_; }
 
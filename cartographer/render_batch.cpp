@@ -0,0 +1,345 @@
+﻿#include "render_batch.h"
+#include "gl_proc.h"
+
+#include <cstdio> /* std::sprintf */
+
+/* Константы OpenGL 1.5 (в gl.h Windows их нет) */
+#define CARTOGRAPHER_GL_ARRAY_BUFFER 0x8892
+#define CARTOGRAPHER_GL_STREAM_DRAW 0x88E0
+
+namespace cartographer
+{
+
+render_batch::render_batch()
+	: commands_count_(0)
+	, layer_start_(0)
+	, in_layer_(false)
+	, draw_calls_(0)
+	, primitives_(0)
+	, primitives_count_(0)
+	, state_changes_(0)
+	, shaders_(false)
+	, buffer_(0)
+	, gen_buffers_(0)
+	, delete_buffers_(0)
+	, bind_buffer_(0)
+	, buffer_data_(0)
+{
+}
+
+bool render_batch::init()
+{
+	deinit();
+
+	if (!gl_supports(1, 5, "GL_ARB_vertex_buffer_object"))
+		return false;
+
+	/* В ядре функции без суффикса, в расширении - с суффиксом ARB */
+	const char *sfx = gl_supports(1, 5, 0) ? "" : "ARB";
+	char name[64];
+
+	#define LOAD_GL_PROC(var, type, proc) \
+		std::sprintf(name, "%s%s", proc, sfx); \
+		var = (type)get_gl_proc(name);
+
+	LOAD_GL_PROC(gen_buffers_, gen_buffers_t, "glGenBuffers")
+	LOAD_GL_PROC(delete_buffers_, delete_buffers_t, "glDeleteBuffers")
+	LOAD_GL_PROC(bind_buffer_, bind_buffer_t, "glBindBuffer")
+	LOAD_GL_PROC(buffer_data_, buffer_data_t, "glBufferData")
+
+	#undef LOAD_GL_PROC
+
+	if (!gen_buffers_ || !delete_buffers_ || !bind_buffer_ || !buffer_data_)
+		return false;
+
+	gen_buffers_(1, &buffer_);
+
+	return buffer_ != 0;
+}
+
+void render_batch::deinit()
+{
+	program_.deinit();
+	shaders_ = false;
+
+	if (buffer_)
+	{
+		delete_buffers_(1, &buffer_);
+		buffer_ = 0;
+	}
+}
+
+bool render_batch::use_shaders(bool on)
+{
+	if (on && !program_.ok())
+		program_.init();
+
+	shaders_ = on && program_.ok();
+
+	return shaders_;
+}
+
+void render_batch::begin(const size &screen_size)
+{
+	screen_size_ = screen_size;
+	center_ = point(screen_size.width / 2.0, screen_size.height / 2.0);
+
+	/* Память групп прошлого кадра не освобождаем */
+	for (std::size_t i = 0; i < commands_count_; ++i)
+		commands_[i].vertices.clear();
+
+	commands_count_ = 0;
+	layer_start_ = 0;
+	in_layer_ = false;
+	primitives_count_ = 0;
+}
+
+void render_batch::begin_layer()
+{
+	layer_start_ = commands_count_;
+	in_layer_ = true;
+}
+
+void render_batch::end_layer()
+{
+	in_layer_ = false;
+}
+
+std::vector<render_batch::vertex>& render_batch::vertices_for(
+	GLenum mode, GLuint texture_id, float line_width)
+{
+	++primitives_count_;
+
+	/* В слое - любая группа слоя, иначе - только последняя */
+	std::size_t first = in_layer_ ? layer_start_
+		: (commands_count_ ? commands_count_ - 1 : 0);
+
+	for (std::size_t i = commands_count_; i > first; --i)
+	{
+		command &cmd = commands_[i - 1];
+		if (cmd.mode == mode && cmd.texture_id == texture_id
+			&& cmd.line_width == line_width)
+			return cmd.vertices;
+	}
+
+	if (commands_count_ == commands_.size())
+		commands_.push_back(command());
+
+	command &cmd = commands_[commands_count_++];
+	cmd.mode = mode;
+	cmd.texture_id = texture_id;
+	cmd.line_width = line_width;
+
+	return cmd.vertices;
+}
+
+void render_batch::to_rgba(const color &c, GLubyte *rgba)
+{
+	const double *ptr = &c.r;
+
+	for (int i = 0; i < 4; ++i)
+	{
+		double k = ptr[i];
+		rgba[i] = (GLubyte)(k <= 0.0 ? 0 : k >= 1.0 ? 255 : k * 255.0 + 0.5);
+	}
+}
+
+void render_batch::add_quad(GLuint texture_id,
+	const point &lt, const point &rt, const point &rb, const point &lb,
+	double u1, double v1, double u2, double v2, const color &c)
+{
+	GLubyte rgba[4];
+	to_rgba(c, rgba);
+
+	std::vector<vertex> &v = vertices_for(GL_TRIANGLES, texture_id, 0.0f);
+
+	put(v, lt, u1, v1, rgba);
+	put(v, rt, u2, v1, rgba);
+	put(v, rb, u2, v2, rgba);
+
+	put(v, lt, u1, v1, rgba);
+	put(v, rb, u2, v2, rgba);
+	put(v, lb, u1, v2, rgba);
+}
+
+void render_batch::add_polygon(const point *pts, std::size_t count,
+	const color &c)
+{
+	if (count < 3)
+		return;
+
+	GLubyte rgba[4];
+	to_rgba(c, rgba);
+
+	std::vector<vertex> &v = vertices_for(GL_TRIANGLES, 0, 0.0f);
+
+	/* Веер из первой вершины */
+	for (std::size_t i = 1; i + 1 < count; ++i)
+	{
+		put(v, pts[0], 0.0, 0.0, rgba);
+		put(v, pts[i], 0.0, 0.0, rgba);
+		put(v, pts[i + 1], 0.0, 0.0, rgba);
+	}
+}
+
+void render_batch::add_lines(const point *pts, std::size_t count,
+	bool loop, double width, const color &c)
+{
+	if (count < 2)
+		return;
+
+	GLubyte rgba[4];
+	to_rgba(c, rgba);
+
+	std::vector<vertex> &v = vertices_for(GL_LINES, 0, (float)width);
+
+	for (std::size_t i = 0; i + 1 < count; ++i)
+	{
+		put(v, pts[i], 0.0, 0.0, rgba);
+		put(v, pts[i + 1], 0.0, 0.0, rgba);
+	}
+
+	if (loop && count > 2)
+	{
+		put(v, pts[count - 1], 0.0, 0.0, rgba);
+		put(v, pts[0], 0.0, 0.0, rgba);
+	}
+}
+
+void render_batch::flush()
+{
+	draw_calls_ = 0;
+	state_changes_ = 0;
+	primitives_ = primitives_count_;
+
+	/* Все вершины кадра - одним куском */
+	stream_.clear();
+	for (std::size_t i = 0; i < commands_count_; ++i)
+		stream_.insert(stream_.end(),
+			commands_[i].vertices.begin(), commands_[i].vertices.end());
+
+	if (stream_.empty())
+		return;
+
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	const char *base = (const char*)&stream_[0];
+
+	if (buffer_)
+	{
+		/* glBufferData каждый кадр даёт буферу новую память (orphaning) -
+			не ждём, пока драйвер дорисует прошлый кадр из старой */
+		bind_buffer_(CARTOGRAPHER_GL_ARRAY_BUFFER, buffer_);
+		buffer_data_(CARTOGRAPHER_GL_ARRAY_BUFFER,
+			stream_.size() * sizeof(vertex), base, CARTOGRAPHER_GL_STREAM_DRAW);
+		base = 0; /* Дальше - смещения в буфере */
+	}
+
+	const GLsizei stride = sizeof(vertex);
+	const char *position = base;
+	const char *texcoord = base + 2 * sizeof(GLfloat);
+	const char *rgba = base + 4 * sizeof(GLfloat);
+
+	/* Начало координат - в центре экрана, y - вниз */
+	if (shaders_)
+	{
+		program_.begin(stride, position, texcoord, rgba);
+		program_.set_screen(
+			(float)(2.0 / screen_size_.width),
+			(float)(-2.0 / screen_size_.height),
+			(float)(2.0 * center_.x / screen_size_.width - 1.0),
+			(float)(1.0 - 2.0 * center_.y / screen_size_.height) );
+	}
+	else
+	{
+		glMatrixMode(GL_PROJECTION);
+		glLoadIdentity();
+		glOrtho(-center_.x, screen_size_.width - center_.x,
+			screen_size_.height - center_.y, -center_.y, -1.0, 1.0);
+
+		glMatrixMode(GL_MODELVIEW);
+		glLoadIdentity();
+
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+		glEnableClientState(GL_COLOR_ARRAY);
+
+		glVertexPointer(2, GL_FLOAT, stride, position);
+		glTexCoordPointer(2, GL_FLOAT, stride, texcoord);
+		glColorPointer(4, GL_UNSIGNED_BYTE, stride, rgba);
+
+		glEnable(GL_TEXTURE_2D);
+	}
+
+	GLint first = 0;
+	bool textured = true;
+	GLuint bound_texture = 0;
+	float line_width = 0.0f;
+
+	if (shaders_)
+		program_.set_textured(true);
+
+	for (std::size_t i = 0; i < commands_count_; ++i)
+	{
+		const command &cmd = commands_[i];
+		const GLsizei count = (GLsizei)cmd.vertices.size();
+
+		if (count == 0)
+			continue;
+
+		/* Наложение текстуры: в шейдере - параметр,
+			без шейдера - glEnable/glDisable */
+		if ((cmd.texture_id != 0) != textured)
+		{
+			textured = !textured;
+			++state_changes_;
+
+			if (shaders_)
+				program_.set_textured(textured);
+			else if (textured)
+				glEnable(GL_TEXTURE_2D);
+			else
+				glDisable(GL_TEXTURE_2D);
+		}
+
+		if (cmd.texture_id && cmd.texture_id != bound_texture)
+		{
+			glBindTexture(GL_TEXTURE_2D, cmd.texture_id);
+			bound_texture = cmd.texture_id;
+			++state_changes_;
+		}
+
+		if (cmd.mode == GL_LINES && cmd.line_width != line_width)
+		{
+			glLineWidth(cmd.line_width);
+			line_width = cmd.line_width;
+			++state_changes_;
+		}
+
+		glDrawArrays(cmd.mode, first, count);
+
+		first += count;
+		++draw_calls_;
+	}
+
+	if (shaders_)
+		program_.end();
+	else
+	{
+		if (!textured)
+			glEnable(GL_TEXTURE_2D);
+
+		glDisableClientState(GL_COLOR_ARRAY);
+		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+		glDisableClientState(GL_VERTEX_ARRAY);
+
+		/* Цвет массивов остаётся текущим - возвращаем белый */
+		glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+	}
+
+	if (buffer_)
+		bind_buffer_(CARTOGRAPHER_GL_ARRAY_BUFFER, 0);
+}
+
+} /* namespace cartographer */
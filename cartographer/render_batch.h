@@ -0,0 +1,172 @@
+﻿#ifndef CARTOGRAPHER_RENDER_BATCH_H
+#define CARTOGRAPHER_RENDER_BATCH_H
+
+#include "config.h" /* Обязательно первым */
+#include "defs.h" /* point, size, color */
+#include "shader_program.h"
+
+#include <cstddef> /* std::size_t, std::ptrdiff_t */
+#include <vector>
+
+#include <GL/gl.h> /* OpenGL */
+
+namespace cartographer
+{
+
+/*
+	Пакетный вывод вместо glBegin/glEnd. Всё, что рисуется за кадр
+	(тайлы, изображения, текст, линии), копится в массиве вершин
+	(float, относительно центра экрана - точность не теряется
+	на любом масштабе) и выводится одним flush() в конце кадра:
+	одна загрузка в VBO и по glDrawArrays на группу с одинаковым
+	состоянием (примитив, текстура, толщина линии). Цвет - в вершинах,
+	поэтому на группы он не влияет.
+
+	Порядок вывода сохраняется - соседние примитивы с одним состоянием
+	объединяются. Только внутри слоя (begin_layer/end_layer), где
+	примитивы не перекрываются (тайлы), они группируются по текстурам
+	независимо от порядка.
+
+	Координаты - экранные (пиксели, y - вниз). Без VBO (OpenGL < 1.5
+	без GL_ARB_vertex_buffer_object) - массивы вершин в ОЗУ.
+	Вывод - фиксированным конвейером или, если включить
+	use_shaders(), программой GLSL (см. shader_program).
+	Только в потоке OpenGL
+*/
+class render_batch
+{
+public:
+	render_batch();
+
+	/* Буфер VBO. false - VBO нет */
+	bool init();
+	void deinit();
+
+	/* Вывод шейдерами. false - они недоступны (shaders_error()),
+		вывод - фиксированным конвейером */
+	bool use_shaders(bool on);
+
+	inline bool shaders() const
+		{ return shaders_; }
+
+	inline const std::string& shaders_error() const
+		{ return program_.error(); }
+
+	/* Начало кадра */
+	void begin(const size &screen_size);
+
+	/* Слой неперекрывающихся примитивов */
+	void begin_layer();
+	void end_layer();
+
+	/* Четырёхугольник с текстурой (u1,v1)-(u2,v2).
+		texture_id == 0 - без текстуры */
+	void add_quad(GLuint texture_id,
+		const point &lt, const point &rt, const point &rb, const point &lb,
+		double u1, double v1, double u2, double v2, const color &c);
+
+	inline void add_rect(GLuint texture_id,
+		double x1, double y1, double x2, double y2,
+		double u1, double v1, double u2, double v2, const color &c)
+	{
+		add_quad(texture_id, point(x1, y1), point(x2, y1),
+			point(x2, y2), point(x1, y2), u1, v1, u2, v2, c);
+	}
+
+	/* Выпуклый многоугольник */
+	void add_polygon(const point *pts, std::size_t count, const color &c);
+
+	/* Ломаная (loop - замкнутая) */
+	void add_lines(const point *pts, std::size_t count, bool loop,
+		double width, const color &c);
+
+	/* Вывод накопленного */
+	void flush();
+
+	/* Статистика последнего flush(): вызовов glDrawArrays и примитивов,
+		которые раньше выводились каждый своим glBegin/glEnd */
+	inline int draw_calls() const
+		{ return draw_calls_; }
+
+	inline int primitives() const
+		{ return primitives_; }
+
+	/* ... и смен состояния OpenGL между вызовами (текстура,
+		её наложение, толщина линии) */
+	inline int state_changes() const
+		{ return state_changes_; }
+
+	inline bool vbo() const
+		{ return buffer_ != 0; }
+
+private:
+	typedef std::ptrdiff_t gl_sizeiptr;
+	typedef void (APIENTRY *gen_buffers_t)(GLsizei n, GLuint *buffers);
+	typedef void (APIENTRY *delete_buffers_t)(GLsizei n, const GLuint *buffers);
+	typedef void (APIENTRY *bind_buffer_t)(GLenum target, GLuint buffer);
+	typedef void (APIENTRY *buffer_data_t)(GLenum target, gl_sizeiptr size,
+		const void *data, GLenum usage);
+
+	struct vertex
+	{
+		GLfloat x;
+		GLfloat y;
+		GLfloat u;
+		GLfloat v;
+		GLubyte rgba[4];
+	};
+
+	/* Группа примитивов с одним состоянием */
+	struct command
+	{
+		GLenum mode; /* GL_TRIANGLES, GL_LINES */
+		GLuint texture_id;
+		float line_width;
+		std::vector<vertex> vertices;
+	};
+
+	size screen_size_;
+	point center_;
+	std::vector<command> commands_; /* Вместе с памятью прошлых кадров */
+	std::size_t commands_count_;
+	std::size_t layer_start_;
+	bool in_layer_;
+	std::vector<vertex> stream_; /* Все вершины кадра подряд */
+	int draw_calls_;
+	int primitives_;
+	int primitives_count_;
+	int state_changes_;
+
+	shader_program program_;
+	bool shaders_;
+
+	GLuint buffer_;
+	gen_buffers_t gen_buffers_;
+	delete_buffers_t delete_buffers_;
+	bind_buffer_t bind_buffer_;
+	buffer_data_t buffer_data_;
+
+	std::vector<vertex>& vertices_for(GLenum mode,
+		GLuint texture_id, float line_width);
+
+	inline void put(std::vector<vertex> &v, const point &pt,
+		double tu, double tv, const GLubyte *rgba)
+	{
+		vertex vx;
+		vx.x = (GLfloat)(pt.x - center_.x);
+		vx.y = (GLfloat)(pt.y - center_.y);
+		vx.u = (GLfloat)tu;
+		vx.v = (GLfloat)tv;
+		vx.rgba[0] = rgba[0];
+		vx.rgba[1] = rgba[1];
+		vx.rgba[2] = rgba[2];
+		vx.rgba[3] = rgba[3];
+		v.push_back(vx);
+	}
+
+	static void to_rgba(const color &c, GLubyte *rgba);
+};
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_RENDER_BATCH_H */
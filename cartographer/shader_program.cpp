@@ -0,0 +1,243 @@
+﻿#include "shader_program.h"
+#include "gl_proc.h"
+
+#include <vector>
+
+/* Константы OpenGL 2.0 (в gl.h Windows их нет) */
+#define CARTOGRAPHER_GL_FRAGMENT_SHADER 0x8B30
+#define CARTOGRAPHER_GL_VERTEX_SHADER 0x8B31
+#define CARTOGRAPHER_GL_COMPILE_STATUS 0x8B81
+#define CARTOGRAPHER_GL_LINK_STATUS 0x8B82
+#define CARTOGRAPHER_GL_INFO_LOG_LENGTH 0x8B84
+
+namespace cartographer
+{
+
+static const char *vertex_shader_source =
+	"#version 120\n"
+	"uniform vec4 screen;\n"
+	"attribute vec2 position;\n"
+	"attribute vec2 texcoord;\n"
+	"attribute vec4 color;\n"
+	"varying vec2 v_texcoord;\n"
+	"varying vec4 v_color;\n"
+	"void main()\n"
+	"{\n"
+	"	gl_Position = vec4(position * screen.xy + screen.zw, 0.0, 1.0);\n"
+	"	v_texcoord = texcoord;\n"
+	"	v_color = color;\n"
+	"}\n";
+
+static const char *fragment_shader_source =
+	"#version 120\n"
+	"uniform sampler2D tex;\n"
+	"uniform float textured;\n"
+	"varying vec2 v_texcoord;\n"
+	"varying vec4 v_color;\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 texel = texture2D(tex, v_texcoord);\n"
+	"	gl_FragColor = v_color * mix(vec4(1.0), texel, textured);\n"
+	"}\n";
+
+shader_program::shader_program()
+	: program_(0)
+	, screen_location_(-1)
+	, textured_location_(-1)
+	, create_shader_(0)
+	, shader_source_(0)
+	, compile_shader_(0)
+	, get_shader_iv_(0)
+	, get_shader_info_log_(0)
+	, delete_shader_(0)
+	, create_program_(0)
+	, attach_shader_(0)
+	, bind_attrib_location_(0)
+	, link_program_(0)
+	, get_program_iv_(0)
+	, get_program_info_log_(0)
+	, delete_program_(0)
+	, use_program_(0)
+	, get_uniform_location_(0)
+	, uniform_1i_(0)
+	, uniform_1f_(0)
+	, uniform_4f_(0)
+	, vertex_attrib_pointer_(0)
+	, enable_vertex_attrib_array_(0)
+	, disable_vertex_attrib_array_(0)
+{
+}
+
+bool shader_program::load_functions()
+{
+	/* Только ядро 2.0: у расширений ARB_shader_objects
+		другие функции (GLhandleARB) */
+	if (!gl_supports(2, 0, 0))
+		return false;
+
+	#define LOAD_GL_PROC(var, type, proc) \
+		var = (type)get_gl_proc(proc); \
+		if (!var) return false;
+
+	LOAD_GL_PROC(create_shader_, create_shader_t, "glCreateShader")
+	LOAD_GL_PROC(shader_source_, shader_source_t, "glShaderSource")
+	LOAD_GL_PROC(compile_shader_, compile_shader_t, "glCompileShader")
+	LOAD_GL_PROC(get_shader_iv_, get_shader_iv_t, "glGetShaderiv")
+	LOAD_GL_PROC(get_shader_info_log_, get_shader_info_log_t, "glGetShaderInfoLog")
+	LOAD_GL_PROC(delete_shader_, delete_shader_t, "glDeleteShader")
+	LOAD_GL_PROC(create_program_, create_program_t, "glCreateProgram")
+	LOAD_GL_PROC(attach_shader_, attach_shader_t, "glAttachShader")
+	LOAD_GL_PROC(bind_attrib_location_, bind_attrib_location_t, "glBindAttribLocation")
+	LOAD_GL_PROC(link_program_, link_program_t, "glLinkProgram")
+	LOAD_GL_PROC(get_program_iv_, get_program_iv_t, "glGetProgramiv")
+	LOAD_GL_PROC(get_program_info_log_, get_program_info_log_t, "glGetProgramInfoLog")
+	LOAD_GL_PROC(delete_program_, delete_program_t, "glDeleteProgram")
+	LOAD_GL_PROC(use_program_, use_program_t, "glUseProgram")
+	LOAD_GL_PROC(get_uniform_location_, get_uniform_location_t, "glGetUniformLocation")
+	LOAD_GL_PROC(uniform_1i_, uniform_1i_t, "glUniform1i")
+	LOAD_GL_PROC(uniform_1f_, uniform_1f_t, "glUniform1f")
+	LOAD_GL_PROC(uniform_4f_, uniform_4f_t, "glUniform4f")
+	LOAD_GL_PROC(vertex_attrib_pointer_, vertex_attrib_pointer_t, "glVertexAttribPointer")
+	LOAD_GL_PROC(enable_vertex_attrib_array_, enable_vertex_attrib_array_t,
+		"glEnableVertexAttribArray")
+	LOAD_GL_PROC(disable_vertex_attrib_array_, disable_vertex_attrib_array_t,
+		"glDisableVertexAttribArray")
+
+	#undef LOAD_GL_PROC
+
+	return true;
+}
+
+GLuint shader_program::compile(GLenum type, const char *source)
+{
+	GLuint shader = create_shader_(type);
+	if (shader == 0)
+		return 0;
+
+	shader_source_(shader, 1, &source, 0);
+	compile_shader_(shader);
+
+	GLint status = 0;
+	get_shader_iv_(shader, CARTOGRAPHER_GL_COMPILE_STATUS, &status);
+
+	if (!status)
+	{
+		GLint length = 0;
+		get_shader_iv_(shader, CARTOGRAPHER_GL_INFO_LOG_LENGTH, &length);
+
+		std::vector<char> log(length + 1);
+		get_shader_info_log_(shader, length, 0, &log[0]);
+		error_ = &log[0];
+
+		delete_shader_(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+bool shader_program::init()
+{
+	deinit();
+	error_.clear();
+
+	if (!load_functions())
+	{
+		error_ = "OpenGL 2.0 is not supported";
+		return false;
+	}
+
+	GLuint vs = compile(CARTOGRAPHER_GL_VERTEX_SHADER, vertex_shader_source);
+	if (vs == 0)
+		return false;
+
+	GLuint fs = compile(CARTOGRAPHER_GL_FRAGMENT_SHADER, fragment_shader_source);
+	if (fs == 0)
+	{
+		delete_shader_(vs);
+		return false;
+	}
+
+	program_ = create_program_();
+	attach_shader_(program_, vs);
+	attach_shader_(program_, fs);
+
+	bind_attrib_location_(program_, attr_position, "position");
+	bind_attrib_location_(program_, attr_texcoord, "texcoord");
+	bind_attrib_location_(program_, attr_color, "color");
+
+	link_program_(program_);
+
+	/* Шейдеры остаются в программе до её удаления */
+	delete_shader_(vs);
+	delete_shader_(fs);
+
+	GLint status = 0;
+	get_program_iv_(program_, CARTOGRAPHER_GL_LINK_STATUS, &status);
+
+	if (!status)
+	{
+		GLint length = 0;
+		get_program_iv_(program_, CARTOGRAPHER_GL_INFO_LOG_LENGTH, &length);
+
+		std::vector<char> log(length + 1);
+		get_program_info_log_(program_, length, 0, &log[0]);
+		error_ = &log[0];
+
+		deinit();
+		return false;
+	}
+
+	screen_location_ = get_uniform_location_(program_, "screen");
+	textured_location_ = get_uniform_location_(program_, "textured");
+
+	use_program_(program_);
+	uniform_1i_(get_uniform_location_(program_, "tex"), 0);
+	use_program_(0);
+
+	return true;
+}
+
+void shader_program::deinit()
+{
+	if (program_)
+	{
+		delete_program_(program_);
+		program_ = 0;
+	}
+}
+
+void shader_program::begin(GLsizei stride, const char *position,
+	const char *texcoord, const char *color)
+{
+	use_program_(program_);
+
+	enable_vertex_attrib_array_(attr_position);
+	enable_vertex_attrib_array_(attr_texcoord);
+	enable_vertex_attrib_array_(attr_color);
+
+	vertex_attrib_pointer_(attr_position, 2, GL_FLOAT, GL_FALSE, stride, position);
+	vertex_attrib_pointer_(attr_texcoord, 2, GL_FLOAT, GL_FALSE, stride, texcoord);
+	vertex_attrib_pointer_(attr_color, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, color);
+}
+
+void shader_program::end()
+{
+	disable_vertex_attrib_array_(attr_color);
+	disable_vertex_attrib_array_(attr_texcoord);
+	disable_vertex_attrib_array_(attr_position);
+
+	use_program_(0);
+}
+
+void shader_program::set_screen(float kx, float ky, float dx, float dy)
+{
+	uniform_4f_(screen_location_, kx, ky, dx, dy);
+}
+
+void shader_program::set_textured(bool on)
+{
+	uniform_1f_(textured_location_, on ? 1.0f : 0.0f);
+}
+
+} /* namespace cartographer */
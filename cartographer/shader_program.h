@@ -0,0 +1,116 @@
+﻿#ifndef CARTOGRAPHER_SHADER_PROGRAM_H
+#define CARTOGRAPHER_SHADER_PROGRAM_H
+
+#include "config.h" /* Обязательно первым */
+
+#include <cstddef> /* std::ptrdiff_t */
+#include <string>
+
+#include <GL/gl.h> /* OpenGL */
+
+namespace cartographer
+{
+
+/*
+	Программа GLSL 1.20 для render_batch: вершины - в экранных
+	координатах относительно центра, цвет - в вершинах, наложение
+	текстуры - явный параметр (uniform) вместо glEnable(GL_TEXTURE_2D).
+	Состояние фиксированного конвейера (текущий цвет, координаты
+	текстуры) на вывод не влияет.
+	Только в потоке OpenGL
+*/
+class shader_program
+{
+public:
+	/* Номера атрибутов вершин */
+	enum {attr_position = 0, attr_texcoord = 1, attr_color = 2};
+
+	shader_program();
+
+	/* Загрузка функций и сборка программы. false - OpenGL < 2.0
+		или ошибка сборки (текст ошибки - error()) */
+	bool init();
+	void deinit();
+
+	inline bool ok() const
+		{ return program_ != 0; }
+
+	inline const std::string& error() const
+		{ return error_; }
+
+	/* Включение программы и массивов вершин (stride и смещения
+		position, texcoord, color - как для glVertexAttribPointer) */
+	void begin(GLsizei stride, const char *position,
+		const char *texcoord, const char *color);
+	void end();
+
+	/* Преобразование экранных координат: x * kx + dx, y * ky + dy */
+	void set_screen(float kx, float ky, float dx, float dy);
+
+	/* Накладывать ли текстуру */
+	void set_textured(bool on);
+
+private:
+	typedef char gl_char;
+	typedef GLuint (APIENTRY *create_shader_t)(GLenum type);
+	typedef void (APIENTRY *shader_source_t)(GLuint shader, GLsizei count,
+		const gl_char **string, const GLint *length);
+	typedef void (APIENTRY *compile_shader_t)(GLuint shader);
+	typedef void (APIENTRY *get_shader_iv_t)(GLuint shader, GLenum pname, GLint *params);
+	typedef void (APIENTRY *get_shader_info_log_t)(GLuint shader, GLsizei max_length,
+		GLsizei *length, gl_char *info_log);
+	typedef void (APIENTRY *delete_shader_t)(GLuint shader);
+	typedef GLuint (APIENTRY *create_program_t)();
+	typedef void (APIENTRY *attach_shader_t)(GLuint program, GLuint shader);
+	typedef void (APIENTRY *bind_attrib_location_t)(GLuint program, GLuint index,
+		const gl_char *name);
+	typedef void (APIENTRY *link_program_t)(GLuint program);
+	typedef void (APIENTRY *get_program_iv_t)(GLuint program, GLenum pname, GLint *params);
+	typedef void (APIENTRY *get_program_info_log_t)(GLuint program, GLsizei max_length,
+		GLsizei *length, gl_char *info_log);
+	typedef void (APIENTRY *delete_program_t)(GLuint program);
+	typedef void (APIENTRY *use_program_t)(GLuint program);
+	typedef GLint (APIENTRY *get_uniform_location_t)(GLuint program, const gl_char *name);
+	typedef void (APIENTRY *uniform_1i_t)(GLint location, GLint v0);
+	typedef void (APIENTRY *uniform_1f_t)(GLint location, GLfloat v0);
+	typedef void (APIENTRY *uniform_4f_t)(GLint location,
+		GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3);
+	typedef void (APIENTRY *vertex_attrib_pointer_t)(GLuint index, GLint size,
+		GLenum type, GLboolean normalized, GLsizei stride, const void *pointer);
+	typedef void (APIENTRY *enable_vertex_attrib_array_t)(GLuint index);
+	typedef void (APIENTRY *disable_vertex_attrib_array_t)(GLuint index);
+
+	GLuint program_;
+	GLint screen_location_;
+	GLint textured_location_;
+	std::string error_;
+
+	create_shader_t create_shader_;
+	shader_source_t shader_source_;
+	compile_shader_t compile_shader_;
+	get_shader_iv_t get_shader_iv_;
+	get_shader_info_log_t get_shader_info_log_;
+	delete_shader_t delete_shader_;
+	create_program_t create_program_;
+	attach_shader_t attach_shader_;
+	bind_attrib_location_t bind_attrib_location_;
+	link_program_t link_program_;
+	get_program_iv_t get_program_iv_;
+	get_program_info_log_t get_program_info_log_;
+	delete_program_t delete_program_;
+	use_program_t use_program_;
+	get_uniform_location_t get_uniform_location_;
+	uniform_1i_t uniform_1i_;
+	uniform_1f_t uniform_1f_;
+	uniform_4f_t uniform_4f_;
+	vertex_attrib_pointer_t vertex_attrib_pointer_;
+	enable_vertex_attrib_array_t enable_vertex_attrib_array_;
+	disable_vertex_attrib_array_t disable_vertex_attrib_array_;
+
+	bool load_functions();
+	GLuint compile(GLenum type, const char *source);
+};
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_SHADER_PROGRAM_H */
@@ -0,0 +1,332 @@
+﻿#include "texture_pool.h"
+
+namespace cartographer
+{
+
+/* Сколько имён текстур создавать за раз */
+static const GLsizei names_batch = 32;
+
+texture_pool::texture_pool(int size, int page_size)
+	: size_(size)
+	, page_size_(page_size)
+	, slots_per_side_(0)
+	, slots_per_page_(0)
+	, delete_bytes_(0)
+	, freed_bytes_(0)
+	, created_(0)
+	, recycled_(0)
+{
+}
+
+int texture_pool::format_index(int bpp)
+{
+	switch (bpp)
+	{
+		case 32: return 0;
+		case 24: return 1;
+		case 16: return 2;
+	}
+	return -1;
+}
+
+std::size_t texture_pool::page_bytes(int bpp) const
+{
+	return (std::size_t)page_size_ * page_size_ * (bpp / 8);
+}
+
+std::size_t texture_pool::free_slots(int bpp) const
+{
+	std::size_t count = 0;
+	for (std::size_t i = 0; i < pages_.size(); ++i)
+		if (pages_[i].id != 0 && pages_[i].bpp == bpp)
+			count += pages_[i].free.size();
+	return count;
+}
+
+void texture_pool::gl_format(int bpp, GLint &internal_format,
+	GLenum &format, GLenum &type)
+{
+	/* Внутренний формат текстуры - по формату пикселей, чтобы
+		непрозрачные тайлы не занимали видеопамять под пустую альфу */
+	internal_format = GL_RGBA;
+	format = GL_RGBA;
+	type = GL_UNSIGNED_BYTE;
+
+	if (bpp == 24)
+	{
+		internal_format = GL_RGB8;
+		format = GL_RGB;
+	}
+	else if (bpp == 16)
+	{
+		internal_format = GL_RGB5;
+		format = GL_RGB;
+		type = 0x8363; /* GL_UNSIGNED_SHORT_5_6_5 */
+	}
+}
+
+void texture_pool::set_params()
+{
+	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	//glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+	//glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, 0x812F); /* GL_CLAMP_TO_EDGE */
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, 0x812F); /* GL_CLAMP_TO_EDGE */
+	//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
+GLuint texture_pool::new_name()
+{
+	if (names_.empty())
+	{
+		names_.resize(names_batch);
+		glGenTextures(names_batch, &names_[0]);
+	}
+
+	GLuint id = names_.back();
+	names_.pop_back();
+	++created_;
+
+	return id;
+}
+
+int texture_pool::add_page(int bpp)
+{
+	/* Размер страницы - при первом обращении, когда уже есть контекст */
+	if (slots_per_page_ == 0)
+	{
+		GLint max_size = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+
+		while (page_size_ > max_size && page_size_ > size_)
+			page_size_ /= 2;
+
+		slots_per_side_ = page_size_ / size_;
+		slots_per_page_ = slots_per_side_ * slots_per_side_;
+	}
+
+	GLint internal_format;
+	GLenum format, type;
+	gl_format(bpp, internal_format, format, type);
+
+	GLuint id = new_name();
+
+	/* Только выделяем память, без пикселей */
+	glBindTexture(GL_TEXTURE_2D, id);
+	set_params();
+	glTexImage2D(GL_TEXTURE_2D, 0, internal_format, page_size_, page_size_,
+		0, format, type, 0);
+
+	if (glGetError() != GL_NO_ERROR)
+	{
+		delete_.push_back(id);
+		return -1;
+	}
+
+	/* Номер удалённой страницы используем повторно */
+	std::size_t index = 0;
+	while (index < pages_.size() && pages_[index].id != 0)
+		++index;
+	if (index == pages_.size())
+		pages_.push_back(page());
+
+	page &p = pages_[index];
+	p.id = id;
+	p.bpp = bpp;
+	p.used = 0;
+	p.touched = 0;
+
+	/* Места раздаём с начала страницы. Освободившиеся встают
+		в конец списка, поэтому новые всегда остаются в его начале */
+	p.free.clear();
+	for (int i = slots_per_page_ - 1; i >= 0; --i)
+		p.free.push_back( (int)index * slots_per_page_ + i );
+
+	return (int)index;
+}
+
+void texture_pool::delete_page(std::size_t index)
+{
+	page &p = pages_[index];
+
+	delete_.push_back(p.id);
+	delete_bytes_ += page_bytes(p.bpp);
+
+	p.id = 0;
+	p.free.clear();
+}
+
+void texture_pool::reserve(std::size_t count, int bpp)
+{
+	if (format_index(bpp) < 0)
+		return;
+
+	while (free_slots(bpp) < count)
+		if (add_page(bpp) < 0)
+			break;
+}
+
+texture_pool::texture texture_pool::take(int width, int height, int bpp,
+	bool &recycled)
+{
+	int index = format_index(bpp);
+
+	recycled = false;
+
+	/* Не тайл - отдельная текстура */
+	if (width != size_ || height != size_ || index < 0)
+		return texture(new_name(), width, height, bpp);
+
+	/* Страница освобождается целиком, только когда пустеют все её
+		места. Поэтому заполняем самую заполненную страницу, а не ту,
+		где место освободилось последним - иначе тайлы расползаются
+		по всем страницам и вытеснение видеопамять не возвращает */
+	page *best = 0;
+
+	for (std::size_t i = 0; i < pages_.size(); ++i)
+	{
+		page &p = pages_[i];
+
+		if (p.id != 0 && p.bpp == bpp && !p.free.empty()
+			&& (!best || p.used > best->used))
+		{
+			best = &p;
+		}
+	}
+
+	if (!best)
+	{
+		int new_page = add_page(bpp);
+		if (new_page < 0)
+			return texture(new_name(), width, height, bpp);
+		best = &pages_[new_page];
+	}
+
+	page &p = *best;
+	int slot = p.free.back();
+	p.free.pop_back();
+	++p.used;
+
+	/* Новые места раздаются по порядку, после уже побывавших в деле */
+	if (slot % slots_per_page_ < p.touched)
+		++recycled_;
+	else
+		++p.touched;
+
+	recycled = true;
+
+	return texture(p.id, width, height, bpp, slot);
+}
+
+void texture_pool::give_back(const texture &tex)
+{
+	if (tex.id == 0)
+		return;
+
+	if (tex.slot < 0)
+	{
+		delete_.push_back(tex.id);
+		delete_bytes_ += (std::size_t)tex.width * tex.height * (tex.bpp / 8);
+		return;
+	}
+
+	page &p = pages_[tex.slot / slots_per_page_];
+
+	/* Страница могла быть удалена вместе с тайлами (clear) */
+	if (p.id != tex.id)
+		return;
+
+	--p.used;
+	p.free.push_back(tex.slot);
+}
+
+std::size_t texture_pool::flush()
+{
+	/* Пустые страницы - кроме одной запасной на формат */
+	bool spare[formats_count] = {false, false, false};
+
+	for (std::size_t i = 0; i < pages_.size(); ++i)
+	{
+		page &p = pages_[i];
+
+		if (p.id == 0 || p.used != 0)
+			continue;
+
+		int index = format_index(p.bpp);
+		if (!spare[index])
+			spare[index] = true;
+		else
+			delete_page(i);
+	}
+
+	if (delete_.empty())
+		return 0;
+
+	glDeleteTextures((GLsizei)delete_.size(), &delete_[0]);
+	delete_.clear();
+
+	/* Место в атласе видеопамять не возвращает - только
+		удалённые страницы и отдельные текстуры */
+	std::size_t freed = delete_bytes_;
+	freed_bytes_ += freed;
+	delete_bytes_ = 0;
+
+	return freed;
+}
+
+void texture_pool::clear()
+{
+	for (std::size_t i = 0; i < pages_.size(); ++i)
+		if (pages_[i].id != 0)
+			delete_page(i);
+
+	delete_.insert(delete_.end(), names_.begin(), names_.end());
+	names_.clear();
+
+	if (!delete_.empty())
+	{
+		glDeleteTextures((GLsizei)delete_.size(), &delete_[0]);
+		delete_.clear();
+	}
+
+	freed_bytes_ += delete_bytes_;
+	delete_bytes_ = 0;
+}
+
+void texture_pool::slot_offset(int slot, int &x, int &y) const
+{
+	int i = slot % slots_per_page_;
+	x = (i % slots_per_side_) * size_;
+	y = (i / slots_per_side_) * size_;
+}
+
+std::size_t texture_pool::free_count() const
+{
+	std::size_t count = 0;
+	for (std::size_t i = 0; i < pages_.size(); ++i)
+		count += pages_[i].free.size();
+	return count;
+}
+
+std::size_t texture_pool::pages_count() const
+{
+	std::size_t count = 0;
+	for (std::size_t i = 0; i < pages_.size(); ++i)
+		if (pages_[i].id != 0)
+			++count;
+	return count;
+}
+
+std::size_t texture_pool::pages_bytes() const
+{
+	std::size_t bytes = 0;
+	for (std::size_t i = 0; i < pages_.size(); ++i)
+		if (pages_[i].id != 0)
+			bytes += page_bytes(pages_[i].bpp);
+	return bytes;
+}
+
+} /* namespace cartographer */
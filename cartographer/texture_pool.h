@@ -0,0 +1,139 @@
+﻿#ifndef CARTOGRAPHER_TEXTURE_POOL_H
+#define CARTOGRAPHER_TEXTURE_POOL_H
+
+#include "config.h" /* Обязательно первым */
+
+#include <cstddef> /* std::size_t */
+#include <vector>
+
+#include <GL/gl.h> /* OpenGL */
+
+namespace cartographer
+{
+
+/*
+	Пул текстур тайлов. Тайлы живут не в отдельных текстурах,
+	а в местах (slot) больших текстур-страниц атласа (2048x2048 -
+	64 тайла 256x256), по странице на формат пикселей. Освободившееся
+	место достаётся новому тайлу - тот загружает пиксели через
+	glTexSubImage2D, без выделения видеопамяти драйвером. А карта
+	рисуется не по вызову на тайл, а по вызову на страницу.
+	Текстуры других размеров (спрайты, шрифты) - отдельные, в пуле
+	не задерживаются и удаляются пачками.
+
+	GL_TEXTURE_2D_ARRAY без шейдеров не выбрать, поэтому - атлас.
+	Все функции - только в потоке OpenGL
+*/
+class texture_pool
+{
+public:
+	/* Текстура и её формат */
+	struct texture
+	{
+		GLuint id;
+		int width;
+		int height;
+		int bpp;
+		int slot; /* Место в атласе (-1 - отдельная текстура) */
+
+		texture()
+			: id(0), width(0), height(0), bpp(0), slot(-1) {}
+
+		texture(GLuint id, int width, int height, int bpp, int slot = -1)
+			: id(id), width(width), height(height), bpp(bpp), slot(slot) {}
+	};
+
+	texture_pool(int size = 256, int page_size = 2048);
+
+	/* Заблаговременное создание страниц под count тайлов формата bpp */
+	void reserve(std::size_t count, int bpp);
+
+	/* Текстура для изображения. recycled - память под неё уже выделена
+		(место в атласе), загружать - glTexSubImage2D со смещением
+		из slot_offset(). Место берётся в самой заполненной странице,
+		чтобы остальные быстрее пустели и могли быть удалены */
+	texture take(int width, int height, int bpp, bool &recycled);
+
+	/* Возврат текстуры (места в атласе) */
+	void give_back(const texture &tex);
+
+	/* Удаление накопившихся лишних текстур и пустых
+		страниц (кроме одной запасной на формат). Возвращает,
+		сколько видеопамяти (в байтах) действительно освободилось */
+	std::size_t flush();
+
+	/* Удаление всего */
+	void clear();
+
+	/* Положение места в странице (в пикселях) */
+	void slot_offset(int slot, int &x, int &y) const;
+
+	inline int page_size() const
+		{ return page_size_; }
+
+	inline int tile_size() const
+		{ return size_; }
+
+	/* Свободных мест в атласе */
+	std::size_t free_count() const;
+
+	/* Страниц в атласе */
+	std::size_t pages_count() const;
+
+	/* Видеопамять, занятая страницами атласа (в байтах) */
+	std::size_t pages_bytes() const;
+
+	/* Всего освобождено видеопамяти (в байтах) */
+	inline unsigned long long freed_bytes() const
+		{ return freed_bytes_; }
+
+	inline long created() const
+		{ return created_; }
+
+	/* Мест атласа, отданных повторно (после другого тайла) */
+	inline long recycled() const
+		{ return recycled_; }
+
+	/* Формат текстуры OpenGL по формату пикселей:
+		32 - RGBA, 24 - RGB8, 16 - RGB565 */
+	static void gl_format(int bpp, GLint &internal_format,
+		GLenum &format, GLenum &type);
+
+	/* Параметры текстуры (фильтрация, края) - для новых текстур */
+	static void set_params();
+
+private:
+	enum {formats_count = 3};
+
+	struct page
+	{
+		GLuint id; /* 0 - страница удалена, номер свободен */
+		int bpp;
+		int used; /* Занято мест */
+		int touched; /* Мест, хоть раз отданных тайлам */
+		std::vector<int> free; /* Свободные места (новые - в начале) */
+	};
+
+	int size_;
+	int page_size_; /* Уточняется по GL_MAX_TEXTURE_SIZE */
+	int slots_per_side_;
+	int slots_per_page_;
+	std::vector<page> pages_;
+	std::vector<GLuint> names_; /* Созданные, но не использованные имена */
+	std::vector<GLuint> delete_; /* Ожидающие удаления */
+	std::size_t delete_bytes_; /* ... занимаемая ими видеопамять */
+	unsigned long long freed_bytes_;
+	long created_;
+	long recycled_;
+
+	static int format_index(int bpp);
+	std::size_t page_bytes(int bpp) const;
+	std::size_t free_slots(int bpp) const;
+	GLuint new_name();
+	int add_page(int bpp); /* Номер новой страницы (-1 - ошибка) */
+	void delete_page(std::size_t index);
+};
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_TEXTURE_POOL_H */
@@ -0,0 +1,1063 @@
+﻿#include "tile_store.h"
+
+#include <algorithm> /* std::sort */
+#include <cstring> /* std::memcmp, std::memcpy */
+#include <cwchar> /* std::wcstol */
+#include <utility> /* std::pair */
+
+#include <boost/static_assert.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread/thread.hpp> /* boost::this_thread::sleep */
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace cartographer
+{
+
+namespace fs = boost::filesystem;
+
+/* Обход каталогов - для Boost.Filesystem обеих версий */
+#if defined(BOOST_FILESYSTEM_VERSION) && BOOST_FILESYSTEM_VERSION >= 3
+	typedef fs::directory_iterator dir_iterator;
+	static inline std::wstring leaf_of(const fs::path &p)
+		{ return p.filename().wstring(); }
+	static inline std::wstring string_of(const fs::path &p)
+		{ return p.wstring(); }
+#else
+	typedef fs::wdirectory_iterator dir_iterator;
+	static inline std::wstring leaf_of(const fs::wpath &p)
+		{ return p.leaf(); }
+	static inline std::wstring string_of(const fs::wpath &p)
+		{ return p.string(); }
+#endif
+
+/* Заголовок обоих файлов */
+struct store_file_header
+{
+	char magic[4];
+	boost::uint32_t version;
+	boost::uint64_t reserved;
+};
+
+static const char data_magic[4] = {'C', 'T', 'D', 'T'};
+static const char index_magic[4] = {'C', 'T', 'I', 'X'};
+static const boost::uint32_t store_version = 1;
+
+/* Записи больше - признак испорченного файла */
+static const boost::uint32_t max_record_size = 16 * 1024 * 1024;
+
+/* Журнал обращений: не больше записей */
+static const std::size_t max_accessed = 64 * 1024;
+
+/* Сжатие: мусора не меньше (и не меньше четверти файла) */
+static const boost::uint64_t min_compact_garbage = 8 * 1024 * 1024;
+
+/* Очередь на запись: больше - пишет тот, кто ставит в очередь */
+static const std::size_t max_pending_bytes = 4 * 1024 * 1024;
+
+/* ... копирование порциями по ... с паузой между ними */
+static const std::size_t compact_chunk = 1024 * 1024;
+static const int compact_pause_ms = 5;
+
+tile_store::stats& tile_store::stats::operator+=(const stats &other)
+{
+	tiles += other.tiles;
+	live_bytes += other.live_bytes;
+	file_bytes += other.file_bytes;
+	hits += other.hits;
+	misses += other.misses;
+	evicted += other.evicted;
+	compactions += other.compactions;
+	pending_bytes += other.pending_bytes;
+	return *this;
+}
+
+tile_store::tile_store()
+	: MY_MUTEX_DEF(index_mutex_,true)
+	, MY_MUTEX_DEF(write_mutex_,true)
+	, live_bytes_(0)
+	, data_end_(0)
+	, index_end_(0)
+	, compact_min_(min_compact_garbage)
+	, last_tick_(0)
+	, MY_MUTEX_DEF(access_mutex_,true)
+	, MY_MUTEX_DEF(pending_mutex_,true)
+	, pending_bytes_(0)
+	, hits_(0)
+	, misses_(0)
+	, evicted_(0)
+	, compactions_(0)
+{
+	/* Размеры записей - часть формата файлов */
+	BOOST_STATIC_ASSERT(sizeof(store_file_header) == 16);
+	BOOST_STATIC_ASSERT(sizeof(record_header) == 16);
+	BOOST_STATIC_ASSERT(sizeof(index_entry) == 24);
+}
+
+boost::uint64_t tile_store::key_of(const tile::id &id)
+{
+	/* z - 6 бит, x и y - по 29 (z до 29 включительно) */
+	return ((boost::uint64_t)id.z << 58)
+		| ((boost::uint64_t)(boost::uint32_t)id.x << 29)
+		| (boost::uint64_t)(boost::uint32_t)id.y;
+}
+
+void tile_store::open(const std::wstring &path)
+{
+	unique_lock<mutex> l1(write_mutex_);
+	unique_lock<shared_mutex> l2(index_mutex_);
+
+	path_ = path;
+	index_.clear();
+	live_bytes_ = 0;
+
+	if (!data_.open(path + L".tiles"))
+		throw my::exception(L"Ошибка открытия хранилища тайлов")
+			<< my::param(L"file", path + L".tiles");
+
+	if (!index_file_.open(path + L".index"))
+		throw my::exception(L"Ошибка открытия индекса хранилища тайлов")
+			<< my::param(L"file", path + L".index");
+
+	/* Файл данных: новый - пишем заголовок,
+		чужой или испорченный - не трогаем */
+	store_file_header header;
+	data_end_ = data_.size();
+
+	if (data_end_ == 0)
+	{
+		std::memcpy(header.magic, data_magic, 4);
+		header.version = store_version;
+		header.reserved = 0;
+
+		if (!data_.write_at(&header, sizeof(header), 0))
+			throw my::exception(L"Ошибка записи в хранилище тайлов")
+				<< my::param(L"file", path + L".tiles");
+
+		data_end_ = sizeof(header);
+	}
+	else if ( !data_.read_at(&header, sizeof(header), 0)
+		|| std::memcmp(header.magic, data_magic, 4) != 0
+		|| header.version != store_version )
+	{
+		throw my::exception(L"Неизвестный формат хранилища тайлов")
+			<< my::param(L"file", path + L".tiles");
+	}
+
+	load_index();
+}
+
+tile_store::~tile_store()
+{
+	try
+	{
+		flush();
+	}
+	catch (...)
+	{
+	}
+}
+
+void tile_store::close()
+{
+	flush();
+
+	unique_lock<mutex> l1(write_mutex_);
+	unique_lock<shared_mutex> l2(index_mutex_);
+
+	index_.clear();
+	live_bytes_ = 0;
+	data_.close();
+	index_file_.close();
+	data_end_ = 0;
+	index_end_ = 0;
+}
+
+void tile_store::load_index()
+{
+	store_file_header header;
+	boost::uint64_t index_size = index_file_.size();
+
+	/* Индекса нет или он испорчен - строим заново по данным */
+	if ( index_size < sizeof(header)
+		|| !index_file_.read_at(&header, sizeof(header), 0)
+		|| std::memcmp(header.magic, index_magic, 4) != 0
+		|| header.version != store_version )
+	{
+		std::memcpy(header.magic, index_magic, 4);
+		header.version = store_version;
+		header.reserved = 0;
+
+		if ( !index_file_.truncate(0)
+			|| !index_file_.write_at(&header, sizeof(header), 0) )
+		{
+			throw my::exception(L"Ошибка записи индекса хранилища тайлов")
+				<< my::param(L"file", path_ + L".index");
+		}
+
+		index_end_ = sizeof(header);
+		scan_data(sizeof(header));
+		return;
+	}
+
+	/* Читаем индекс пачками. Конец данных - по последней записи */
+	boost::uint64_t data_size = data_end_;
+	boost::uint64_t indexed_end = sizeof(header);
+	std::vector<index_entry> entries(4096);
+
+	index_end_ = sizeof(header);
+
+	while (index_end_ + sizeof(index_entry) <= index_size)
+	{
+		std::size_t n = (std::size_t)((index_size - index_end_) / sizeof(index_entry));
+		if (n > entries.size())
+			n = entries.size();
+
+		if (!index_file_.read_at(&entries[0], n * sizeof(index_entry), index_end_))
+			break;
+
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			const index_entry &e = entries[i];
+			boost::uint64_t end = e.offset + sizeof(record_header) + e.size;
+
+			/* Запись ссылается за конец данных - индекс дальше не верим */
+			if (e.offset < sizeof(header) || e.size > max_record_size || end > data_size)
+			{
+				index_size = index_end_;
+				break;
+			}
+
+			location loc;
+			loc.offset = e.offset;
+			loc.size = e.size;
+			loc.flags = e.flags;
+			loc.access = 0;
+			set_location(e.key, loc);
+
+			if (end > indexed_end)
+				indexed_end = end;
+
+			index_end_ += sizeof(index_entry);
+		}
+	}
+
+	/* Недописанный хвост индекса отрезаем */
+	if (index_file_.size() != index_end_)
+		index_file_.truncate(index_end_);
+
+	/* Данные, не попавшие в индекс */
+	scan_data(indexed_end);
+}
+
+void tile_store::scan_data(boost::uint64_t offset)
+{
+	const boost::uint64_t data_size = data_end_;
+
+	while (offset + sizeof(record_header) <= data_size)
+	{
+		record_header rec;
+
+		if (!data_.read_at(&rec, sizeof(rec), offset)
+			|| rec.size > max_record_size
+			|| offset + sizeof(rec) + rec.size > data_size)
+		{
+			break;
+		}
+
+		location loc;
+		loc.offset = offset;
+		loc.size = rec.size;
+		loc.flags = rec.flags;
+		loc.access = 0;
+
+		set_location(rec.key, loc);
+		append_index(rec.key, loc);
+
+		offset += sizeof(rec) + rec.size;
+	}
+
+	/* Недописанную запись (сбой при записи) отрезаем */
+	if (offset < data_size)
+		data_.truncate(offset);
+
+	data_end_ = offset;
+}
+
+void tile_store::set_location(boost::uint64_t key, const location &loc)
+{
+	std::pair<index_map::iterator, bool> res
+		= index_.insert( std::make_pair(key, loc) );
+
+	/* Старая запись стала мусором */
+	if (!res.second)
+	{
+		live_bytes_ -= sizeof(record_header) + res.first->second.size;
+		res.first->second = loc;
+	}
+
+	live_bytes_ += sizeof(record_header) + loc.size;
+}
+
+void tile_store::append_index(boost::uint64_t key, const location &loc)
+{
+	index_entry e;
+	e.key = key;
+	e.offset = loc.offset;
+	e.size = loc.size;
+	e.flags = loc.flags;
+
+	/* Индекс восстанавливается по данным, поэтому ошибку записи
+		в него не считаем ошибкой записи тайла */
+	if (index_file_.write_at(&e, sizeof(e), index_end_))
+		index_end_ += sizeof(e);
+}
+
+void tile_store::count_lookup(result res)
+{
+	if (res == absent)
+		++misses_;
+	else
+		++hits_;
+}
+
+bool tile_store::find_pending(boost::uint64_t key, result &res, std::string *data)
+{
+	unique_lock<mutex> lock(pending_mutex_);
+
+	const pending_record *rec = 0;
+
+	pending_map::iterator iter = pending_keys_.find(key);
+	if (iter != pending_keys_.end())
+		rec = &pending_[iter->second];
+	else
+	{
+		iter = flushing_keys_.find(key);
+		if (iter != flushing_keys_.end())
+			rec = &flushing_[iter->second];
+	}
+
+	if (!rec)
+		return false;
+
+	res = (rec->flags & flag_missing) ? missing : found;
+
+	if (data && res == found)
+		*data = rec->data;
+
+	return true;
+}
+
+tile_store::result tile_store::lookup(boost::uint64_t key)
+{
+	result res;
+
+	/* Записанные тайлы покидают очередь только после попадания
+		в индекс - между ними тайл не "пропадёт" */
+	if (find_pending(key, res, 0))
+		return res;
+
+	shared_lock<shared_mutex> lock(index_mutex_);
+
+	index_map::iterator iter = index_.find(key);
+
+	if (iter == index_.end())
+		return absent;
+
+	return (iter->second.flags & flag_missing) ? missing : found;
+}
+
+tile_store::result tile_store::find(const tile::id &id)
+{
+	result res = lookup( key_of(id) );
+
+	/* Найденный тайл будет прочитан - его учтёт read() */
+	if (res != found)
+		count_lookup(res);
+
+	return res;
+}
+
+tile_store::result tile_store::read(const tile::id &id, std::string &data)
+{
+	const boost::uint64_t key = key_of(id);
+	result res;
+
+	if (find_pending(key, res, &data))
+	{
+		count_lookup(res);
+		return res;
+	}
+
+	{
+		/* Блокировка - на всё чтение: сжатие подменяет файл */
+		shared_lock<shared_mutex> lock(index_mutex_);
+
+		index_map::iterator iter = index_.find(key);
+
+		if (iter == index_.end())
+		{
+			count_lookup(absent);
+			return absent;
+		}
+
+		const location &loc = iter->second;
+
+		if (loc.flags & flag_missing)
+		{
+			count_lookup(missing);
+			return missing;
+		}
+
+		data.resize(loc.size);
+
+		if (loc.size && !data_.read_at(&data[0], loc.size,
+			loc.offset + sizeof(record_header)))
+		{
+			data.clear();
+			count_lookup(absent);
+			return absent;
+		}
+	}
+
+	count_lookup(found);
+	log_access(key);
+
+	return found;
+}
+
+void tile_store::touch_key(const tile::id &id)
+{
+	log_access( key_of(id) );
+}
+
+void tile_store::log_access(boost::uint64_t key)
+{
+	unique_lock<mutex> lock(access_mutex_);
+	if (accessed_.size() < max_accessed)
+		accessed_.push_back(key);
+}
+
+void tile_store::append(const pending_list &records)
+{
+	/* write_mutex_ - у вызывающего */
+
+	if (!data_.is_open())
+		throw my::exception(L"Хранилище тайлов не открыто");
+
+	/* Заголовки и данные всех записей - одним обращением к диску */
+	std::size_t total = 0;
+	for (pending_list::const_iterator it = records.begin();
+		it != records.end(); ++it)
+	{
+		total += sizeof(record_header) + it->data.size();
+	}
+
+	std::vector<char> buf(total);
+	std::vector<index_entry> entries(records.size());
+	std::size_t pos = 0;
+
+	for (std::size_t i = 0; i < records.size(); ++i)
+	{
+		const pending_record &r = records[i];
+
+		record_header *rec = (record_header*)&buf[pos];
+		rec->key = r.key;
+		rec->size = (boost::uint32_t)r.data.size();
+		rec->flags = r.flags;
+
+		if (!r.data.empty())
+			std::memcpy(&buf[pos + sizeof(record_header)], r.data.c_str(), r.data.size());
+
+		index_entry &e = entries[i];
+		e.key = r.key;
+		e.offset = data_end_ + pos;
+		e.size = rec->size;
+		e.flags = r.flags;
+
+		pos += sizeof(record_header) + r.data.size();
+	}
+
+	if (!data_.write_at(&buf[0], buf.size(), data_end_))
+	{
+		/* Запись могла лечь частично - отрезаем */
+		data_.truncate(data_end_);
+		throw my::exception(L"Ошибка записи в хранилище тайлов")
+			<< my::param(L"file", path_ + L".tiles");
+	}
+
+	data_end_ += buf.size();
+
+	/* Индекс восстанавливается по данным, поэтому ошибку записи
+		в него не считаем ошибкой записи тайлов */
+	if (index_file_.write_at(&entries[0],
+		entries.size() * sizeof(index_entry), index_end_))
+	{
+		index_end_ += entries.size() * sizeof(index_entry);
+	}
+
+	/* В индексе в памяти - только полностью записанные тайлы.
+		Только что загруженные тайлы - самые "свежие" */
+	unique_lock<shared_mutex> l(index_mutex_);
+
+	for (std::size_t i = 0; i < entries.size(); ++i)
+	{
+		location loc;
+		loc.offset = entries[i].offset;
+		loc.size = entries[i].size;
+		loc.flags = entries[i].flags;
+		loc.access = last_tick_;
+		set_location(entries[i].key, loc);
+	}
+}
+
+void tile_store::enqueue(boost::uint64_t key, const char *data,
+	std::size_t size, boost::uint32_t flags)
+{
+	bool full;
+
+	{
+		unique_lock<mutex> lock(pending_mutex_);
+
+		pending_record *rec;
+		pending_map::iterator iter = pending_keys_.find(key);
+
+		if (iter != pending_keys_.end())
+		{
+			rec = &pending_[iter->second];
+			pending_bytes_ -= sizeof(record_header) + rec->data.size();
+		}
+		else
+		{
+			pending_keys_[key] = pending_.size();
+			pending_.push_back( pending_record() );
+			rec = &pending_.back();
+			rec->key = key;
+		}
+
+		rec->flags = flags;
+		if (size)
+			rec->data.assign(data, size);
+		else
+			rec->data.clear();
+
+		pending_bytes_ += sizeof(record_header) + size;
+		full = (pending_bytes_ >= max_pending_bytes);
+	}
+
+	/* Диск не успевает - пишем сами */
+	if (full)
+		flush();
+}
+
+void tile_store::write(const tile::id &id, const char *data, std::size_t size)
+{
+	enqueue(key_of(id), data, size, 0);
+}
+
+void tile_store::write_missing(const tile::id &id)
+{
+	enqueue(key_of(id), 0, 0, flag_missing);
+}
+
+void tile_store::flush()
+{
+	unique_lock<mutex> lock(write_mutex_);
+
+	{
+		unique_lock<mutex> l(pending_mutex_);
+
+		if (pending_.empty())
+			return;
+
+		flushing_.swap(pending_);
+		flushing_keys_.swap(pending_keys_);
+		pending_bytes_ = 0;
+	}
+
+	try
+	{
+		append(flushing_);
+	}
+	catch (...)
+	{
+		unique_lock<mutex> l(pending_mutex_);
+		flushing_.clear();
+		flushing_keys_.clear();
+		throw;
+	}
+
+	unique_lock<mutex> l(pending_mutex_);
+	flushing_.clear();
+	flushing_keys_.clear();
+}
+
+bool tile_store::pending()
+{
+	unique_lock<mutex> lock(pending_mutex_);
+	return !pending_.empty();
+}
+
+std::size_t tile_store::count()
+{
+	shared_lock<shared_mutex> lock(index_mutex_);
+	return index_.size();
+}
+
+boost::uint64_t tile_store::data_size()
+{
+	unique_lock<mutex> lock(write_mutex_);
+	return data_end_;
+}
+
+tile_store::stats tile_store::get_stats()
+{
+	stats st;
+
+	{
+		unique_lock<mutex> l1(write_mutex_);
+		shared_lock<shared_mutex> l2(index_mutex_);
+
+		st.tiles = index_.size();
+		st.live_bytes = live_bytes_;
+		st.file_bytes = data_end_;
+	}
+
+	st.hits = hits_;
+	st.misses = misses_;
+	st.evicted = evicted_;
+	st.compactions = compactions_;
+
+	{
+		unique_lock<mutex> lock(pending_mutex_);
+		st.pending_bytes = pending_bytes_;
+	}
+
+	return st;
+}
+
+void tile_store::touch(boost::uint32_t tick)
+{
+	std::vector<boost::uint64_t> keys;
+
+	{
+		unique_lock<mutex> lock(access_mutex_);
+		keys.swap(accessed_);
+	}
+
+	unique_lock<shared_mutex> lock(index_mutex_);
+
+	last_tick_ = tick;
+
+	for (std::size_t i = 0; i < keys.size(); ++i)
+	{
+		index_map::iterator iter = index_.find(keys[i]);
+		if (iter != index_.end())
+			iter->second.access = tick;
+	}
+}
+
+void tile_store::get_entries(entries_list &entries)
+{
+	shared_lock<shared_mutex> lock(index_mutex_);
+
+	entries.reserve(entries.size() + index_.size());
+
+	for (index_map::iterator iter = index_.begin();
+		iter != index_.end(); ++iter)
+	{
+		entry e;
+		e.key = iter->first;
+		e.offset = iter->second.offset;
+		e.size = (boost::uint32_t)sizeof(record_header) + iter->second.size;
+		e.access = iter->second.access;
+		entries.push_back(e);
+	}
+}
+
+void tile_store::evict(const entries_list &entries)
+{
+	unique_lock<shared_mutex> lock(index_mutex_);
+
+	for (entries_list::const_iterator it = entries.begin();
+		it != entries.end(); ++it)
+	{
+		index_map::iterator iter = index_.find(it->key);
+
+		/* Тайл перезаписан - он уже не "холодный" */
+		if (iter == index_.end() || iter->second.offset != it->offset)
+			continue;
+
+		live_bytes_ -= sizeof(record_header) + iter->second.size;
+		index_.erase(iter);
+		++evicted_;
+	}
+}
+
+bool tile_store::needs_maintenance()
+{
+	{
+		unique_lock<mutex> lock(access_mutex_);
+		if (accessed_.size() >= max_accessed / 2)
+			return true;
+	}
+
+	return needs_compaction();
+}
+
+bool tile_store::needs_compaction()
+{
+	unique_lock<mutex> l1(write_mutex_);
+	shared_lock<shared_mutex> l2(index_mutex_);
+
+	if (!data_.is_open())
+		return false;
+
+	const boost::uint64_t garbage
+		= data_end_ - sizeof(store_file_header) - live_bytes_;
+
+	return garbage >= compact_min_ && garbage >= data_end_ / 4;
+}
+
+/* Для сжатия: холодные записи - вперёд */
+static bool colder(const tile_store::entry &a, const tile_store::entry &b)
+{
+	return a.access < b.access
+		|| (a.access == b.access && a.offset < b.offset);
+}
+
+void tile_store::create_files(disk_file &data, disk_file &index,
+	const std::wstring &path)
+{
+	store_file_header header;
+	header.version = store_version;
+	header.reserved = 0;
+
+	if (!data.open(path + L".tiles") || !data.truncate(0))
+		throw my::exception(L"Ошибка создания хранилища тайлов")
+			<< my::param(L"file", path + L".tiles");
+
+	std::memcpy(header.magic, data_magic, 4);
+	if (!data.write_at(&header, sizeof(header), 0))
+		throw my::exception(L"Ошибка записи в хранилище тайлов")
+			<< my::param(L"file", path + L".tiles");
+
+	if (!index.open(path + L".index") || !index.truncate(0))
+		throw my::exception(L"Ошибка создания индекса хранилища тайлов")
+			<< my::param(L"file", path + L".index");
+
+	std::memcpy(header.magic, index_magic, 4);
+	if (!index.write_at(&header, sizeof(header), 0))
+		throw my::exception(L"Ошибка записи индекса хранилища тайлов")
+			<< my::param(L"file", path + L".index");
+}
+
+bool tile_store::compact(boost::function<bool ()> cancelled)
+{
+	try
+	{
+		return compact_files(cancelled);
+	}
+	catch (std::exception &)
+	{
+		/* Не получилось (например, не хватило места на диске) -
+			следующая попытка, когда мусора станет вдвое больше */
+		unique_lock<mutex> l1(write_mutex_);
+		shared_lock<shared_mutex> l2(index_mutex_);
+
+		const boost::uint64_t garbage
+			= data_end_ - sizeof(store_file_header) - live_bytes_;
+		compact_min_ = 2 * (garbage > min_compact_garbage ? garbage : min_compact_garbage);
+
+		throw;
+	}
+}
+
+bool tile_store::compact_files(boost::function<bool ()> cancelled)
+{
+	const std::wstring new_path = path_ + L".new";
+
+	/* Очередь - в файл, чтобы сжатие её учло */
+	flush();
+
+	/* Снимок индекса. Файл только дописывается, поэтому записи
+		снимка до конца сжатия остаются на своих местах */
+	entries_list snapshot;
+	boost::uint64_t snapshot_end;
+
+	{
+		unique_lock<mutex> l1(write_mutex_);
+		snapshot_end = data_end_;
+		get_entries(snapshot);
+	}
+
+	std::sort(snapshot.begin(), snapshot.end(), colder);
+
+	disk_file data;
+	disk_file index;
+	create_files(data, index, new_path);
+
+	/* Новые места записей снимка: старое смещение -> новое */
+	typedef boost::unordered_map<boost::uint64_t, boost::uint64_t> moves_map;
+	moves_map moves;
+
+	std::vector<char> buf;
+	std::vector<index_entry> entries;
+	boost::uint64_t end = sizeof(store_file_header);
+	boost::uint64_t buf_offset = end;
+
+	buf.reserve(2 * compact_chunk);
+	entries.reserve(snapshot.size());
+
+	for (entries_list::iterator it = snapshot.begin();
+		it != snapshot.end(); ++it)
+	{
+		std::size_t pos = buf.size();
+		buf.resize(pos + it->size);
+
+		if (!data_.read_at(&buf[pos], it->size, it->offset))
+			throw my::exception(L"Ошибка чтения хранилища тайлов")
+				<< my::param(L"file", path_ + L".tiles");
+
+		const record_header *rec = (const record_header*)&buf[pos];
+
+		index_entry e;
+		e.key = rec->key;
+		e.offset = end;
+		e.size = rec->size;
+		e.flags = rec->flags;
+		entries.push_back(e);
+
+		moves[it->offset] = end;
+		end += it->size;
+
+		/* Порция готова - пишем и даём поработать остальным */
+		if (buf.size() >= compact_chunk)
+		{
+			if (!data.write_at(&buf[0], buf.size(), buf_offset))
+				throw my::exception(L"Ошибка записи в хранилище тайлов")
+					<< my::param(L"file", new_path + L".tiles");
+
+			buf_offset = end;
+			buf.clear();
+
+			if (cancelled())
+				return false;
+
+			boost::this_thread::sleep(
+				boost::posix_time::milliseconds(compact_pause_ms));
+		}
+	}
+
+	/* Подмена файлов. Записи, дописанные за время копирования,
+		копируем под блокировкой - их немного */
+	unique_lock<mutex> l1(write_mutex_);
+
+	if (data_end_ > snapshot_end)
+	{
+		std::size_t pos = buf.size();
+		std::size_t tail = (std::size_t)(data_end_ - snapshot_end);
+		buf.resize(pos + tail);
+
+		if (!data_.read_at(&buf[pos], tail, snapshot_end))
+			throw my::exception(L"Ошибка чтения хранилища тайлов")
+				<< my::param(L"file", path_ + L".tiles");
+	}
+
+	if (!buf.empty() && !data.write_at(&buf[0], buf.size(), buf_offset))
+		throw my::exception(L"Ошибка записи в хранилище тайлов")
+			<< my::param(L"file", new_path + L".tiles");
+
+	const boost::uint64_t tail_offset = end;
+	const boost::uint64_t new_end = end + (data_end_ - snapshot_end);
+
+	unique_lock<shared_mutex> l2(index_mutex_);
+
+	/* Новый индекс: записи снимка - на новых местах (вытесненные
+		и перезаписанные за время копирования в индекс не попадут),
+		дописанные - со сдвигом */
+	index_map new_index;
+	boost::uint64_t new_live = 0;
+	entries.clear();
+
+	for (index_map::iterator iter = index_.begin();
+		iter != index_.end(); ++iter)
+	{
+		location loc = iter->second;
+
+		if (loc.offset >= snapshot_end)
+			loc.offset = tail_offset + (loc.offset - snapshot_end);
+		else
+		{
+			moves_map::iterator m = moves.find(loc.offset);
+			if (m == moves.end())
+				continue; /* Не может быть, но лучше без тайла, чем с чужим */
+			loc.offset = m->second;
+		}
+
+		new_index[iter->first] = loc;
+		new_live += sizeof(record_header) + loc.size;
+
+		index_entry e;
+		e.key = iter->first;
+		e.offset = loc.offset;
+		e.size = loc.size;
+		e.flags = loc.flags;
+		entries.push_back(e);
+	}
+
+	if (!entries.empty() && !index.write_at(&entries[0],
+		entries.size() * sizeof(index_entry), sizeof(store_file_header)))
+	{
+		throw my::exception(L"Ошибка записи индекса хранилища тайлов")
+			<< my::param(L"file", new_path + L".index");
+	}
+
+	data.sync();
+	index.sync();
+	data.close();
+	index.close();
+
+	/* Порядок замены такой, чтобы при сбое на любом шаге индекс
+		не указывал в чужой файл: без индекса он восстановится по данным */
+	data_.close();
+	index_file_.close();
+
+	try
+	{
+		fs::remove(path_ + L".index");
+		fs::remove(path_ + L".tiles");
+		fs::rename(new_path + L".tiles", path_ + L".tiles");
+		fs::rename(new_path + L".index", path_ + L".index");
+	}
+	catch (std::exception &)
+	{
+		/* Открываем то, что осталось (хранилище может оказаться пустым) */
+		l2.unlock();
+		l1.unlock();
+		open(path_);
+		throw;
+	}
+
+	if (!data_.open(path_ + L".tiles") || !index_file_.open(path_ + L".index"))
+		throw my::exception(L"Ошибка открытия хранилища тайлов")
+			<< my::param(L"file", path_ + L".tiles");
+
+	index_.swap(new_index);
+	live_bytes_ = new_live;
+	data_end_ = new_end;
+	index_end_ = sizeof(store_file_header) + entries.size() * sizeof(index_entry);
+	compact_min_ = min_compact_garbage;
+	++compactions_;
+
+	return true;
+}
+
+/* Число после буквы-префикса: "z12" -> 12. false - не то имя */
+static bool parse_name(const std::wstring &name, wchar_t prefix,
+	const std::wstring &ext, int &value)
+{
+	if (name.size() < 2 + ext.size() || name[0] != prefix)
+		return false;
+
+	if (name.compare(name.size() - ext.size(), ext.size(), ext) != 0)
+		return false;
+
+	const wchar_t *begin = name.c_str() + 1;
+	wchar_t *end;
+	long n = std::wcstol(begin, &end, 10);
+
+	if (end == begin || (std::size_t)(end - name.c_str()) != name.size() - ext.size())
+		return false;
+
+	value = (int)n;
+	return true;
+}
+
+std::size_t tile_store::import_tree(const std::wstring &dir, const std::wstring &ext)
+{
+	tile::id id;
+	std::size_t count = import_dir(dir, 0, id, ext);
+	flush();
+	return count;
+}
+
+std::size_t tile_store::import_dir(const std::wstring &dir, int level,
+	tile::id &id, const std::wstring &ext)
+{
+	std::size_t count = 0;
+
+	/* dir/z<z>/<x/1024>/x<x>/<y/1024>/y<y>ext */
+	dir_iterator end;
+	for (dir_iterator iter(dir); iter != end; ++iter)
+	{
+		const std::wstring name = leaf_of(iter->path());
+		const std::wstring path = string_of(iter->path());
+		const bool is_dir = fs::is_directory(iter->status());
+
+		switch (level)
+		{
+			case 0:
+				if (is_dir && parse_name(name, L'z', std::wstring(), id.z))
+					count += import_dir(path, 1, id, ext);
+				break;
+
+			case 2:
+				if (is_dir && parse_name(name, L'x', std::wstring(), id.x))
+					count += import_dir(path, 3, id, ext);
+				break;
+
+			case 1:
+			case 3:
+				if (is_dir)
+					count += import_dir(path, level + 1, id, ext);
+				break;
+
+			case 4:
+				if (is_dir)
+					break;
+
+				if (parse_name(name, L'y', ext, id.y))
+				{
+					if (import_file(path, id, false))
+						++count;
+				}
+				else if (parse_name(name, L'y', L".tne", id.y))
+				{
+					if (import_file(path, id, true))
+						++count;
+				}
+				break;
+		}
+	}
+
+	return count;
+}
+
+bool tile_store::import_file(const std::wstring &filename,
+	const tile::id &id, bool missing)
+{
+	/* Уже есть - новее старого кэша. Не find(): перенос - не загрузка
+		тайла, в статистику не идёт */
+	if (lookup( key_of(id) ) != absent)
+		return false;
+
+	if (missing)
+	{
+		write_missing(id);
+		return true;
+	}
+
+	disk_file file;
+	if (!file.open(filename, true))
+		return false;
+
+	std::vector<char> buf( (std::size_t)file.size() );
+
+	if (buf.empty() || !file.read_at(&buf[0], buf.size(), 0))
+		return false;
+
+	write(id, &buf[0], buf.size());
+	return true;
+}
+
+} /* namespace cartographer */
@@ -0,0 +1,257 @@
+﻿#ifndef CARTOGRAPHER_TILE_STORE_H
+#define CARTOGRAPHER_TILE_STORE_H
+
+#include "config.h" /* Обязательно первым */
+#include "image.h" /* tile::id */
+#include "disk_file.h"
+
+#include <mylib.h> /* mutex, shared_mutex */
+#include <my_ptr.h> /* shared_ptr */
+
+#include <cstddef> /* std::size_t */
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp> /* boost::uint64_t, boost::uint32_t */
+#include <boost/detail/atomic_count.hpp>
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
+
+namespace cartographer
+{
+
+/*
+	Дисковый кэш тайлов одной карты - два файла вместо файла на тайл:
+		path.tiles - данные: тайлы (как их отдал сервер) и метки
+			"тайла нет на сервере", только дописываются в конец;
+		path.index - индекс: ключ тайла -> смещение и размер записи,
+			тоже только дописывается.
+	Индекс целиком держится в памяти, поэтому поиск не трогает диск,
+	а чтение тайла - одно чтение по смещению (pread).
+
+	Каждая запись данных начинается с заголовка с ключом и размером,
+	так что индекс восстанавливается по данным, если он отстал
+	(сбой между записью данных и индекса) или потерян.
+	Запись отложенная: write() ставит тайл в очередь, flush() пишет
+	очередь одним обращением к диску. Тайлы из очереди видны find()
+	и read() сразу. Переполненную очередь (диск не успевает) пишет
+	сам вызвавший write() - так задержка диска доходит до источника.
+
+	Повторная запись тайла добавляет новую запись, старая остаётся
+	мусором в файле. Мусор и вытесненные по квоте тайлы убирает сжатие
+	(compact()) - перезапись живых записей в новый файл.
+	Числа - в порядке байт машины (x86 - little endian).
+
+	Все функции - в любом потоке
+*/
+class tile_store
+{
+public:
+	typedef shared_ptr<tile_store> ptr;
+
+	/* Результат поиска: нет в кэше, есть, нет на сервере */
+	enum result {absent, found, missing};
+
+	/* Статистика */
+	struct stats
+	{
+		std::size_t tiles; /* Записей (тайлов и меток) */
+		boost::uint64_t live_bytes; /* Объём живых записей */
+		boost::uint64_t file_bytes; /* Размер файла данных (с мусором) */
+		long hits; /* Найдено в хранилище */
+		long misses; /* Не найдено */
+		long evicted; /* Вытеснено по квоте */
+		long compactions; /* Сжатий */
+		std::size_t pending_bytes; /* В очереди на запись */
+
+		stats()
+			: tiles(0), live_bytes(0), file_bytes(0)
+			, hits(0), misses(0), evicted(0), compactions(0)
+			, pending_bytes(0) {}
+
+		stats& operator+=(const stats &other);
+	};
+
+	/* Запись индекса - для выбора вытесняемых тайлов */
+	struct entry
+	{
+		boost::uint64_t key;
+		boost::uint64_t offset;
+		boost::uint32_t size; /* Вместе с заголовком */
+		boost::uint32_t access; /* Такт последнего обращения */
+	};
+	typedef std::vector<entry> entries_list;
+
+	tile_store();
+	~tile_store();
+
+	/* Открытие (создание) хранилища. Исключение при ошибке */
+	void open(const std::wstring &path);
+	void close();
+
+	/* Поиск - только в индексе и очереди, без обращения к диску */
+	result find(const tile::id &id);
+
+	/* Чтение тайла - одно обращение к диску (или из очереди).
+		В статистике (hits, misses) каждая загрузка тайла учитывается
+		один раз: найденный тайл - при чтении, остальное - при поиске */
+	result read(const tile::id &id, std::string &data);
+
+	/* Запись тайла и метки "тайла нет на сервере" - в очередь.
+		Повторная запись тайла, ещё не покинувшего очередь, заменяет
+		его там. Исключение при ошибке (если писать пришлось самим) */
+	void write(const tile::id &id, const char *data, std::size_t size);
+	void write_missing(const tile::id &id);
+
+	/* Запись очереди на диск. Исключение при ошибке
+		(тайлы очереди при этом теряются - это всего лишь кэш) */
+	void flush();
+
+	/* Есть ли что записывать */
+	bool pending();
+
+	/* Перенос в хранилище старого кэша - файла на тайл
+		(dir/z<z>/<x/1024>/x<x>/<y/1024>/y<y>ext и метки .tne).
+		Тайлы, которые уже есть в хранилище, не переносятся.
+		Возвращает количество перенесённых файлов */
+	std::size_t import_tree(const std::wstring &dir, const std::wstring &ext);
+
+	/* Записей в индексе (тайлов и меток) */
+	std::size_t count();
+
+	/* Размер файла данных (вместе с мусором) */
+	boost::uint64_t data_size();
+
+	stats get_stats();
+
+
+	/*
+		Обслуживание - в одном (фоновом) потоке
+	*/
+
+	/* Приблизительный LRU: прочитанные тайлы копятся в журнале
+		обращений, touch() отмечает их в индексе тактом tick.
+		Переполненный журнал новые обращения теряет */
+	void touch(boost::uint32_t tick);
+
+	/* Обращение к тайлу без чтения (его пиксели взяты из другого
+		хранилища) - в журнал обращений */
+	void touch_key(const tile::id &id);
+
+	/* Все записи индекса (к концу списка) */
+	void get_entries(entries_list &entries);
+
+	/* Вытеснение: убирает записи из индекса, если их с тех пор
+		не перезаписали. Место в файле освобождает только сжатие,
+		до него после перезапуска тайлы вернутся */
+	void evict(const entries_list &entries);
+
+	/* Требуется ли обслуживание: журнал обращений заполнен
+		наполовину или мусора в файле больше четверти */
+	bool needs_maintenance();
+	bool needs_compaction();
+
+	/* Сжатие: живые записи копируются в новый файл порциями, без
+		блокировок (файл только дописывается, поэтому снимок индекса
+		остаётся верным), с паузами между порциями. Блокируются только
+		дописывание записей, появившихся за время копирования,
+		и подмена файлов. Сначала пишутся давно не читанные тайлы, так
+		что порядок записей хранит LRU и после перезапуска.
+		cancelled() проверяется между порциями. Исключение при ошибке */
+	bool compact(boost::function<bool ()> cancelled);
+
+private:
+	enum {flag_missing = 1};
+
+	/* Заголовок записи в файле данных */
+	struct record_header
+	{
+		boost::uint64_t key;
+		boost::uint32_t size;
+		boost::uint32_t flags;
+	};
+
+	/* Запись файла индекса */
+	struct index_entry
+	{
+		boost::uint64_t key;
+		boost::uint64_t offset; /* Смещение заголовка записи в данных */
+		boost::uint32_t size;
+		boost::uint32_t flags;
+	};
+
+	struct location
+	{
+		boost::uint64_t offset;
+		boost::uint32_t size;
+		boost::uint32_t flags;
+		boost::uint32_t access; /* Такт последнего обращения (только в памяти) */
+	};
+
+	typedef boost::unordered_map<boost::uint64_t, location> index_map;
+
+	/* Тайл в очереди на запись */
+	struct pending_record
+	{
+		boost::uint64_t key;
+		boost::uint32_t flags;
+		std::string data;
+	};
+	typedef std::vector<pending_record> pending_list;
+	typedef boost::unordered_map<boost::uint64_t, std::size_t> pending_map;
+
+	shared_mutex index_mutex_; /* Индекс в памяти и подмена файлов при сжатии */
+	mutex write_mutex_; /* Запись в файлы. Порядок: write_mutex_, index_mutex_ */
+	index_map index_;
+	boost::uint64_t live_bytes_; /* Объём записей индекса (с заголовками) */
+	disk_file data_;
+	disk_file index_file_;
+	boost::uint64_t data_end_;
+	boost::uint64_t index_end_;
+	boost::uint64_t compact_min_; /* Мусора, при котором пора сжимать */
+	boost::uint32_t last_tick_; /* Последний такт touch() */
+	std::wstring path_;
+
+	mutex access_mutex_;
+	std::vector<boost::uint64_t> accessed_; /* Журнал обращений */
+
+	/* Очередь на запись и записываемые сейчас тайлы (ключ -> место
+		в списке). Порядок: write_mutex_, pending_mutex_ */
+	mutex pending_mutex_;
+	pending_list pending_;
+	pending_map pending_keys_;
+	pending_list flushing_;
+	pending_map flushing_keys_;
+	std::size_t pending_bytes_;
+
+	boost::detail::atomic_count hits_;
+	boost::detail::atomic_count misses_;
+	boost::detail::atomic_count evicted_;
+	boost::detail::atomic_count compactions_;
+
+	static boost::uint64_t key_of(const tile::id &id);
+
+	void load_index();
+	void scan_data(boost::uint64_t offset);
+	void set_location(boost::uint64_t key, const location &loc);
+	void create_files(disk_file &data, disk_file &index,
+		const std::wstring &path);
+	bool compact_files(boost::function<bool ()> cancelled);
+	void enqueue(boost::uint64_t key, const char *data,
+		std::size_t size, boost::uint32_t flags);
+	bool find_pending(boost::uint64_t key, result &res, std::string *data);
+	result lookup(boost::uint64_t key); /* find() без статистики */
+	void count_lookup(result res);
+	void log_access(boost::uint64_t key);
+	void append(const pending_list &records);
+	void append_index(boost::uint64_t key, const location &loc);
+
+	std::size_t import_dir(const std::wstring &dir, int level,
+		tile::id &id, const std::wstring &ext);
+	bool import_file(const std::wstring &filename,
+		const tile::id &id, bool missing);
+};
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_TILE_STORE_H */
@@ -0,0 +1,380 @@
+﻿#include "tiles_cache.h"
+
+namespace cartographer
+{
+
+/* Сколько самых старых тайлов шарда просматривается в поисках
+	тайла с текстурой, когда превышен только лимит видеопамяти */
+static const int gpu_evict_window = 8;
+
+tiles_cache::tiles_cache(std::size_t ram_limit, std::size_t gpu_limit,
+	std::size_t shards_count)
+	: ram_limit_(ram_limit)
+	, gpu_limit_(gpu_limit)
+	, ram_(0)
+	, gpu_(0)
+	, size_(0)
+	, clock_(0)
+	, evicted_(0)
+	, MY_MUTEX_DEF(evict_mutex_,false)
+{
+	if (shards_count == 0)
+		shards_count = 1;
+
+	for (std::size_t i = 0; i < shards_count; ++i)
+		shards_.push_back(new shard);
+}
+
+tiles_cache::~tiles_cache()
+{
+	clear();
+}
+
+tile::ptr tiles_cache::find(const tile::id &tile_id)
+{
+	shard &sh = shard_for(tile_id);
+	shared_lock<shared_mutex> lock(sh.mutex);
+
+	entries_list::iterator iter = sh.entries.find(tile_id);
+
+	return iter == sh.entries.end() ? tile::ptr() : iter->second.ptr;
+}
+
+int tiles_cache::format_of(int bpp)
+{
+	switch (bpp)
+	{
+		case 32: return format_rgba;
+		case 24: return format_rgb;
+		case 16: return format_rgb565;
+	}
+	return -1;
+}
+
+void tiles_cache::account(shard &sh, lru_item &item, const tile::ptr &tile_ptr)
+{
+	const std::size_t old_ram = item.ram;
+	const std::size_t old_gpu = item.gpu;
+
+	sh.ram -= item.ram;
+	sh.gpu -= item.gpu;
+	if (item.pinned)
+	{
+		sh.pinned_ram -= item.ram;
+		sh.pinned_gpu -= item.gpu;
+	}
+	if (item.format >= 0)
+	{
+		sh.format_ram[item.format] -= item.ram - tile_overhead;
+		sh.format_gpu[item.format] -= item.gpu;
+	}
+
+	item.ram = tile_overhead + (tile_ptr ? tile_ptr->ram_size() : 0);
+	item.gpu = tile_ptr ? tile_ptr->gpu_size() : 0;
+	item.format = tile_ptr ? format_of(tile_ptr->bpp()) : -1;
+
+	sh.ram += item.ram;
+	sh.gpu += item.gpu;
+	if (item.pinned)
+	{
+		sh.pinned_ram += item.ram;
+		sh.pinned_gpu += item.gpu;
+	}
+	if (item.format >= 0)
+	{
+		sh.format_ram[item.format] += item.ram - tile_overhead;
+		sh.format_gpu[item.format] += item.gpu;
+	}
+
+	/* Разность - по модулю, уменьшение тоже сложение */
+	add_usage(item.ram - old_ram, item.gpu - old_gpu);
+}
+
+void tiles_cache::add_usage(std::size_t ram_delta, std::size_t gpu_delta)
+{
+	if (ram_delta)
+		ram_.fetch_add(ram_delta, boost::memory_order_relaxed);
+	if (gpu_delta)
+		gpu_.fetch_add(gpu_delta, boost::memory_order_relaxed);
+}
+
+void tiles_cache::set_pinned(shard &sh, entry &e, bool pinned)
+{
+	lru_item &item = *e.lru_iter;
+
+	if (item.pinned == pinned)
+		return;
+
+	item.pinned = pinned;
+
+	if (pinned)
+	{
+		sh.pinned_ram += item.ram;
+		sh.pinned_gpu += item.gpu;
+		sh.pinned.splice(sh.pinned.begin(), sh.lru, e.lru_iter);
+	}
+	else
+	{
+		/* Открепляемые тайлы только что были на экране,
+			поэтому ставим их в начало списка */
+		sh.pinned_ram -= item.ram;
+		sh.pinned_gpu -= item.gpu;
+		sh.lru.splice(sh.lru.begin(), sh.pinned, e.lru_iter);
+	}
+}
+
+void tiles_cache::set_pinned(const tile::id &tile_id, bool pinned)
+{
+	{
+		shard &sh = shard_for(tile_id);
+		unique_lock<shared_mutex> lock(sh.mutex);
+
+		entries_list::iterator iter = sh.entries.find(tile_id);
+		if (iter == sh.entries.end())
+			return;
+
+		set_pinned(sh, iter->second, pinned);
+	}
+
+	/* Открепление могло вернуть кэш к вытеснению */
+	if (!pinned && over_limits())
+		evict();
+}
+
+void tiles_cache::pin(const tile::id &tile_id)
+{
+	set_pinned(tile_id, true);
+}
+
+void tiles_cache::unpin(const tile::id &tile_id)
+{
+	set_pinned(tile_id, false);
+}
+
+void tiles_cache::insert(const tile::id &tile_id, const tile::ptr &tile_ptr,
+	bool pinned)
+{
+	/* Заменяемый тайл удаляем уже после снятия блокировки */
+	tile::ptr old_ptr;
+
+	{
+		shard &sh = shard_for(tile_id);
+		unique_lock<shared_mutex> lock(sh.mutex);
+
+		const long stamp = ++clock_;
+		entries_list::iterator iter = sh.entries.find(tile_id);
+
+		if (iter != sh.entries.end())
+		{
+			entry &e = iter->second;
+			old_ptr = e.ptr;
+			e.ptr = tile_ptr;
+			e.lru_iter->stamp = stamp;
+			set_pinned(sh, e, pinned);
+
+			lru_list &list = pinned ? sh.pinned : sh.lru;
+			list.splice(list.begin(), list, e.lru_iter);
+
+			account(sh, *e.lru_iter, tile_ptr);
+		}
+		else
+		{
+			lru_list &list = pinned ? sh.pinned : sh.lru;
+			entry &e = sh.entries[tile_id];
+			e.ptr = tile_ptr;
+			list.push_front( lru_item(tile_id, stamp, pinned) );
+			e.lru_iter = list.begin();
+			account(sh, *e.lru_iter, tile_ptr);
+			++size_;
+		}
+	}
+
+	if (over_limits())
+		evict();
+}
+
+void tiles_cache::update(const tile::id &tile_id)
+{
+	{
+		shard &sh = shard_for(tile_id);
+		unique_lock<shared_mutex> lock(sh.mutex);
+
+		entries_list::iterator iter = sh.entries.find(tile_id);
+
+		/* Тайл мог быть уже вытеснен */
+		if (iter == sh.entries.end())
+			return;
+
+		account(sh, *iter->second.lru_iter, iter->second.ptr);
+	}
+
+	if (over_limits())
+		evict();
+}
+
+void tiles_cache::clear()
+{
+	for (std::size_t i = 0; i < shards_.size(); ++i)
+	{
+		shard &sh = shards_[i];
+		entries_list entries;
+
+		{
+			unique_lock<shared_mutex> lock(sh.mutex);
+
+			std::size_t count = sh.entries.size();
+			add_usage(0 - sh.ram, 0 - sh.gpu);
+			sh.entries.swap(entries);
+			sh.lru.clear();
+			sh.pinned.clear();
+			sh.ram = 0;
+			sh.gpu = 0;
+			sh.pinned_ram = 0;
+			sh.pinned_gpu = 0;
+			sh.reset_formats();
+
+			while (count--)
+				--size_;
+		}
+
+		/* Тайлы удаляются здесь - вне блокировки */
+	}
+}
+
+void tiles_cache::get_usage(std::size_t *p_ram, std::size_t *p_gpu)
+{
+	if (p_ram)
+		*p_ram = ram_.load(boost::memory_order_relaxed);
+	if (p_gpu)
+		*p_gpu = gpu_.load(boost::memory_order_relaxed);
+}
+
+tiles_cache::stats tiles_cache::get_stats()
+{
+	stats st;
+
+	for (std::size_t i = 0; i < shards_.size(); ++i)
+	{
+		shard &sh = shards_[i];
+		shared_lock<shared_mutex> lock(sh.mutex);
+
+		st.count += sh.entries.size();
+		st.pinned_count += sh.pinned.size();
+		st.ram += sh.ram;
+		st.gpu += sh.gpu;
+		st.pinned_ram += sh.pinned_ram;
+		st.pinned_gpu += sh.pinned_gpu;
+
+		for (int f = 0; f < formats_count; ++f)
+		{
+			st.format_ram[f] += sh.format_ram[f];
+			st.format_gpu[f] += sh.format_gpu[f];
+		}
+	}
+
+	st.ram_overshoot = st.ram > ram_limit_ ? st.ram - ram_limit_ : 0;
+	st.gpu_overshoot = st.gpu > gpu_limit_ ? st.gpu - gpu_limit_ : 0;
+	st.evicted = (std::size_t)(long)evicted_;
+
+	return st;
+}
+
+bool tiles_cache::over_limits()
+{
+	return ram_.load(boost::memory_order_relaxed) > ram_limit_
+		|| gpu_.load(boost::memory_order_relaxed) > gpu_limit_;
+}
+
+void tiles_cache::evict()
+{
+	/* Вытеснением занимается только один поток, иначе
+		несколько потоков вытеснят больше необходимого */
+	unique_lock<mutex> evict_lock(evict_mutex_);
+
+	while (true)
+	{
+		std::size_t ram, gpu;
+		get_usage(&ram, &gpu);
+
+		const bool ram_over = ram > ram_limit_;
+		const bool gpu_over = gpu > gpu_limit_;
+
+		if (!ram_over && !gpu_over)
+			break;
+
+		/* Ищем шард с самым старым тайлом. Если превышен только лимит
+			видеопамяти, тайлы без текстур пропускаем - их вытеснение
+			ничего не даст. Закреплённые тайлы в lru не попадают.
+			Если вытеснять нечего - кэш растёт сверх лимитов */
+		shard *oldest = 0;
+		long oldest_stamp = 0;
+
+		for (std::size_t i = 0; i < shards_.size(); ++i)
+		{
+			shard &sh = shards_[i];
+			shared_lock<shared_mutex> lock(sh.mutex);
+
+			lru_list::reverse_iterator iter = sh.lru.rbegin();
+
+			for (int n = 0; iter != sh.lru.rend(); ++iter)
+			{
+				if (ram_over || iter->gpu)
+					break;
+				if (++n == gpu_evict_window)
+				{
+					iter = sh.lru.rend();
+					break;
+				}
+			}
+
+			if (iter != sh.lru.rend()
+				&& (!oldest || iter->stamp < oldest_stamp))
+			{
+				oldest = &sh;
+				oldest_stamp = iter->stamp;
+			}
+		}
+
+		if (!oldest)
+			break;
+
+		tile::ptr victim;
+
+		{
+			unique_lock<shared_mutex> lock(oldest->mutex);
+
+			/* Пока мы искали, шард мог измениться - ищем заново,
+				вытеснение всё равно приблизительное */
+			lru_list::reverse_iterator iter = oldest->lru.rbegin();
+
+			while (iter != oldest->lru.rend() && !ram_over && !iter->gpu)
+				++iter;
+
+			if (iter == oldest->lru.rend())
+				continue;
+
+			lru_list::iterator lru_iter = --iter.base();
+			entries_list::iterator entry_iter
+				= oldest->entries.find(lru_iter->id);
+
+			oldest->ram -= lru_iter->ram;
+			oldest->gpu -= lru_iter->gpu;
+			add_usage(0 - lru_iter->ram, 0 - lru_iter->gpu);
+			if (lru_iter->format >= 0)
+			{
+				oldest->format_ram[lru_iter->format] -= lru_iter->ram - tile_overhead;
+				oldest->format_gpu[lru_iter->format] -= lru_iter->gpu;
+			}
+
+			victim = entry_iter->second.ptr;
+			oldest->entries.erase(entry_iter);
+			oldest->lru.erase(lru_iter);
+			--size_;
+			++evicted_;
+		}
+
+		/* victim удаляется здесь - вне блокировки шарда */
+	}
+}
+
+} /* namespace cartographer */
@@ -0,0 +1,198 @@
+﻿#ifndef CARTOGRAPHER_TILES_CACHE_H
+#define CARTOGRAPHER_TILES_CACHE_H
+
+#include "config.h" /* Обязательно первым */
+#include "image.h" /* tile */
+
+#include <mylib.h>
+
+#include <cstddef> /* std::size_t */
+#include <list>
+
+#include <boost/unordered_map.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/atomic.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+namespace cartographer
+{
+
+/*
+	Кэш тайлов, разбитый на шарды по hash_value(tile::id).
+	У каждого шарда своя блокировка и свой список MRU, поэтому
+	отрисовка и загрузчики не мешают друг другу, обращаясь к разным
+	тайлам. Вытеснение - общее для всего кэша, приблизительное:
+	из всех шардов выбирается тот, чей самый старый тайл старше прочих.
+
+	Размер кэша ограничивается не количеством тайлов, а памятью:
+	отдельно ОЗУ (декодированные пиксели) и видеопамять (текстуры).
+
+	Тайлы активной пирамиды закрепляются и не вытесняются. Если они
+	не умещаются в лимиты, кэш временно растёт, а превышение
+	отражается в статистике
+*/
+class tiles_cache
+{
+public:
+	/* Накладные расходы на один тайл в ОЗУ, помимо пикселей */
+	static const std::size_t tile_overhead = 256;
+
+	/* Форматы пикселей тайлов (см. image::bpp()) */
+	enum {format_rgba, format_rgb, format_rgb565, formats_count};
+
+	/* Статистика кэша */
+	struct stats
+	{
+		std::size_t count; /* Всего тайлов */
+		std::size_t pinned_count; /* Из них закреплённых */
+		std::size_t ram; /* Расход памяти (в байтах) */
+		std::size_t gpu;
+		std::size_t pinned_ram; /* ... закреплёнными тайлами */
+		std::size_t pinned_gpu;
+		std::size_t ram_overshoot; /* Превышение лимитов (в байтах) */
+		std::size_t gpu_overshoot;
+		std::size_t evicted; /* Всего вытеснено тайлов */
+		/* Расход памяти пикселями по форматам (без накладных расходов) */
+		std::size_t format_ram[formats_count];
+		std::size_t format_gpu[formats_count];
+
+		stats()
+			: count(0), pinned_count(0)
+			, ram(0), gpu(0)
+			, pinned_ram(0), pinned_gpu(0)
+			, ram_overshoot(0), gpu_overshoot(0)
+			, evicted(0)
+		{
+			for (int i = 0; i < formats_count; ++i)
+				format_ram[i] = format_gpu[i] = 0;
+		}
+	};
+
+	/* Формат по bpp; -1 - пикселей ещё нет */
+	static int format_of(int bpp);
+
+	tiles_cache(std::size_t ram_limit, std::size_t gpu_limit,
+		std::size_t shards_count = 16);
+	~tiles_cache();
+
+	/* Поиск тайла (только поиск! Порядок вытеснения не меняется) */
+	tile::ptr find(const tile::id &tile_id);
+
+	/* Добавление тайла. Если тайл уже есть - он заменяется
+		и становится самым "свежим" */
+	void insert(const tile::id &tile_id, const tile::ptr &tile_ptr,
+		bool pinned = false);
+
+	/* Закрепление/открепление тайлов. Закреплённые тайлы не вытесняются */
+	void pin(const tile::id &tile_id);
+	void unpin(const tile::id &tile_id);
+
+	/* Пересчёт занимаемой тайлом памяти - после загрузки
+		пикселей или после выгрузки их в текстуру */
+	void update(const tile::id &tile_id);
+
+	void clear();
+
+	/* Текущий расход памяти (в байтах). Без блокировок */
+	void get_usage(std::size_t *p_ram, std::size_t *p_gpu);
+
+	stats get_stats();
+
+	inline std::size_t size() const
+		{ return (std::size_t)(long)size_; }
+
+	inline std::size_t ram_limit() const
+		{ return ram_limit_; }
+
+	inline std::size_t gpu_limit() const
+		{ return gpu_limit_; }
+
+private:
+	struct lru_item
+	{
+		tile::id id;
+		long stamp; /* "Время" последнего обращения */
+		std::size_t ram; /* Учтённая в кэше память */
+		std::size_t gpu;
+		int format;
+		bool pinned;
+
+		lru_item(const tile::id &id, long stamp, bool pinned)
+			: id(id), stamp(stamp), ram(0), gpu(0), format(-1), pinned(pinned) {}
+	};
+
+	/* Начало списка - самые свежие. Закреплённые тайлы хранятся
+		в отдельном списке, поэтому хвост lru всегда можно вытеснять */
+	typedef std::list<lru_item> lru_list;
+
+	struct entry
+	{
+		tile::ptr ptr;
+		lru_list::iterator lru_iter;
+	};
+
+	typedef boost::unordered_map<tile::id, entry> entries_list;
+
+	struct shard
+	{
+		shared_mutex mutex;
+		entries_list entries;
+		lru_list lru;
+		lru_list pinned;
+		std::size_t ram;
+		std::size_t gpu;
+		std::size_t pinned_ram;
+		std::size_t pinned_gpu;
+		std::size_t format_ram[formats_count];
+		std::size_t format_gpu[formats_count];
+
+		shard()
+			: MY_MUTEX_DEF(mutex,false)
+			, ram(0)
+			, gpu(0)
+			, pinned_ram(0)
+			, pinned_gpu(0)
+		{
+			reset_formats();
+		}
+
+		void reset_formats()
+		{
+			for (int i = 0; i < formats_count; ++i)
+				format_ram[i] = format_gpu[i] = 0;
+		}
+	};
+
+	std::size_t ram_limit_;
+	std::size_t gpu_limit_;
+	boost::ptr_vector<shard> shards_;
+	/* Общий расход памяти - сумма по шардам, но без их блокировок:
+		лимиты проверяются при каждом изменении кэша */
+	boost::atomic<std::size_t> ram_;
+	boost::atomic<std::size_t> gpu_;
+	boost::detail::atomic_count size_;
+	boost::detail::atomic_count clock_;
+	boost::detail::atomic_count evicted_;
+	mutex evict_mutex_;
+
+	inline shard& shard_for(const tile::id &tile_id)
+		{ return shards_[ hash_value(tile_id) % shards_.size() ]; }
+
+	/* Учёт памяти тайла (вызывается под блокировкой шарда) */
+	void account(shard &sh, lru_item &item, const tile::ptr &tile_ptr);
+
+	/* Перенос тайла между списками (вызывается под блокировкой шарда) */
+	static void set_pinned(shard &sh, entry &e, bool pinned);
+	void set_pinned(const tile::id &tile_id, bool pinned);
+
+	/* Изменение общего расхода памяти */
+	void add_usage(std::size_t ram_delta, std::size_t gpu_delta);
+
+	/* Вытеснение самых старых тайлов при превышении лимитов */
+	bool over_limits();
+	void evict();
+};
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_TILES_CACHE_H */
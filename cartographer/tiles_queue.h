@@ -0,0 +1,216 @@
+﻿#ifndef CARTOGRAPHER_TILES_QUEUE_H
+#define CARTOGRAPHER_TILES_QUEUE_H
+
+#include "config.h" /* Обязательно первым */
+#include "image.h" /* tile */
+
+#include <mylib.h>
+
+#include <cstddef> /* std::size_t */
+#include <map>
+
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
+
+namespace cartographer
+{
+
+/*
+	Очередь тайлов на загрузку. Тайлы выдаются в порядке приоритета,
+	повторное добавление тайла лишь меняет его приоритет
+*/
+class tiles_queue
+{
+public:
+	/* Приоритет загрузки: чем меньше, тем раньше */
+	struct priority
+	{
+		int level; /* Удалённость слоя от видимого (0 - видимый слой) */
+		double distance; /* Расстояние от центра экрана (в тайлах слоя) */
+		int z; /* При прочих равных - сначала более крупные (верхние) слои */
+
+		priority()
+			: level(0), distance(0.0), z(0) {}
+
+		priority(int level, double distance, int z)
+			: level(level), distance(distance), z(z) {}
+
+		inline bool operator<(const priority &other) const
+		{
+			if (level != other.level)
+				return level < other.level;
+			if (distance != other.distance)
+				return distance < other.distance;
+			return z < other.z;
+		}
+	};
+
+	/* Элемент очереди. Запоминает поколение пирамиды, для которого
+		тайл был поставлен в очередь */
+	struct item
+	{
+		tile::id id;
+		tile::ptr ptr;
+		priority prio;
+		unsigned int epoch;
+		int retries; /* Повторных запросов к серверу */
+
+		item()
+			: epoch(0), retries(0) {}
+
+		item(const tile::id &id, const tile::ptr &ptr, const priority &prio)
+			: id(id), ptr(ptr), prio(prio)
+			, epoch(ptr ? ptr->epoch() : 0), retries(0) {}
+
+		/* Тайл покинул пирамиду (и, возможно, вошёл в неё заново)
+			после постановки в очередь - загружать его не для кого */
+		inline bool stale() const
+			{ return !ptr || ptr->epoch() != epoch; }
+	};
+
+	tiles_queue()
+		: MY_MUTEX_DEF(mutex_,true)
+		, counter_(0) {}
+
+	/* Добавление тайла (или изменение приоритета уже имеющегося) */
+	void push(const tile::id &tile_id, const tile::ptr &tile_ptr,
+		const priority &prio)
+	{
+		push( item(tile_id, tile_ptr, prio) );
+	}
+
+	/* Возврат извлечённого тайла в очередь (с его поколением
+		и счётчиком повторов) */
+	void push(const item &it)
+	{
+		unique_lock<mutex> lock(mutex_);
+
+		index_list::iterator iter = index_.find(it.id);
+		if (iter != index_.end())
+			items_.erase(iter->second);
+
+		index_[it.id] = items_.insert( std::make_pair(
+			key(it.prio, ++counter_), it) ).first;
+	}
+
+	/* Извлечение тайла с наивысшим приоритетом */
+	bool pop(item &it)
+	{
+		unique_lock<mutex> lock(mutex_);
+
+		if (items_.empty())
+			return false;
+
+		items_list::iterator first = items_.begin();
+		it = first->second;
+		index_.erase(it.id);
+		items_.erase(first);
+
+		return true;
+	}
+
+	/* Извлечение тайла с наивысшим приоритетом, но только
+		если он относится к указанному слою (для пакетных запросов) */
+	bool pop_layer(item &it, int map_id, int z)
+	{
+		unique_lock<mutex> lock(mutex_);
+
+		if (items_.empty())
+			return false;
+
+		items_list::iterator first = items_.begin();
+		if (first->second.id.map_id != map_id || first->second.id.z != z)
+			return false;
+
+		it = first->second;
+		index_.erase(it.id);
+		items_.erase(first);
+
+		return true;
+	}
+
+	/* Пересчёт приоритетов всех тайлов очереди (сменился видимый
+		слой или центр). Порядок тайлов с равными приоритетами -
+		прежний */
+	void reprioritize(const boost::function<priority (const tile::id&)> &prio_of)
+	{
+		unique_lock<mutex> lock(mutex_);
+
+		items_list items;
+
+		for (items_list::iterator iter = items_.begin();
+			iter != items_.end(); ++iter)
+		{
+			item it = iter->second;
+			it.prio = prio_of(it.id);
+			index_[it.id] = items.insert( std::make_pair(
+				key(it.prio, iter->first.n), it) ).first;
+		}
+
+		items_.swap(items);
+	}
+
+	/* Удаление тайла из очереди */
+	bool erase(const tile::id &tile_id)
+	{
+		unique_lock<mutex> lock(mutex_);
+
+		index_list::iterator iter = index_.find(tile_id);
+		if (iter == index_.end())
+			return false;
+
+		items_.erase(iter->second);
+		index_.erase(iter);
+
+		return true;
+	}
+
+	void clear()
+	{
+		unique_lock<mutex> lock(mutex_);
+		items_.clear();
+		index_.clear();
+	}
+
+	std::size_t size()
+	{
+		unique_lock<mutex> lock(mutex_);
+		return items_.size();
+	}
+
+	inline bool empty()
+		{ return size() == 0; }
+
+private:
+	/* Ключ упорядочивания: приоритет + порядковый номер добавления
+		(при равных приоритетах - в порядке поступления) */
+	struct key
+	{
+		priority prio;
+		unsigned int n;
+
+		key(const priority &prio, unsigned int n)
+			: prio(prio), n(n) {}
+
+		inline bool operator<(const key &other) const
+		{
+			if (prio < other.prio)
+				return true;
+			if (other.prio < prio)
+				return false;
+			return n < other.n;
+		}
+	};
+
+	typedef std::map<key, item> items_list;
+	typedef boost::unordered_map<tile::id, items_list::iterator> index_list;
+
+	mutex mutex_;
+	unsigned int counter_;
+	items_list items_;
+	index_list index_;
+};
+
+} /* namespace cartographer */
+
+#endif /* CARTOGRAPHER_TILES_QUEUE_H */